@@ -0,0 +1,296 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * CPU topology and thread affinity.
+ */
+#include "affinity.h"
+
+#include <errno.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/* node directories looked for in sysfs */
+#define AFFINITY_MAX_NODES 1024
+/* longest CPU list a spec may give */
+#define AFFINITY_MAX_LIST 4096
+
+struct cpu_topology {
+    int ncpus;
+    int nnodes;
+    /* per CPU: its node, -1 if offline */
+    int *node_of;
+    /* per CPU: its first SMT sibling, itself if it has none */
+    int *core_first;
+};
+
+/*
+ * Parses a CPU list such as "0-3,8,10-11" into cpus, in order. Returns
+ * how many, or -1 if it's malformed or longer than max.
+ */
+static int parse_cpulist(const char *list, int *cpus, const int max) {
+    const char *p = list;
+    char *end;
+    long first, last, cpu;
+    int n = 0;
+
+    while (*p != '\0' && *p != '\n') {
+        first = strtol(p, &end, 10);
+        if (end == p || first < 0)
+            return -1;
+        last = first;
+        p = end;
+        if (*p == '-') {
+            last = strtol(p + 1, &end, 10);
+            if (end == p + 1 || last < first)
+                return -1;
+            p = end;
+        }
+        for (cpu = first; cpu <= last; cpu++) {
+            if (n == max)
+                return -1;
+            cpus[n++] = (int)cpu;
+        }
+        if (*p == ',')
+            p++;
+        else if (*p != '\0' && *p != '\n')
+            return -1;
+    }
+    return n;
+}
+
+/* the first line of a sysfs file; -1 if it can't be read */
+static int read_line(const char *path, char *buf, const size_t size) {
+    FILE *fp = fopen(path, "r");
+    bool ok;
+
+    if (fp == NULL)
+        return -1;
+    ok = fgets(buf, (int)size, fp) != NULL;
+    fclose(fp);
+    return ok ? 0 : -1;
+}
+
+cpu_topology *topology_load(void) {
+    cpu_topology *t = (cpu_topology *)calloc(1, sizeof(cpu_topology));
+    long configured = sysconf(_SC_NPROCESSORS_CONF);
+    int max, *list = NULL, n = -1, i, node;
+    char path[128], buf[4096];
+
+    if (t == NULL)
+        return NULL;
+    max = configured > 0 ? (int)configured : 1;
+    list = (int *)malloc(max * sizeof(int));
+    t->node_of = (int *)malloc(max * sizeof(int));
+    t->core_first = (int *)malloc(max * sizeof(int));
+    if (list == NULL || t->node_of == NULL || t->core_first == NULL) {
+        free(list);
+        topology_free(t);
+        return NULL;
+    }
+    for (i = 0; i < max; i++) {
+        t->node_of[i] = -1;
+        t->core_first[i] = i;
+    }
+
+    if (read_line("/sys/devices/system/cpu/online", buf, sizeof(buf)) == 0)
+        n = parse_cpulist(buf, list, max);
+    if (n <= 0) {
+        long online = sysconf(_SC_NPROCESSORS_ONLN);
+        n = online > 0 && online <= max ? (int)online : 1;
+        for (i = 0; i < n; i++)
+            list[i] = i;
+    }
+    for (i = 0; i < n; i++) {
+        if (list[i] >= max)
+            continue;
+        t->node_of[list[i]] = 0;
+        if (list[i] >= t->ncpus)
+            t->ncpus = list[i] + 1;
+    }
+    t->nnodes = 1;
+
+    for (node = 0; node < AFFINITY_MAX_NODES; node++) {
+        snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+        if (read_line(path, buf, sizeof(buf)) != 0)
+            continue;
+        n = parse_cpulist(buf, list, max);
+        for (i = 0; i < n; i++)
+            if (list[i] < t->ncpus && t->node_of[list[i]] >= 0)
+                t->node_of[list[i]] = node;
+        if (node >= t->nnodes)
+            t->nnodes = node + 1;
+    }
+
+    for (i = 0; i < t->ncpus; i++) {
+        if (t->node_of[i] < 0)
+            continue;
+        snprintf(path, sizeof(path),
+                 "/sys/devices/system/cpu/cpu%d/topology/thread_siblings_list", i);
+        if (read_line(path, buf, sizeof(buf)) == 0 &&
+            parse_cpulist(buf, list, max) > 0 && list[0] < t->ncpus)
+            t->core_first[i] = list[0];
+    }
+    free(list);
+    return t;
+}
+
+void topology_free(cpu_topology *t) {
+    if (t == NULL)
+        return;
+    free(t->node_of);
+    free(t->core_first);
+    free(t);
+}
+
+int topology_cpus(const cpu_topology *t) {
+    return t->ncpus;
+}
+
+int topology_nodes(const cpu_topology *t) {
+    return t->nnodes;
+}
+
+int topology_node_of(const cpu_topology *t, const int cpu) {
+    if (cpu < 0 || cpu >= t->ncpus)
+        return -1;
+    return t->node_of[cpu];
+}
+
+/*
+ * The online CPUs in "auto" order: a CPU from each node in turn, and in
+ * each node the first sibling of every core before the other siblings.
+ * Returns how many, or -1 if no memory.
+ */
+static int auto_order(const cpu_topology *t, int *order) {
+    int *rank = (int *)malloc(t->ncpus * sizeof(int));
+    int *next = (int *)calloc(t->nnodes, sizeof(int));
+    int pass, cpu, node, round, n = 0, added = 1;
+
+    if (rank == NULL || next == NULL) {
+        free(rank);
+        free(next);
+        return -1;
+    }
+    /* where each CPU comes in its node's own order */
+    for (pass = 0; pass < 2; pass++)
+        for (cpu = 0; cpu < t->ncpus; cpu++)
+            if (t->node_of[cpu] >= 0 && (t->core_first[cpu] == cpu) == (pass == 0))
+                rank[cpu] = next[t->node_of[cpu]]++;
+    for (round = 0; added; round++) {
+        added = 0;
+        for (node = 0; node < t->nnodes; node++)
+            for (cpu = 0; cpu < t->ncpus; cpu++)
+                if (t->node_of[cpu] == node && rank[cpu] == round) {
+                    order[n++] = cpu;
+                    added = 1;
+                }
+    }
+    free(rank);
+    free(next);
+    return n;
+}
+
+int affinity_plan(const cpu_topology *t, const char *spec, const int nthreads,
+                  int *cpus) {
+    int *list, n, i;
+
+    if (spec == NULL || strcmp(spec, "none") == 0) {
+        for (i = 0; i < nthreads; i++)
+            cpus[i] = -1;
+        return 0;
+    }
+    /* room for a spec's list or every CPU */
+    list = (int *)malloc((AFFINITY_MAX_LIST > t->ncpus ? AFFINITY_MAX_LIST : t->ncpus) *
+                         sizeof(int));
+    if (list == NULL) {
+        fprintf(stderr, "Failed to allocate the CPU list\n");
+        return -1;
+    }
+    if (strcmp(spec, "auto") == 0) {
+        if ((n = auto_order(t, list)) < 0) {
+            fprintf(stderr, "Failed to allocate the CPU list\n");
+            free(list);
+            return -1;
+        }
+    } else {
+        n = parse_cpulist(spec, list, AFFINITY_MAX_LIST);
+        if (n <= 0) {
+            fprintf(stderr, "Bad CPU list \"%s\"\n", spec);
+            free(list);
+            return -1;
+        }
+        for (i = 0; i < n; i++) {
+            if (topology_node_of(t, list[i]) < 0) {
+                fprintf(stderr, "CPU %d is not online\n", list[i]);
+                free(list);
+                return -1;
+            }
+        }
+    }
+    for (i = 0; i < nthreads; i++)
+        cpus[i] = n > 0 ? list[i % n] : -1;
+    free(list);
+    return 0;
+}
+
+int affinity_set_attr(pthread_attr_t *attr, const int cpu) {
+#if defined(__linux__) && defined(CPU_SET)
+    cpu_set_t set;
+    int ret;
+
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if ((ret = pthread_attr_setaffinity_np(attr, sizeof(set), &set)) != 0) {
+        errno = ret;
+        return -1;
+    }
+    return 0;
+#else
+    (void)attr;
+    (void)cpu;
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+/* "0-3,8" */
+static void print_cpulist(FILE *out, const cpu_topology *t, const int node) {
+    int cpu, first = -1;
+    bool any = false;
+
+    for (cpu = 0; cpu <= t->ncpus; cpu++) {
+        if (cpu < t->ncpus && t->node_of[cpu] == node) {
+            if (first < 0)
+                first = cpu;
+            continue;
+        }
+        if (first < 0)
+            continue;
+        fprintf(out, "%s%d", any ? "," : "", first);
+        if (cpu - 1 > first)
+            fprintf(out, "-%d", cpu - 1);
+        any = true;
+        first = -1;
+    }
+}
+
+void affinity_report(FILE *out, const cpu_topology *t, const int nthreads,
+                     const int *cpus) {
+    int node, i;
+
+    fprintf(out, "CPU topology: %d node%s, %d CPU%s\n", t->nnodes,
+            t->nnodes == 1 ? "" : "s", t->ncpus, t->ncpus == 1 ? "" : "s");
+    for (node = 0; node < t->nnodes; node++) {
+        fprintf(out, "  node %d: CPUs ", node);
+        print_cpulist(out, t, node);
+        fprintf(out, "\n");
+    }
+    for (i = 0; i < nthreads; i++) {
+        if (cpus[i] < 0)
+            fprintf(out, "  worker %d: not pinned\n", i);
+        else
+            fprintf(out, "  worker %d: CPU %d, node %d\n", i, cpus[i],
+                    topology_node_of(t, cpus[i]));
+    }
+}
@@ -0,0 +1,52 @@
+#ifndef AFFINITY_H
+#define AFFINITY_H
+
+#include <stdio.h>
+#include <pthread.h>
+
+/*
+  CPU and NUMA placement of worker threads.
+
+  The topology comes from sysfs on Linux: the online CPUs, the NUMA node
+  each is on and its SMT siblings. A machine without node information is
+  one node. Elsewhere it is sysconf()'s CPUs on one node, and pinning
+  isn't supported.
+
+  An affinity spec is "none", "auto" or a CPU list such as "0-3,8,10-11".
+  A list is taken in order, thread i on the (i mod n)th CPU. "auto"
+  spreads the threads over the nodes in turn, and within a node gives each
+  physical core one thread before doubling up on its SMT siblings.
+
+  Pin a thread before it allocates anything. Linux places a page on the
+  node of the thread that first touches it, and glibc gives each thread
+  its own malloc arena, so whatever a pinned thread allocates and
+  initializes itself is on its own node.
+ */
+
+typedef struct cpu_topology cpu_topology;
+
+/* NULL if no memory */
+cpu_topology *topology_load(void);
+void topology_free(cpu_topology *t);
+/* the highest online CPU + 1 */
+int topology_cpus(const cpu_topology *t);
+int topology_nodes(const cpu_topology *t);
+/* -1 if cpu isn't online */
+int topology_node_of(const cpu_topology *t, const int cpu);
+
+/*
+ * Fills cpus[nthreads] with the CPU each thread goes on, -1 for any.
+ * Returns 0, or -1 after printing why the spec is no good.
+ */
+int affinity_plan(const cpu_topology *t, const char *spec, const int nthreads,
+                  int *cpus);
+/*
+ * Makes threads created with attr start on cpu, so that even their stacks
+ * are local. Returns 0, or -1 with errno set.
+ */
+int affinity_set_attr(pthread_attr_t *attr, const int cpu);
+/* the topology, and the CPU and node of each thread, to out */
+void affinity_report(FILE *out, const cpu_topology *t, const int nthreads,
+                     const int *cpus);
+
+#endif
@@ -0,0 +1,231 @@
+#ifndef BASICHASHTABLE_H
+#define BASICHASHTABLE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "main.h"
+#include "portable.h"
+#include "hash.h"
+#include "times33hash.h"
+
+/*
+  Chained hashtable over keys of any char type, so that wide keys (CJK
+  S_WCHAR keys, say) are stored as they are instead of being re-encoded
+  to bytes on every lookup.
+
+  Hasher is any type with a static S_UINT32 hash(const CharT *key,
+  S_UINT nkey), nkey counted in chars: Times33Hash for S_CHAR and
+  S_WCHAR, or Lookup3Hasher for the bytes of any width. The hash and the
+  key compare are both fixed at compile time; nothing looks at the char
+  width at run time.
+
+  Expands the way HashTable does without a maintenance thread: a new
+  table twice the size, then BASIC_HASH_BULK_MOVE old buckets migrated on
+  every insert and remove until the old one is empty. That logic is a
+  copy of HashTable's, not shared with it; see the note on struct node in
+  hashtable.h before changing either. None of HashTable's striping, TTL
+  or eviction is here. Not synchronized: callers serialize access. Nodes
+  stay the caller's.
+ */
+
+#define BASIC_HASH_BULK_MOVE 1
+
+template <typename CharT>
+struct basic_node {
+    basic_node *h_next;
+    S_UINT32 hv;                /* set on insert */
+    S_UINT nkey;                /* in chars */
+    const CharT *key;
+    S_UINT32 nvalue;
+    S_CHAR *value;
+};
+
+/* Jenkins lookup3, hash() in hash.c, over the bytes of the key */
+struct Lookup3Hasher {
+    template <typename CharT>
+    static S_UINT32 hash(const CharT *key, const S_UINT nkey) {
+        return ::hash(key, nkey * sizeof(CharT), 0);
+    }
+};
+
+template <typename CharT, typename Hasher = Times33Hash>
+class BasicHashTable {
+public:
+    typedef basic_node<CharT> node_type;
+
+    explicit BasicHashTable(const int hashpower_init = 0);
+    ~BasicHashTable();
+
+    S_UINT32 hash_key(const CharT *key, const S_UINT nkey) const {
+        return Hasher::hash(key, nkey);
+    }
+    node_type *find(const CharT *key, const S_UINT nkey) {
+        return find(key, nkey, hash_key(key, nkey));
+    }
+    int insert(node_type *it) {
+        return insert(it, hash_key(it->key, it->nkey));
+    }
+    void remove(const CharT *key, const S_UINT nkey) {
+        remove(key, nkey, hash_key(key, nkey));
+    }
+
+    node_type *find(const CharT *key, const S_UINT nkey, const S_UINT32 hv);
+    /* the key must not be in the table already */
+    int insert(node_type *it, const S_UINT32 hv);
+    void remove(const CharT *key, const S_UINT nkey, const S_UINT32 hv);
+
+    unsigned int power(void) const { return hashpower; }
+    S_UINT items(void) const { return hash_items; }
+    bool is_expanding(void) const { return expanding; }
+
+private:
+    static S_UINT32 buckets(const unsigned int power) {
+        return (S_UINT32)1 << power;
+    }
+    static bool key_matches(const node_type *it, const CharT *key,
+                            const S_UINT nkey, const S_UINT32 hv) {
+        return hv == it->hv && nkey == it->nkey &&
+            memcmp(key, it->key, nkey * sizeof(CharT)) == 0;
+    }
+    node_type **bucket_for(const S_UINT32 hv);
+    node_type **before(const CharT *key, const S_UINT nkey, const S_UINT32 hv);
+    void expand(void);
+    void expand_move(void);
+
+    /* not copyable */
+    BasicHashTable(const BasicHashTable &);
+    BasicHashTable &operator=(const BasicHashTable &);
+
+    unsigned int hashpower;
+    node_type **primary_hashtable;
+    /* during expansion, the buckets not migrated yet */
+    node_type **old_hashtable;
+    S_UINT hash_items;
+    bool expanding;
+    /* old buckets below this have been migrated */
+    S_UINT32 expand_bucket;
+};
+
+template <typename CharT, typename Hasher>
+BasicHashTable<CharT, Hasher>::BasicHashTable(const int hashpower_init)
+    : hashpower(hashpower_init ? hashpower_init : HASHPOWER_DEFAULT),
+      primary_hashtable(0),
+      old_hashtable(0),
+      hash_items(0),
+      expanding(false),
+      expand_bucket(0) {
+    primary_hashtable = (node_type **)calloc(buckets(hashpower), sizeof(void *));
+    if (! primary_hashtable) {
+        fprintf(stderr, "Failed to init hashtable.\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+template <typename CharT, typename Hasher>
+BasicHashTable<CharT, Hasher>::~BasicHashTable() {
+    if (expanding)
+        free(old_hashtable);
+    free(primary_hashtable);
+}
+
+template <typename CharT, typename Hasher>
+basic_node<CharT> **BasicHashTable<CharT, Hasher>::bucket_for(const S_UINT32 hv) {
+    S_UINT32 oldbucket;
+
+    if (expanding &&
+        (oldbucket = (hv & (buckets(hashpower - 1) - 1))) >= expand_bucket)
+        return &old_hashtable[oldbucket];
+    return &primary_hashtable[hv & (buckets(hashpower) - 1)];
+}
+
+template <typename CharT, typename Hasher>
+basic_node<CharT> **BasicHashTable<CharT, Hasher>::before(const CharT *key,
+                                                          const S_UINT nkey,
+                                                          const S_UINT32 hv) {
+    node_type **pos = bucket_for(hv);
+
+    while (*pos && ! key_matches(*pos, key, nkey, hv))
+        pos = &(*pos)->h_next;
+    return pos;
+}
+
+template <typename CharT, typename Hasher>
+basic_node<CharT> *BasicHashTable<CharT, Hasher>::find(const CharT *key,
+                                                       const S_UINT nkey,
+                                                       const S_UINT32 hv) {
+    return *before(key, nkey, hv);
+}
+
+template <typename CharT, typename Hasher>
+int BasicHashTable<CharT, Hasher>::insert(node_type *it, const S_UINT32 hv) {
+    node_type **head = bucket_for(hv);
+
+    it->hv = hv;
+    it->h_next = *head;
+    *head = it;
+    hash_items++;
+    if (! expanding && hash_items > (buckets(hashpower) * 3) / 2)
+        expand();
+    else if (expanding)
+        expand_move();
+    return 1;
+}
+
+template <typename CharT, typename Hasher>
+void BasicHashTable<CharT, Hasher>::remove(const CharT *key, const S_UINT nkey,
+                                           const S_UINT32 hv) {
+    node_type **pos = before(key, nkey, hv);
+    node_type *it = *pos;
+
+    if (! it)
+        return;
+    *pos = it->h_next;
+    it->h_next = 0;
+    hash_items--;
+    if (expanding)
+        expand_move();
+}
+
+/* grows the hashtable to twice its current size */
+template <typename CharT, typename Hasher>
+void BasicHashTable<CharT, Hasher>::expand(void) {
+    node_type **table = (node_type **)calloc(buckets(hashpower + 1), sizeof(void *));
+
+    if (! table) {
+        /* Bad news, but we can keep running. */
+        fprintf(stderr, "Hash table expansion failed\n");
+        return;
+    }
+    old_hashtable = primary_hashtable;
+    primary_hashtable = table;
+    hashpower++;
+    expanding = true;
+    expand_bucket = 0;
+}
+
+/* migrates up to BASIC_HASH_BULK_MOVE old buckets to the primary */
+template <typename CharT, typename Hasher>
+void BasicHashTable<CharT, Hasher>::expand_move(void) {
+    node_type *it, *next;
+    S_UINT32 bucket;
+    int i;
+
+    for (i = 0; i < BASIC_HASH_BULK_MOVE && expanding; i++) {
+        for (it = old_hashtable[expand_bucket]; it; it = next) {
+            next = it->h_next;
+            bucket = it->hv & (buckets(hashpower) - 1);
+            it->h_next = primary_hashtable[bucket];
+            primary_hashtable[bucket] = it;
+        }
+        old_hashtable[expand_bucket] = 0;
+        expand_bucket++;
+        if (expand_bucket == buckets(hashpower - 1)) {
+            expanding = false;
+            free(old_hashtable);
+            old_hashtable = 0;
+        }
+    }
+}
+
+#endif
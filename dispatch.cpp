@@ -0,0 +1,180 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * Connection dispatch policies.
+ */
+#include "dispatch.h"
+#include "hash.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define CACHE_LINE 64
+
+/* a line each, as the workers update their own */
+struct dispatch_counters {
+    volatile S_UINT32 conns;
+    volatile S_UINT32 load;
+    char pad[CACHE_LINE - 2 * sizeof(S_UINT32)];
+};
+
+struct dispatcher {
+    enum dispatch_policy policy;
+    int nthreads;
+    /* the dispatcher's alone */
+    int last_thread;
+    S_UINT32 random;
+    struct dispatch_counters *counters;
+};
+
+static const char *const policy_names[] = {
+    "round-robin",
+    "least-conns",
+    "two-choices",
+    "peer-hash"
+};
+
+dispatcher *dispatcher_create(const int nthreads, const enum dispatch_policy policy) {
+    dispatcher *d = (dispatcher *)calloc(1, sizeof(dispatcher));
+
+    if (d == NULL)
+        return NULL;
+    d->counters = (struct dispatch_counters *)calloc(nthreads, sizeof(struct dispatch_counters));
+    if (d->counters == NULL) {
+        free(d);
+        return NULL;
+    }
+    d->policy = policy;
+    d->nthreads = nthreads;
+    d->last_thread = -1;
+    d->random = 2463534242U;
+    return d;
+}
+
+void dispatcher_free(dispatcher *d) {
+    if (d == NULL)
+        return;
+    free(d->counters);
+    free(d);
+}
+
+enum dispatch_policy dispatcher_policy(const dispatcher *d) {
+    return d->policy;
+}
+
+/* xorshift32 */
+static S_UINT32 next_random(dispatcher *d) {
+    S_UINT32 x = d->random;
+
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return d->random = x;
+}
+
+static S_UINT32 conns_of(const dispatcher *d, const int tid) {
+    return __atomic_load_n(&d->counters[tid].conns, __ATOMIC_RELAXED);
+}
+
+static S_UINT32 load_of(const dispatcher *d, const int tid) {
+    return __atomic_load_n(&d->counters[tid].load, __ATOMIC_RELAXED);
+}
+
+static int round_robin(dispatcher *d) {
+    d->last_thread = (d->last_thread + 1) % d->nthreads;
+    return d->last_thread;
+}
+
+/* the first of the least, starting after the last pick so ties rotate */
+static int least_conns(dispatcher *d) {
+    int i, tid, best = -1;
+    S_UINT32 conns, best_conns = 0;
+
+    for (i = 1; i <= d->nthreads; i++) {
+        tid = (d->last_thread + i) % d->nthreads;
+        conns = conns_of(d, tid);
+        if (best < 0 || conns < best_conns) {
+            best = tid;
+            best_conns = conns;
+        }
+    }
+    d->last_thread = best;
+    return best;
+}
+
+static int two_choices(dispatcher *d) {
+    int a, b;
+    S_UINT32 load_a, load_b;
+
+    if (d->nthreads < 2)
+        return 0;
+    a = next_random(d) % d->nthreads;
+    b = next_random(d) % (d->nthreads - 1);
+    if (b >= a)
+        b++;
+    load_a = load_of(d, a);
+    load_b = load_of(d, b);
+    if (load_a != load_b)
+        return load_a < load_b ? a : b;
+    return conns_of(d, a) <= conns_of(d, b) ? a : b;
+}
+
+int dispatch_pick(dispatcher *d, const void *peer, const size_t npeer) {
+    int tid;
+
+    switch (d->policy) {
+    case DISPATCH_LEAST_CONNS:
+        tid = least_conns(d);
+        break;
+    case DISPATCH_TWO_CHOICES:
+        tid = two_choices(d);
+        break;
+    case DISPATCH_PEER_HASH:
+        if (peer != NULL && npeer > 0) {
+            tid = hash(peer, npeer, 0) % d->nthreads;
+            break;
+        }
+        /* no address to go by */
+        tid = round_robin(d);
+        break;
+    case DISPATCH_ROUND_ROBIN:
+    default:
+        tid = round_robin(d);
+        break;
+    }
+    __sync_fetch_and_add(&d->counters[tid].conns, 1);
+    return tid;
+}
+
+int dispatch_next(dispatcher *d) {
+    int tid = round_robin(d);
+
+    __sync_fetch_and_add(&d->counters[tid].conns, 1);
+    return tid;
+}
+
+void dispatch_conn_closed(dispatcher *d, const int tid) {
+    __sync_fetch_and_sub(&d->counters[tid].conns, 1);
+}
+
+void dispatch_set_load(dispatcher *d, const int tid, const S_UINT32 load) {
+    __atomic_store_n(&d->counters[tid].load, load, __ATOMIC_RELAXED);
+}
+
+S_UINT32 dispatch_conns(const dispatcher *d, const int tid) {
+    return conns_of(d, tid);
+}
+
+int dispatch_policy_parse(const char *name) {
+    unsigned int i;
+
+    for (i = 0; i < sizeof(policy_names) / sizeof(policy_names[0]); i++)
+        if (strcmp(name, policy_names[i]) == 0)
+            return (int)i;
+    return -1;
+}
+
+const char *dispatch_policy_name(const enum dispatch_policy policy) {
+    if ((unsigned int)policy >= sizeof(policy_names) / sizeof(policy_names[0]))
+        return "unknown";
+    return policy_names[policy];
+}
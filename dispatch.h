@@ -0,0 +1,57 @@
+#ifndef DISPATCH_H
+#define DISPATCH_H
+
+#include <stddef.h>
+#include "portable.h"
+
+/*
+  Picks the worker thread for a new connection.
+
+    DISPATCH_ROUND_ROBIN  each worker in turn, whatever it holds
+    DISPATCH_LEAST_CONNS  the worker with the fewest connections
+    DISPATCH_TWO_CHOICES  the less loaded of two workers drawn at random
+    DISPATCH_PEER_HASH    the worker the peer's address hashes to, so a
+                          client host keeps to one worker
+
+  Each worker has two counters. conns counts the connections dispatched
+  to it and not yet closed, queued ones included, so a burst doesn't all
+  land on the worker that looked idle before it. load is a gauge the
+  worker sets itself, such as requests waiting, for TWO_CHOICES to weigh
+  before conns; a worker that never sets it is judged on conns alone.
+
+  Picking is done by one thread at a time (the dispatcher); the counters
+  may be updated by any thread.
+ */
+
+enum dispatch_policy {
+    DISPATCH_ROUND_ROBIN = 0,
+    DISPATCH_LEAST_CONNS,
+    DISPATCH_TWO_CHOICES,
+    DISPATCH_PEER_HASH
+};
+
+typedef struct dispatcher dispatcher;
+
+/* NULL if no memory */
+dispatcher *dispatcher_create(const int nthreads, const enum dispatch_policy policy);
+void dispatcher_free(dispatcher *d);
+enum dispatch_policy dispatcher_policy(const dispatcher *d);
+
+/*
+ * The worker for a new connection, counted in its conns. peer is the
+ * client's address, npeer bytes, for DISPATCH_PEER_HASH; without one that
+ * policy goes round robin.
+ */
+int dispatch_pick(dispatcher *d, const void *peer, const size_t npeer);
+/* the next worker round robin whatever the policy, counted in its conns */
+int dispatch_next(dispatcher *d);
+/* a connection of worker tid closed, or never started */
+void dispatch_conn_closed(dispatcher *d, const int tid);
+void dispatch_set_load(dispatcher *d, const int tid, const S_UINT32 load);
+S_UINT32 dispatch_conns(const dispatcher *d, const int tid);
+
+/* "round-robin", "least-conns", "two-choices" or "peer-hash"; -1 if none */
+int dispatch_policy_parse(const char *name);
+const char *dispatch_policy_name(const enum dispatch_policy policy);
+
+#endif
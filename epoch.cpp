@@ -0,0 +1,169 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * Epoch based reclamation.
+ *
+ * There is one global epoch counter. A thread entering a critical section
+ * records the epoch it saw. Anything retired is stamped with the epoch
+ * current at that moment and may be freed once the global epoch is two
+ * ahead of the stamp: by then every reader that could have reached it has
+ * left. The epoch only advances when every active reader has caught up.
+ */
+#include "epoch.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <assert.h>
+#include <sched.h>
+#include <pthread.h>
+
+/* how many retired pointers a thread collects before trying to reclaim */
+#define EPOCH_RECLAIM_BATCH 64
+
+typedef struct epoch_retired epoch_retired;
+struct epoch_retired {
+    void *ptr;
+    epoch_free_func free_fn;
+    unsigned long epoch;
+    epoch_retired *next;
+};
+
+/* Per-thread state. Records are never freed; exited threads' records are
+   reused, along with whatever they had left to reclaim. */
+typedef struct epoch_record epoch_record;
+struct epoch_record {
+    volatile unsigned long epoch;
+    volatile int active;            /* critical section nesting depth */
+    volatile int in_use;
+    epoch_retired *retired;
+    unsigned int nretired;
+    epoch_record *next;
+};
+
+static volatile unsigned long global_epoch = 0;
+static epoch_record *volatile records = NULL;
+
+static pthread_key_t record_key;
+static pthread_once_t record_key_once = PTHREAD_ONCE_INIT;
+
+static void release_record(void *arg) {
+    epoch_record *rec = (epoch_record *)arg;
+    rec->active = 0;
+    __sync_synchronize();
+    rec->in_use = 0;
+}
+
+static void make_record_key(void) {
+    pthread_key_create(&record_key, release_record);
+}
+
+static epoch_record *get_record(void) {
+    epoch_record *rec;
+
+    pthread_once(&record_key_once, make_record_key);
+    rec = (epoch_record *)pthread_getspecific(record_key);
+    if (rec)
+        return rec;
+
+    for (rec = records; rec != NULL; rec = rec->next) {
+        if (! rec->in_use && __sync_bool_compare_and_swap(&rec->in_use, 0, 1))
+            break;
+    }
+    if (rec == NULL) {
+        rec = (epoch_record *)calloc(1, sizeof(epoch_record));
+        if (rec == NULL) {
+            perror("Can't allocate epoch record");
+            exit(EXIT_FAILURE);
+        }
+        rec->in_use = 1;
+        do {
+            rec->next = records;
+        } while (! __sync_bool_compare_and_swap(&records, rec->next, rec));
+    }
+    pthread_setspecific(record_key, rec);
+    return rec;
+}
+
+void epoch_enter(void) {
+    epoch_record *rec = get_record();
+
+    if (rec->active++ == 0) {
+        rec->epoch = global_epoch;
+        /* publish before touching any shared pointer */
+        __sync_synchronize();
+    }
+}
+
+void epoch_exit(void) {
+    epoch_record *rec = get_record();
+
+    assert(rec->active > 0);
+    __sync_synchronize();
+    rec->active--;
+}
+
+/* advances the global epoch if every active reader has seen it. */
+static bool try_advance(void) {
+    unsigned long epoch = global_epoch;
+    epoch_record *rec;
+
+    __sync_synchronize();
+    for (rec = records; rec != NULL; rec = rec->next) {
+        if (rec->in_use && rec->active && rec->epoch != epoch)
+            return false;
+    }
+    return __sync_bool_compare_and_swap(&global_epoch, epoch, epoch + 1);
+}
+
+static void reclaim(epoch_record *rec) {
+    unsigned long epoch = global_epoch;
+    epoch_retired **pos = &rec->retired;
+
+    while (*pos) {
+        epoch_retired *r = *pos;
+        if (r->epoch + 2 <= epoch) {
+            *pos = r->next;
+            r->free_fn(r->ptr);
+            free(r);
+            rec->nretired--;
+        } else {
+            pos = &r->next;
+        }
+    }
+}
+
+void epoch_retire(void *ptr, epoch_free_func free_fn) {
+    epoch_record *rec = get_record();
+    epoch_retired *r = (epoch_retired *)malloc(sizeof(epoch_retired));
+
+    if (r == NULL) {
+        /* no memory to defer with: wait for the readers instead */
+        epoch_synchronize();
+        free_fn(ptr);
+        return;
+    }
+    r->ptr = ptr;
+    r->free_fn = free_fn;
+    /* the unlink must be visible before we stamp it */
+    __sync_synchronize();
+    r->epoch = global_epoch;
+    r->next = rec->retired;
+    rec->retired = r;
+
+    if (++rec->nretired >= EPOCH_RECLAIM_BATCH) {
+        try_advance();
+        reclaim(rec);
+    }
+}
+
+void epoch_synchronize(void) {
+    epoch_record *rec = get_record();
+    unsigned long target = global_epoch + 2;
+
+    /* waiting inside our own section would never finish */
+    assert(rec->active == 0);
+    while (global_epoch < target) {
+        if (! try_advance())
+            sched_yield();
+    }
+    reclaim(rec);
+}
@@ -0,0 +1,21 @@
+#ifndef EPOCH_H
+#define EPOCH_H
+
+/*
+  Epoch based reclamation for lock-free readers.
+
+  A reader brackets its accesses with epoch_enter()/epoch_exit(). Memory
+  unlinked by a writer is handed to epoch_retire() and freed only once every
+  thread that might still see it has left its critical section. Sections
+  nest.
+ */
+
+typedef void (*epoch_free_func)(void *ptr);
+
+void epoch_enter(void);
+void epoch_exit(void);
+void epoch_retire(void *ptr, epoch_free_func free_fn);
+/* waits out a grace period and frees what this thread has retired */
+void epoch_synchronize(void);
+
+#endif
@@ -11,6 +11,8 @@
  */
 #include "hash.h"
 
+#include <string.h>
+
 /*
  * Since the hash function does bit manipulation, it needs to know
  * whether it's big or little-endian. ENDIAN_LITTLE and ENDIAN_BIG
@@ -431,3 +433,189 @@ S_UINT32 hash( const void *key, S_UINT length, const S_UINT32 initval)
 #else /* HASH_XXX_ENDIAN == 1 */
 #error Must define HASH_BIG_ENDIAN or HASH_LITTLE_ENDIAN
 #endif /* HASH_XXX_ENDIAN == 1 */
+
+/*
+ * hash_batch():
+ * hash(keys[i], lens[i], 0) for n keys. Each key's hash is a chain of
+ * dependent mix() rounds, so one key at a time leaves most of the CPU idle;
+ * here HASH_BATCH_WIDTH keys advance through their full blocks in lockstep
+ * and the independent chains overlap, four lanes of one SSE2 register
+ * where available. Words are assembled little-endian, which is what hash()
+ * computes on little-endian machines whatever the alignment. Elsewhere it
+ * just calls hash().
+ */
+#define HASH_BATCH_WIDTH 4
+
+#if HASH_LITTLE_ENDIAN == 1
+static S_UINT32 hash_le32(const S_UINT8 *k)
+{
+  S_UINT32 v;
+  memcpy(&v, k, 4);
+  return v;
+}
+
+/* the first n (< 4) bytes at k as the low bytes of a little-endian word */
+static S_UINT32 hash_le_part(const S_UINT8 *k, S_UINT n)
+{
+  S_UINT32 v = 0;
+  switch(n)
+  {
+  case 3 : v+=((S_UINT32)k[2])<<16;  /* fall through */
+  case 2 : v+=((S_UINT32)k[1])<<8;   /* fall through */
+  case 1 : v+=k[0];
+  }
+  return v;
+}
+
+/*
+ * The blocks hash() would still mix for one key after the lockstep rounds,
+ * then its last block added in; everything but final().
+ */
+static void hash_rest(const S_UINT8 *k, S_UINT length,
+                      S_UINT32 *pa, S_UINT32 *pb, S_UINT32 *pc)
+{
+  S_UINT32 a = *pa, b = *pb, c = *pc;
+
+  while (length > 12)
+  {
+    a += hash_le32(k);
+    b += hash_le32(k + 4);
+    c += hash_le32(k + 8);
+    mix(a,b,c);
+    length -= 12;
+    k += 12;
+  }
+
+  if (length >= 8) {
+    a += hash_le32(k);
+    b += hash_le32(k + 4);
+    c += hash_le_part(k + 8, length - 8);
+    if (length == 12)
+      c += hash_le32(k + 8);
+  } else if (length >= 4) {
+    a += hash_le32(k);
+    b += hash_le_part(k + 4, length - 4);
+  } else {
+    a += hash_le_part(k, length);
+  }
+  *pa = a; *pb = b; *pc = c;
+}
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+
+/* mix() and final() with each 32-bit lane holding another key's state */
+#define rot4(x,k) _mm_or_si128(_mm_slli_epi32(x,k), _mm_srli_epi32(x,32-(k)))
+
+#define mix4(a,b,c) \
+{ \
+  a = _mm_sub_epi32(a, c); a = _mm_xor_si128(a, rot4(c, 4)); c = _mm_add_epi32(c, b); \
+  b = _mm_sub_epi32(b, a); b = _mm_xor_si128(b, rot4(a, 6)); a = _mm_add_epi32(a, c); \
+  c = _mm_sub_epi32(c, b); c = _mm_xor_si128(c, rot4(b, 8)); b = _mm_add_epi32(b, a); \
+  a = _mm_sub_epi32(a, c); a = _mm_xor_si128(a, rot4(c,16)); c = _mm_add_epi32(c, b); \
+  b = _mm_sub_epi32(b, a); b = _mm_xor_si128(b, rot4(a,19)); a = _mm_add_epi32(a, c); \
+  c = _mm_sub_epi32(c, b); c = _mm_xor_si128(c, rot4(b, 4)); b = _mm_add_epi32(b, a); \
+}
+
+#define final4(a,b,c) \
+{ \
+  c = _mm_xor_si128(c, b); c = _mm_sub_epi32(c, rot4(b,14)); \
+  a = _mm_xor_si128(a, c); a = _mm_sub_epi32(a, rot4(c,11)); \
+  b = _mm_xor_si128(b, a); b = _mm_sub_epi32(b, rot4(a,25)); \
+  c = _mm_xor_si128(c, b); c = _mm_sub_epi32(c, rot4(b,16)); \
+  a = _mm_xor_si128(a, c); a = _mm_sub_epi32(a, rot4(c, 4)); \
+  b = _mm_xor_si128(b, a); b = _mm_sub_epi32(b, rot4(a,14)); \
+  c = _mm_xor_si128(c, b); c = _mm_sub_epi32(c, rot4(b,24)); \
+}
+
+/* word w of the current block of each of the four keys */
+#define hash_load4(k,w) _mm_setr_epi32((int)hash_le32(k[0] + (w)), (int)hash_le32(k[1] + (w)), \
+                                  (int)hash_le32(k[2] + (w)), (int)hash_le32(k[3] + (w)))
+#endif /* __SSE2__ */
+
+void hash_batch(const void **keys, const S_UINT *lens, S_UINT32 *out, S_UINT n)
+{
+  S_UINT32 a[HASH_BATCH_WIDTH], b[HASH_BATCH_WIDTH], c[HASH_BATCH_WIDTH];
+  const S_UINT8 *k[HASH_BATCH_WIDTH];
+  S_UINT i, j, r, shortest, common;
+
+  for (i = 0; i + HASH_BATCH_WIDTH <= n; i += HASH_BATCH_WIDTH) {
+    /* rounds of hash()'s block loop every key in the group goes through */
+    shortest = lens[i];
+    for (j = 1; j < HASH_BATCH_WIDTH; j++) {
+      if (lens[i + j] < shortest)
+        shortest = lens[i + j];
+    }
+    common = shortest > 12 ? (shortest - 1) / 12 : 0;
+    if (common == 0) {
+      /* nothing to overlap; hash()'s masked word reads win on short keys */
+      for (j = 0; j < HASH_BATCH_WIDTH; j++)
+        out[i + j] = hash(keys[i + j], lens[i + j], 0);
+      continue;
+    }
+    for (j = 0; j < HASH_BATCH_WIDTH; j++) {
+      k[j] = (const S_UINT8 *)keys[i + j];
+      a[j] = b[j] = c[j] = 0xdeadbeef + ((S_UINT32)lens[i + j]);
+    }
+
+#if defined(__SSE2__)
+    {
+      __m128i va = _mm_setr_epi32((int)a[0], (int)a[1], (int)a[2], (int)a[3]);
+      __m128i vb = va, vc = va;
+
+      for (r = 0; r < common; r++) {
+        va = _mm_add_epi32(va, hash_load4(k, 0));
+        vb = _mm_add_epi32(vb, hash_load4(k, 4));
+        vc = _mm_add_epi32(vc, hash_load4(k, 8));
+        mix4(va,vb,vc);
+        for (j = 0; j < HASH_BATCH_WIDTH; j++)
+          k[j] += 12;
+      }
+      _mm_storeu_si128((__m128i *)a, va);
+      _mm_storeu_si128((__m128i *)b, vb);
+      _mm_storeu_si128((__m128i *)c, vc);
+    }
+#else
+    for (r = 0; r < common; r++) {
+      for (j = 0; j < HASH_BATCH_WIDTH; j++) {
+        a[j] += hash_le32(k[j]);
+        b[j] += hash_le32(k[j] + 4);
+        c[j] += hash_le32(k[j] + 8);
+        mix(a[j],b[j],c[j]);
+        k[j] += 12;
+      }
+    }
+#endif
+
+    for (j = 0; j < HASH_BATCH_WIDTH; j++)
+      hash_rest(k[j], lens[i + j] - common * 12, &a[j], &b[j], &c[j]);
+
+#if defined(__SSE2__)
+    {
+      __m128i va = _mm_setr_epi32((int)a[0], (int)a[1], (int)a[2], (int)a[3]);
+      __m128i vb = _mm_setr_epi32((int)b[0], (int)b[1], (int)b[2], (int)b[3]);
+      __m128i vc = _mm_setr_epi32((int)c[0], (int)c[1], (int)c[2], (int)c[3]);
+
+      final4(va,vb,vc);
+      _mm_storeu_si128((__m128i *)(out + i), vc);
+    }
+#else
+    for (j = 0; j < HASH_BATCH_WIDTH; j++) {
+      final(a[j],b[j],c[j]);
+      out[i + j] = c[j];
+    }
+#endif
+  }
+
+  for (; i < n; i++)
+    out[i] = hash(keys[i], lens[i], 0);
+}
+#else
+void hash_batch(const void **keys, const S_UINT *lens, S_UINT32 *out, S_UINT n)
+{
+  S_UINT i;
+
+  for (i = 0; i < n; i++)
+    out[i] = hash(keys[i], lens[i], 0);
+}
+#endif /* HASH_LITTLE_ENDIAN == 1 */
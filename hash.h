@@ -1,13 +1,15 @@
 #ifndef HASH_H
 #define    HASH_H
 
-#include "win.h"
+#include "portable.h"
 
 #ifdef    __cplusplus
 extern "C" {
 #endif
 
 S_UINT32 hash(const void *key, S_UINT length, const S_UINT32 initval);
+/* out[i] = hash(keys[i], lens[i], 0), several keys at a time */
+void hash_batch(const void **keys, const S_UINT *lens, S_UINT32 *out, S_UINT n);
 
 #ifdef    __cplusplus
 }
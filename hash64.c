@@ -0,0 +1,104 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * 64-bit hash
+ *
+ * A multiply-fold hash in the style of wyhash by Wang Yi: the key is read
+ * 8 or 16 bytes at a time, each pair of words is folded by a 64x64->128
+ * multiply and the halves are xored together. Keys of up to 16 bytes take
+ * a single multiply. Reads are in native byte order, so, like hash(), the
+ * result differs between little and big-endian machines.
+ */
+#include "hash64.h"
+
+#include <string.h>
+
+static const S_UINT64 secret[4] = {
+    0x2d358dccaa6c78a5ULL, 0x8bb84b93962eacc9ULL,
+    0x4b33a62ed433d4a3ULL, 0x4d5a2da51de1aa47ULL
+};
+
+/* 64x64 -> 128 bit multiply; *a gets the low half, *b the high half. */
+static void mum(S_UINT64 *a, S_UINT64 *b) {
+#if defined(__SIZEOF_INT128__)
+    unsigned __int128 r = *a;
+    r *= *b;
+    *a = (S_UINT64)r;
+    *b = (S_UINT64)(r >> 64);
+#else
+    S_UINT64 ha = *a >> 32, hb = *b >> 32;
+    S_UINT64 la = (S_UINT32)*a, lb = (S_UINT32)*b;
+    S_UINT64 rh = ha * hb, rm0 = ha * lb, rm1 = hb * la, rl = la * lb;
+    S_UINT64 t = rl + (rm0 << 32), c = t < rl;
+    S_UINT64 lo = t + (rm1 << 32);
+    c += lo < t;
+    *a = lo;
+    *b = rh + (rm0 >> 32) + (rm1 >> 32) + c;
+#endif
+}
+
+static S_UINT64 mix(S_UINT64 a, S_UINT64 b) {
+    mum(&a, &b);
+    return a ^ b;
+}
+
+static S_UINT64 r8(const S_UINT8 *p) {
+    S_UINT64 v;
+    memcpy(&v, p, 8);
+    return v;
+}
+
+static S_UINT64 r4(const S_UINT8 *p) {
+    S_UINT32 v;
+    memcpy(&v, p, 4);
+    return v;
+}
+
+/* 1 to 3 bytes: first, middle and last */
+static S_UINT64 r3(const S_UINT8 *p, S_UINT k) {
+    return (((S_UINT64)p[0]) << 16) | (((S_UINT64)p[k >> 1]) << 8) | p[k - 1];
+}
+
+S_UINT64 hash64(const void *key, S_UINT length, const S_UINT64 seed_init) {
+    const S_UINT8 *p = (const S_UINT8 *)key;
+    S_UINT64 seed = seed_init;
+    S_UINT64 a, b;
+
+    seed ^= mix(seed ^ secret[0], secret[1]);
+    if (length <= 16) {
+        if (length >= 4) {
+            /* two overlapping pairs of 4-byte reads cover 4..16 bytes */
+            a = (r4(p) << 32) | r4(p + ((length >> 3) << 2));
+            b = (r4(p + length - 4) << 32) | r4(p + length - 4 - ((length >> 3) << 2));
+        } else if (length > 0) {
+            a = r3(p, length);
+            b = 0;
+        } else {
+            a = b = 0;
+        }
+    } else {
+        S_UINT i = length;
+        if (i > 48) {
+            /* three independent lanes keep the multipliers busy */
+            S_UINT64 see1 = seed, see2 = seed;
+            do {
+                seed = mix(r8(p) ^ secret[1], r8(p + 8) ^ seed);
+                see1 = mix(r8(p + 16) ^ secret[2], r8(p + 24) ^ see1);
+                see2 = mix(r8(p + 32) ^ secret[3], r8(p + 40) ^ see2);
+                p += 48;
+                i -= 48;
+            } while (i > 48);
+            seed ^= see1 ^ see2;
+        }
+        while (i > 16) {
+            seed = mix(r8(p) ^ secret[1], r8(p + 8) ^ seed);
+            i -= 16;
+            p += 16;
+        }
+        a = r8(p + i - 16);
+        b = r8(p + i - 8);
+    }
+    a ^= secret[1];
+    b ^= seed;
+    mum(&a, &b);
+    return mix(a ^ secret[0] ^ length, b ^ secret[1]);
+}
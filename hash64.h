@@ -0,0 +1,16 @@
+#ifndef HASH64_H
+#define    HASH64_H
+
+#include "portable.h"
+
+#ifdef    __cplusplus
+extern "C" {
+#endif
+
+S_UINT64 hash64(const void *key, S_UINT length, const S_UINT64 seed);
+
+#ifdef    __cplusplus
+}
+#endif
+
+#endif    /* HASH64_H */
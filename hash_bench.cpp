@@ -0,0 +1,181 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * Hash function benchmarks.
+ *
+ *   hash_bench [nkeys] [rounds]
+ *
+ * For every hash policy and key set prints throughput and how evenly the
+ * keys spread over a power-of-two bucket array: chi2/df near 1.0 is what a
+ * random function gives, and max is the longest chain. It then compares
+ * hash_batch() with calling hash() key by key, after checking it gives
+ * the same hashes; it exits nonzero if not.
+ */
+#include "hashtable.h"
+#include "hash.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+typedef struct {
+    const char *name;
+    hashtable_hash_func fn;
+} hash_policy;
+
+static const hash_policy policies[] = {
+    { "lookup3", hashtable_hash_lookup3 },
+    { "times33", hashtable_hash_times33 },
+    { "fast64", hashtable_hash_fast64 },
+};
+
+typedef struct {
+    const char *name;
+    char **keys;
+    S_UINT *lens;
+    unsigned long bytes;
+} key_set;
+
+/* keeps the timed loops from being optimized away */
+static volatile S_UINT32 hash_sink;
+
+static double now(void) {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static void make_keys(key_set *ks, const char *name, const char *fmt,
+                      const unsigned int nkeys) {
+    unsigned int i;
+    char buf[512];
+
+    ks->name = name;
+    ks->keys = (char **)malloc(nkeys * sizeof(char *));
+    ks->lens = (S_UINT *)malloc(nkeys * sizeof(S_UINT));
+    ks->bytes = 0;
+    if (ks->keys == NULL || ks->lens == NULL) {
+        fprintf(stderr, "Failed to allocate %u keys\n", nkeys);
+        exit(EXIT_FAILURE);
+    }
+    for (i = 0; i < nkeys; i++) {
+        /* the multiplied id scatters digits the way real ids do */
+        int len = snprintf(buf, sizeof(buf), fmt, i, i * 2654435761u);
+        ks->keys[i] = strdup(buf);
+        ks->lens[i] = len;
+        ks->bytes += len;
+    }
+}
+
+static void bench_policy(const hash_policy *p, const key_set *ks,
+                         const unsigned int nkeys, const unsigned int rounds) {
+    unsigned int power = 1, i, r, max = 0;
+    unsigned int *counts;
+    S_UINT32 sink = 0;
+    double start, elapsed, expected, chi2 = 0;
+
+    start = now();
+    for (r = 0; r < rounds; r++) {
+        for (i = 0; i < nkeys; i++) {
+            sink ^= p->fn(ks->keys[i], ks->lens[i]);
+        }
+    }
+    elapsed = now() - start;
+    hash_sink = sink;
+
+    while ((1u << power) < nkeys)
+        power++;
+    counts = (unsigned int *)calloc(1u << power, sizeof(unsigned int));
+    for (i = 0; i < nkeys; i++) {
+        counts[p->fn(ks->keys[i], ks->lens[i]) & ((1u << power) - 1)]++;
+    }
+    expected = (double)nkeys / (1u << power);
+    for (i = 0; i < (1u << power); i++) {
+        chi2 += (counts[i] - expected) * (counts[i] - expected) / expected;
+        if (counts[i] > max)
+            max = counts[i];
+    }
+    free(counts);
+
+    printf("%-8s %-6s %8.1f MB/s %7.1f ns/key  chi2/df %5.3f  max %u\n",
+           p->name, ks->name,
+           (double)ks->bytes * rounds / elapsed / 1e6,
+           elapsed * 1e9 / ((double)nkeys * rounds),
+           chi2 / ((1u << power) - 1), max);
+}
+
+/* lookup3 over the whole set, one key at a time and then in batches */
+static void bench_batch(const key_set *ks, const unsigned int nkeys,
+                        const unsigned int rounds, const unsigned int batch) {
+    S_UINT32 *out = (S_UINT32 *)malloc(batch * sizeof(S_UINT32));
+    unsigned int i, r, n;
+    S_UINT32 sink = 0;
+    double start, scalar, batched;
+
+    if (out == NULL) {
+        fprintf(stderr, "Failed to allocate batch output\n");
+        exit(EXIT_FAILURE);
+    }
+
+    /* timing a wrong answer is no use */
+    for (i = 0; i < nkeys; i += n) {
+        n = nkeys - i < batch ? nkeys - i : batch;
+        hash_batch((const void **)&ks->keys[i], &ks->lens[i], out, n);
+        for (r = 0; r < n; r++) {
+            if (out[r] != hash(ks->keys[i + r], ks->lens[i + r], 0)) {
+                fprintf(stderr, "hash_batch differs from hash() on %s key %u\n",
+                        ks->name, i + r);
+                exit(EXIT_FAILURE);
+            }
+        }
+    }
+
+    start = now();
+    for (r = 0; r < rounds; r++) {
+        for (i = 0; i < nkeys; i++) {
+            sink ^= hash(ks->keys[i], ks->lens[i], 0);
+        }
+    }
+    scalar = now() - start;
+
+    start = now();
+    for (r = 0; r < rounds; r++) {
+        for (i = 0; i < nkeys; i += n) {
+            n = nkeys - i < batch ? nkeys - i : batch;
+            hash_batch((const void **)&ks->keys[i], &ks->lens[i], out, n);
+            sink ^= out[0];
+        }
+    }
+    batched = now() - start;
+    hash_sink = sink;
+    free(out);
+
+    printf("batch%-3u %-6s %7.1f ns/key scalar %7.1f ns/key batched  %.2fx\n",
+           batch, ks->name,
+           scalar * 1e9 / ((double)nkeys * rounds),
+           batched * 1e9 / ((double)nkeys * rounds),
+           scalar / batched);
+}
+
+int main(int argc, char **argv) {
+    unsigned int nkeys = argc > 1 ? atoi(argv[1]) : 1000000;
+    unsigned int rounds = argc > 2 ? atoi(argv[2]) : 10;
+    key_set sets[2];
+    unsigned int s, p;
+
+    make_keys(&sets[0], "short", "user:%u", nkeys);
+    make_keys(&sets[1], "url",
+              "https://www.example.com/catalog/items/%010u/detail"
+              "?ref=search&session=%010u&lang=en-US&view=full&page=1",
+              nkeys);
+
+    for (s = 0; s < sizeof(sets) / sizeof(sets[0]); s++) {
+        for (p = 0; p < sizeof(policies) / sizeof(policies[0]); p++) {
+            bench_policy(&policies[p], &sets[s], nkeys, rounds);
+        }
+    }
+    for (s = 0; s < sizeof(sets) / sizeof(sets[0]); s++) {
+        bench_batch(&sets[s], nkeys, rounds, 32);
+    }
+    return 0;
+}
@@ -0,0 +1,142 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * Hash function checks.
+ *
+ *   hash_test
+ *
+ * Every Times33Hash kernel this CPU runs, for S_CHAR and S_WCHAR keys of
+ * 0 to TEST_MAX_LEN chars at every start offset up to TEST_OFFSETS, against
+ * the plain h = h * 33 + c loop. Then hash_batch() against hash() key by
+ * key, for groups of every size up to TEST_BATCH_MAX: keys of 12 bytes or
+ * less, keys all of one length and keys of mixed lengths, at unaligned
+ * starts. Prints each mismatch and exits nonzero if there was any.
+ */
+#include "portable.h"
+#include "hash.h"
+#include "times33hash_test.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#define TEST_MAX_LEN 300
+#define TEST_OFFSETS 16
+#define TEST_BATCH_MAX 37
+
+static unsigned long long test_seed = 1;
+
+static S_UINT32 test_random(void) {
+    test_seed = test_seed * 6364136223846793005ULL + 1442695040888963407ULL;
+    return (S_UINT32)(test_seed >> 32);
+}
+
+/* the char promoted as the serial loop does, sign included */
+template <typename C>
+static S_UINT32 times33_reference(const C *key, const S_UINT klen) {
+    S_UINT32 h = 5381;
+    S_UINT i;
+
+    for (i = 0; i < klen; i++)
+        h = h * 33 + (S_UINT32)key[i];
+    return h;
+}
+
+template <typename C>
+static unsigned int check_times33(const char *kernel, const char *type) {
+    C buf[TEST_MAX_LEN + TEST_OFFSETS];
+    unsigned int i, len, off, failed = 0;
+    S_UINT32 got, want;
+
+    /* the whole range of C, negative chars included */
+    for (i = 0; i < sizeof(buf) / sizeof(buf[0]); i++)
+        buf[i] = (C)test_random();
+    for (len = 0; len <= TEST_MAX_LEN; len++) {
+        for (off = 0; off < TEST_OFFSETS; off++) {
+            got = Times33Hash::hash(buf + off, len);
+            want = times33_reference(buf + off, len);
+            if (got != want) {
+                fprintf(stderr, "times33 %s %s: len %u offset %u: %08x, want %08x\n",
+                        kernel, type, len, off, got, want);
+                failed++;
+            }
+        }
+    }
+    return failed;
+}
+
+/* lens[i] bytes at unaligned places in buf for each of the n keys */
+static unsigned int check_batch(const char *what, const S_UINT8 *buf,
+                                const S_UINT *lens, const S_UINT n) {
+    const void *keys[TEST_BATCH_MAX];
+    S_UINT32 out[TEST_BATCH_MAX];
+    S_UINT i;
+    unsigned int failed = 0;
+    S_UINT32 want;
+
+    for (i = 0; i < n; i++)
+        keys[i] = buf + 1 + (test_random() % (TEST_OFFSETS - 1));
+    hash_batch(keys, lens, out, n);
+    for (i = 0; i < n; i++) {
+        want = hash(keys[i], lens[i], 0);
+        if (out[i] != want) {
+            fprintf(stderr, "hash_batch %s: group of %u, key %u of %u bytes: %08x, want %08x\n",
+                    what, n, i, lens[i], out[i], want);
+            failed++;
+        }
+    }
+    return failed;
+}
+
+static unsigned int check_hash_batch(void) {
+    S_UINT8 buf[TEST_MAX_LEN + TEST_OFFSETS];
+    S_UINT lens[TEST_BATCH_MAX];
+    unsigned int i, n, len, round, failed = 0;
+
+    for (i = 0; i < sizeof(buf); i++)
+        buf[i] = (S_UINT8)test_random();
+    for (n = 0; n <= TEST_BATCH_MAX; n++) {
+        for (round = 0; round < 20; round++) {
+            for (i = 0; i < n; i++)
+                lens[i] = test_random() % 13;
+            failed += check_batch("short", buf, lens, n);
+            for (i = 0; i < n; i++)
+                lens[i] = test_random() % TEST_MAX_LEN;
+            failed += check_batch("mixed", buf, lens, n);
+        }
+        for (len = 0; len < TEST_MAX_LEN; len++) {
+            for (i = 0; i < n; i++)
+                lens[i] = len;
+            failed += check_batch("same", buf, lens, n);
+        }
+    }
+    printf("hash_batch    checked\n");
+    return failed;
+}
+
+int main(void) {
+    static const struct {
+        const char *name;
+        enum times33_kernel kernel;
+    } kernels[] = {
+        { "serial", TIMES33_SERIAL },
+        { "sse2", TIMES33_SSE2 },
+        { "avx2", TIMES33_AVX2 },
+    };
+    unsigned int k, failed = 0;
+
+    for (k = 0; k < sizeof(kernels) / sizeof(kernels[0]); k++) {
+        if (! times33_set_kernel(kernels[k].kernel)) {
+            printf("times33 %-6s skipped, not supported here\n", kernels[k].name);
+            continue;
+        }
+        failed += check_times33<S_CHAR>(kernels[k].name, "S_CHAR");
+        failed += check_times33<S_WCHAR>(kernels[k].name, "S_WCHAR");
+        printf("times33 %-6s checked\n", kernels[k].name);
+    }
+    failed += check_hash_batch();
+
+    if (failed > 0) {
+        fprintf(stderr, "%u mismatches\n", failed);
+        return EXIT_FAILURE;
+    }
+    return 0;
+}
@@ -1,4 +1,3 @@
-
 /* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
 /*
  * Hash table
@@ -13,191 +12,980 @@
  */
 #include "hashtable.h"
 #include "hash.h"
+#include "hash64.h"
+#include "times33hash.h"
+#include "epoch.h"
+#include "timewheel.h"
+#include "wal.h"
 
 #include <errno.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <assert.h>
+#include <time.h>
+#include <sys/time.h>
 
-/* multi-thread support
-#include <fcntl.h>
-#include <errno.h>
-#include <stdlib.h>
-#include <stdio.h>
-#include <string.h>
-#include <assert.h>
 #include <pthread.h>
 
-
-static pthread_cond_t maintenance_cond = PTHREAD_COND_INITIALIZER;
-*/
-
 typedef  unsigned long  int  ub4;   /* unsigned 4-byte quantities */
 typedef  unsigned       char ub1;   /* unsigned 1-byte quantities */
 
-/* how many powers of 2's worth of buckets we use */
-unsigned int hashpower = HASHPOWER_DEFAULT;
-
 #define hashsize(n) ((ub4)1<<(n))
 #define hashmask(n) (hashsize(n)-1)
 
-/* Main hash table. This is where we look except during expansion. */
-static item** primary_hashtable = 0;
+#define DEFAULT_HASH_BULK_MOVE 1
 
-/*
- * Previous hash table. During expansion, we look here for keys that haven't
- * been moved over to the primary yet.
- */
-static item** old_hashtable = 0;
+S_UINT32 hashtable_hash_lookup3(const void *key, const S_UINT nkey) {
+    return hash(key, nkey, 0);
+}
 
-/* Number of items in the hash table. */
-static S_UINT hash_items = 0;
+S_UINT32 hashtable_hash_times33(const void *key, const S_UINT nkey) {
+    return Times33Hash::hash((const S_CHAR *)key, nkey);
+}
 
-/* Flag: Are we in the middle of expanding now? */
-static bool expanding = false;
-static bool started_expanding = false;
+S_UINT32 hashtable_hash_fast64(const void *key, const S_UINT nkey) {
+    S_UINT64 h = hash64(key, nkey, 0);
+    return (S_UINT32)(h ^ (h >> 32));
+}
 
-/*
- * During expansion we migrate values with bucket granularity; this is how
- * far we've gotten so far. Ranges from 0 .. hashsize(hashpower - 1) - 1.
- */
-static unsigned int expand_bucket = 0;
+rel_time_t hashtable_current_time(void) {
+    static volatile time_t started = 0;
+    struct timespec ts;
 
-void hashtable_init(const int ht_init) {
-    if (ht_init) {
-        hashpower = ht_init;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    if (! started)
+        __sync_bool_compare_and_swap(&started, 0, ts.tv_sec);
+    return (rel_time_t)(ts.tv_sec - started) + 2;
+}
+
+HashTable::HashTable(const int hashpower_init, const int nthreads,
+                     const int flags, hashtable_hash_func hash_function)
+    : hash_func(hash_function),
+      hashpower(HASHPOWER_DEFAULT),
+      hashpower_min(HASHPOWER_DEFAULT),
+      primary_hashtable(0),
+      old_hashtable(0),
+      hash_items(0),
+      expanding(false),
+      shrinking(false),
+      started_expanding(0),
+      expand_bucket(0),
+      item_locks(0),
+      item_lock_count(0),
+      lockfree((flags & HASHTABLE_LOCKFREE_READS) != 0),
+      migrate_seq(0),
+      inline_nodes((flags & HASHTABLE_INLINE_KEYS) != 0),
+      hash_bytes(0),
+      mem_limit(0),
+      evict_func(0),
+      evict_arg(0),
+      clock_hands(0),
+      evicted(0),
+      expire_func(0),
+      expire_arg(0),
+      wheel(0),
+      expired(0),
+      wal_log(0),
+      wal_sync(false),
+      hash_bulk_move(DEFAULT_HASH_BULK_MOVE),
+      do_run_maintenance_thread(1),
+      maintenance_running(false) {
+    if (hashpower_init) {
+        hashpower = hashpower_init;
     }
+    hashpower_min = hashpower;
     primary_hashtable = (item**)calloc(hashsize(hashpower), sizeof(void *));
     if (! primary_hashtable) {
         fprintf(stderr, "Failed to init hashtable.\n");
         exit(EXIT_FAILURE);
-    }        
-    
+    }
+    pthread_mutex_init(&maintenance_lock, NULL);
+    pthread_mutex_init(&wheel_lock, NULL);
+    pthread_cond_init(&maintenance_cond, NULL);
+
+    if (nthreads > 0 || lockfree) {
+        unsigned int power;
+        S_UINT32 i;
+
+        /* Want a wide lock table, but don't waste memory */
+        if (nthreads < 3) {
+            power = 10;
+        } else if (nthreads < 4) {
+            power = 11;
+        } else if (nthreads < 5) {
+            power = 12;
+        } else {
+            /* 8192 buckets, and central locks don't scale much past 5 threads */
+            power = 13;
+        }
+        /* a stripe must cover whole old buckets, see item_locks */
+        if (power > hashpower - 1)
+            power = hashpower > 0 ? hashpower - 1 : 0;
+
+        item_lock_count = hashsize(power);
+        item_locks = (pthread_mutex_t *)calloc(item_lock_count, sizeof(pthread_mutex_t));
+        if (! item_locks) {
+            perror("Can't allocate item locks");
+            exit(EXIT_FAILURE);
+        }
+        for (i = 0; i < item_lock_count; i++) {
+            pthread_mutex_init(&item_locks[i], NULL);
+        }
+    }
+    clock_hands = (unsigned int *)calloc(item_lock_count ? item_lock_count : 1,
+                                         sizeof(unsigned int));
+    if (! clock_hands) {
+        perror("Can't allocate clock hands");
+        exit(EXIT_FAILURE);
+    }
+
     //STATS_LOCK();
     //stats.hash_power_level = hashpower;
     //stats.hash_bytes = hashsize(hashpower) * sizeof(void *);
-    //STATS_UNLOCK();    
+    //STATS_UNLOCK();
 }
 
-item *hashtable_find(const S_CHAR *key, const S_UINT nkey, const S_UINT32 hv) {
-    item *it;
+HashTable::~HashTable() {
+    S_UINT32 i;
+
+    stop_maintenance_thread();
+    if (expanding)
+        free(old_hashtable);
+    free(primary_hashtable);
+    for (i = 0; i < item_lock_count; i++) {
+        pthread_mutex_destroy(&item_locks[i]);
+    }
+    free(item_locks);
+    free(clock_hands);
+    timewheel_free(wheel);
+    pthread_mutex_destroy(&wheel_lock);
+    pthread_cond_destroy(&maintenance_cond);
+    pthread_mutex_destroy(&maintenance_lock);
+}
+
+void HashTable::item_lock(const S_UINT32 hv) {
+    pthread_mutex_lock(&item_locks[hv & (item_lock_count - 1)]);
+}
+
+void HashTable::item_unlock(const S_UINT32 hv) {
+    pthread_mutex_unlock(&item_locks[hv & (item_lock_count - 1)]);
+}
+
+/* takes every stripe in index order; this is the global window. */
+void HashTable::item_lock_all(void) {
+    S_UINT32 i;
+    for (i = 0; i < item_lock_count; i++) {
+        pthread_mutex_lock(&item_locks[i]);
+    }
+}
+
+void HashTable::item_unlock_all(void) {
+    S_UINT32 i = item_lock_count;
+    while (i-- > 0) {
+        pthread_mutex_unlock(&item_locks[i]);
+    }
+}
+
+/* seqlock writer side for lock-free readers; there is only ever one mover. */
+void HashTable::migrate_begin(void) {
+    if (! lockfree)
+        return;
+    migrate_seq++;
+    __sync_synchronize();
+}
+
+void HashTable::migrate_end(void) {
+    if (! lockfree)
+        return;
+    __sync_synchronize();
+    migrate_seq++;
+}
+
+/* returns the head of the chain hv lives in, old or primary. */
+item **HashTable::bucket_for(const S_UINT32 hv) {
     unsigned int oldbucket;
 
-    if (expanding &&
-        (oldbucket = (hv & hashmask(hashpower - 1))) >= expand_bucket)
-    {
-        it = old_hashtable[oldbucket];
-    } else {
-        it = primary_hashtable[hv & hashmask(hashpower)];
+    if (expanding) {
+        if (shrinking) {
+            if ((hv & hashmask(hashpower)) >= expand_bucket)
+                return &old_hashtable[hv & hashmask(hashpower + 1)];
+        } else if ((oldbucket = (hv & hashmask(hashpower - 1))) >= expand_bucket) {
+            return &old_hashtable[oldbucket];
+        }
     }
+    return &primary_hashtable[hv & hashmask(hashpower)];
+}
+
+/*
+ * An expired item is passed over rather than ending the walk: migration
+ * reverses chains, so a live item of the same key may come after it.
+ */
+item *HashTable::do_find(const S_CHAR *key, const S_UINT nkey, const S_UINT32 hv) {
+    item **pos = bucket_for(hv);
 
     item *ret = NULL;
     int depth = 0;
-    while (it) {
-        if ((nkey == it->nkey) && (memcmp(key, it->key, nkey) == 0)) {
-            ret = it;
-            break;
+    while (*pos) {
+        item *it = *pos;
+
+        if (key_matches(it, key, nkey, hv)) {
+            if (! is_expired(it)) {
+                ret = it;
+                touch(it);
+                break;
+            }
+            if (expire_func) {
+                expire(pos);
+                continue;
+            }
         }
-        it = it->h_next;
+        pos = &it->h_next;
         ++depth;
     }
     //MEMCACHED_ASSOC_FIND(key, nkey, depth);
     return ret;
 }
 
-/* returns the address of the item pointer before the key.  if *item == 0,
-   the item wasn't found */
+/*
+ * Snapshot of the bucket geometry for lock-free readers. Returns false if a
+ * migration was in progress or happened while reading; try again.
+ */
+bool HashTable::load_view(struct view *v) {
+    v->seq = __atomic_load_n(&migrate_seq, __ATOMIC_ACQUIRE);
+    if (v->seq & 1)
+        return false;
+    v->power = __atomic_load_n(&hashpower, __ATOMIC_RELAXED);
+    v->expanding = __atomic_load_n(&expanding, __ATOMIC_RELAXED);
+    v->shrinking = __atomic_load_n(&shrinking, __ATOMIC_RELAXED);
+    v->expand_bucket = __atomic_load_n(&expand_bucket, __ATOMIC_RELAXED);
+    v->primary = __atomic_load_n(&primary_hashtable, __ATOMIC_RELAXED);
+    v->old = __atomic_load_n(&old_hashtable, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(&migrate_seq, __ATOMIC_RELAXED) == v->seq;
+}
+
+/* true if a miss seen through v may be stale */
+bool HashTable::view_changed(const struct view *v) {
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(&migrate_seq, __ATOMIC_RELAXED) != v->seq;
+}
 
-static item** _hashitem_before (const char *key, const size_t nkey, const uint32_t hv) {
-    item **pos;
+/* bucket_for() against a snapshot */
+item **HashTable::view_bucket(const struct view *v, const S_UINT32 hv) {
     unsigned int oldbucket;
 
-    if (expanding &&
-        (oldbucket = (hv & hashmask(hashpower - 1))) >= expand_bucket)
-    {
-        pos = &old_hashtable[oldbucket];
+    if (v->expanding) {
+        if (v->shrinking) {
+            if ((hv & hashmask(v->power)) >= v->expand_bucket)
+                return &v->old[hv & hashmask(v->power + 1)];
+        } else if ((oldbucket = (hv & hashmask(v->power - 1))) >= v->expand_bucket) {
+            return &v->old[oldbucket];
+        }
+    }
+    return &v->primary[hv & hashmask(v->power)];
+}
+
+/*
+ * Lock-free lookup. The bucket geometry is read as a snapshot validated
+ * against migrate_seq. A hit is always good. A miss only counts if nothing
+ * was migrated while we walked, because a node moved to the primary table
+ * under our feet takes the rest of its old chain with it.
+ */
+item *HashTable::find_lockfree(const S_CHAR *key, const S_UINT nkey, const S_UINT32 hv) {
+    item *it, *ret;
+    struct view v;
+
+    epoch_enter();
+    for (;;) {
+        if (! load_view(&v))
+            continue;
+
+        it = __atomic_load_n(view_bucket(&v, hv), __ATOMIC_ACQUIRE);
+        ret = NULL;
+        while (it) {
+            if (key_matches(it, key, nkey, hv) && ! is_expired(it)) {
+                ret = it;
+                touch(it);
+                break;
+            }
+            it = __atomic_load_n(&it->h_next, __ATOMIC_ACQUIRE);
+        }
+        if (ret)
+            break;
+        if (! view_changed(&v))
+            break;
+    }
+    epoch_exit();
+    return ret;
+}
+
+/*
+ * Up to HASHTABLE_FIND_MANY_GROUP lookups in three stages: prefetch every
+ * bucket slot, read the heads and prefetch the first nodes, then advance
+ * all unresolved chains one hop per pass, prefetching each next node (and
+ * the key of a node whose hash matched) so its miss overlaps with the
+ * other keys' work.
+ *
+ * Locked tables only get the first stage; each key is then found under its
+ * own stripe, as find() would.
+ */
+void HashTable::find_group(const S_CHAR **keys, const S_UINT *nkeys,
+                           const S_UINT32 *hvs, item **out, const S_UINT n) {
+    item *cur[HASHTABLE_FIND_MANY_GROUP];
+    S_UINT pending[HASHTABLE_FIND_MANY_GROUP];
+    bool compare[HASHTABLE_FIND_MANY_GROUP];
+    S_UINT i, npending;
+    struct view v;
+
+    if (concurrent() && ! lockfree) {
+        /* a stale snapshot only wastes a prefetch */
+        if (load_view(&v)) {
+            for (i = 0; i < n; i++)
+                __builtin_prefetch(view_bucket(&v, hvs[i]));
+        }
+        for (i = 0; i < n; i++) {
+            item_lock(hvs[i]);
+            out[i] = do_find(keys[i], nkeys[i], hvs[i]);
+            item_unlock(hvs[i]);
+        }
+        return;
+    }
+
+    if (lockfree) {
+        epoch_enter();
+        while (! load_view(&v))
+            ;
     } else {
-        pos = &primary_hashtable[hv & hashmask(hashpower)];
+        /* nothing moves under us; the caller holds lock() if it has to */
+        v.seq = 0;
+        v.power = hashpower;
+        v.expanding = expanding;
+        v.shrinking = shrinking;
+        v.expand_bucket = expand_bucket;
+        v.primary = primary_hashtable;
+        v.old = old_hashtable;
+    }
+
+    for (i = 0; i < n; i++)
+        __builtin_prefetch(view_bucket(&v, hvs[i]));
+    for (i = 0; i < n; i++) {
+        cur[i] = __atomic_load_n(view_bucket(&v, hvs[i]), __ATOMIC_ACQUIRE);
+        if (cur[i])
+            __builtin_prefetch(cur[i]);
+        compare[i] = false;
+        pending[i] = i;
+    }
+
+    npending = n;
+    while (npending > 0) {
+        for (i = 0; i < npending; ) {
+            S_UINT k = pending[i];
+            item *it = cur[k];
+
+            if (it == NULL) {
+                out[k] = NULL;
+                pending[i] = pending[--npending];
+                continue;
+            }
+            if (inline_nodes) {
+                if (key_matches(it, keys[k], nkeys[k], hvs[k]) && ! is_expired(it)) {
+                    touch(it);
+                    out[k] = it;
+                    pending[i] = pending[--npending];
+                    continue;
+                }
+            } else if ((hvs[k] == it->hv) && (nkeys[k] == it->nkey)) {
+                /* the key lives elsewhere; fetch it and compare next pass */
+                if (! compare[k]) {
+                    compare[k] = true;
+                    __builtin_prefetch(it->key);
+                    i++;
+                    continue;
+                }
+                compare[k] = false;
+                if (memcmp(keys[k], it->key, nkeys[k]) == 0 && ! is_expired(it)) {
+                    touch(it);
+                    out[k] = it;
+                    pending[i] = pending[--npending];
+                    continue;
+                }
+            }
+            cur[k] = __atomic_load_n(&it->h_next, __ATOMIC_ACQUIRE);
+            if (cur[k])
+                __builtin_prefetch(cur[k]);
+            i++;
+        }
     }
 
-    while (*pos && ((nkey != (*pos)->nkey) || memcmp(key, (*pos)->key, nkey))) {
+    if (lockfree) {
+        /* misses through a snapshot that went stale get a fresh lookup */
+        if (view_changed(&v)) {
+            for (i = 0; i < n; i++) {
+                if (out[i] == NULL)
+                    out[i] = find_lockfree(keys[i], nkeys[i], hvs[i]);
+            }
+        }
+        epoch_exit();
+    }
+}
+
+void HashTable::find_many(const S_CHAR **keys, const S_UINT *nkeys,
+                          const S_UINT32 *hvs, item **out, const S_UINT n) {
+    S_UINT i, group;
+
+    for (i = 0; i < n; i += group) {
+        group = n - i < HASHTABLE_FIND_MANY_GROUP ? n - i : HASHTABLE_FIND_MANY_GROUP;
+        find_group(keys + i, nkeys + i, hvs + i, out + i, group);
+    }
+}
+
+item *HashTable::find(const S_CHAR *key, const S_UINT nkey, const S_UINT32 hv) {
+    item *it;
+
+    if (lockfree)
+        return find_lockfree(key, nkey, hv);
+    if (! concurrent())
+        return do_find(key, nkey, hv);
+
+    item_lock(hv);
+    it = do_find(key, nkey, hv);
+    item_unlock(hv);
+    return it;
+}
+
+/* returns the address of the item pointer before the key.  if *item == 0,
+   the item wasn't found */
+
+item **HashTable::hashitem_before(const S_CHAR *key, const S_UINT nkey, const S_UINT32 hv) {
+    item **pos = bucket_for(hv);
+
+    while (*pos && ! key_matches(*pos, key, nkey, hv)) {
         pos = &(*pos)->h_next;
     }
     return pos;
 }
 
-/* grows the hashtable to the next power of 2. */
-static void hashtable_expand(void) {
-    old_hashtable = primary_hashtable;
+/* grows the hashtable to the next power of 2. In concurrent mode the caller
+   holds every stripe. */
+void HashTable::expand(void) {
+    item **bigger = (item**)calloc(hashsize(hashpower + 1), sizeof(void *));
 
-    primary_hashtable = (item**)calloc(hashsize(hashpower + 1), sizeof(void *));
-    if (primary_hashtable) {        
+    if (bigger) {
+        migrate_begin();
+        old_hashtable = primary_hashtable;
+        primary_hashtable = bigger;
         hashpower++;
-        expanding = true;
         expand_bucket = 0;
-        
+        expanding = true;
+        migrate_end();
+
         //STATS_LOCK();
         /* stats.hash_power_level = hashpower; */
         /* stats.hash_bytes += hashsize(hashpower) * sizeof(void *); */
         /* stats.hash_is_expanding = 1; */
         //STATS_UNLOCK();
-        
+
     } else {
-        primary_hashtable = old_hashtable;
         /* Bad news, but we can keep running. */
     }
 }
 
 /*
-  another thread to extend the hashtable
+ * Halves the hashtable. The old buckets b and b + hashsize(hashpower) merge
+ * into primary bucket b; in concurrent mode the stripe count never exceeds
+ * hashsize(hashpower_min - 1), so both share b's stripe. The caller holds
+ * every stripe.
  */
-static void hashtable_start_expand(void) {
+void HashTable::shrink(void) {
+    item **smaller = (item**)calloc(hashsize(hashpower - 1), sizeof(void *));
+
+    if (smaller) {
+        migrate_begin();
+        old_hashtable = primary_hashtable;
+        primary_hashtable = smaller;
+        hashpower--;
+        expand_bucket = 0;
+        shrinking = true;
+        expanding = true;
+        migrate_end();
+    }
+}
+
+/*
+ * Grows past 1.5 items per bucket and shrinks below 1/8, so a table just
+ * resized either way sits well inside both bounds and won't flip back.
+ */
+bool HashTable::resize_wanted(void) const {
+    return hash_items > (hashsize(hashpower) * 3) / 2 ||
+        (hash_items < hashsize(hashpower) / 8 && hashpower > hashpower_min);
+}
+
+/* starts whichever migration the item count asks for; true if one started */
+bool HashTable::resize(void) {
+    if (expanding)
+        return false;
+    if (hash_items > (hashsize(hashpower) * 3) / 2) {
+        expand();
+    } else if (hash_items < hashsize(hashpower) / 8 && hashpower > hashpower_min) {
+        shrink();
+    }
+    return expanding;
+}
+
+/*
+ * Relinks every item, from the old table too if migrating, into a fresh
+ * table of hashsize(power) buckets in one pass. The caller holds every
+ * stripe.
+ */
+void HashTable::rebuild(const unsigned int power) {
+    item **table = (item**)calloc(hashsize(power), sizeof(void *));
+    item **tables[2];
+    unsigned int sizes[2], t, b;
+    item *it, *next;
+
+    if (! table) {
+        fprintf(stderr, "Failed to allocate %lu buckets\n", hashsize(power));
+        return;
+    }
+    tables[0] = primary_hashtable;
+    sizes[0] = hashsize(hashpower);
+    tables[1] = expanding ? old_hashtable : NULL;
+    sizes[1] = shrinking ? hashsize(hashpower + 1) : hashsize(hashpower - 1);
+
+    migrate_begin();
+    for (t = 0; t < 2 && tables[t]; t++) {
+        for (b = 0; b < sizes[t]; b++) {
+            for (it = tables[t][b]; it; it = next) {
+                next = it->h_next;
+                it->h_next = table[it->hv & hashmask(power)];
+                table[it->hv & hashmask(power)] = it;
+            }
+        }
+        if (lockfree)
+            epoch_retire(tables[t], free);
+        else
+            free(tables[t]);
+    }
+    primary_hashtable = table;
+    old_hashtable = NULL;
+    hashpower = power;
+    expand_bucket = 0;
+    expanding = false;
+    shrinking = false;
+    migrate_end();
+}
+
+/*
+ * Makes the table big enough for nitems without expanding, and done
+ * migrating. The caller holds every stripe.
+ */
+void HashTable::grow_for(const size_t nitems) {
+    unsigned int power = hashpower;
+
+    while ((hashsize(power) * 3) / 2 < nitems && power < 32)
+        power++;
+    if (power > hashpower || expanding)
+        rebuild(power);
+}
+
+void HashTable::reserve(const size_t expected_items) {
+    if (concurrent())
+        item_lock_all();
+    grow_for(expected_items);
+    if (hashpower > hashpower_min)
+        hashpower_min = hashpower;
+    if (concurrent())
+        item_unlock_all();
+}
+
+/* one bulk_load() thread's share: the items of buckets lo .. hi - 1 */
+struct HashTable::load_range {
+    HashTable *ht;
+    item **items;
+    const S_UINT32 *hvs;
+    size_t n;
+    S_UINT32 lo, hi;
+    size_t bytes;
+};
+
+/* items this far ahead get their bucket and node prefetched */
+#define LOAD_PREFETCH 16
+/* wheel entries a loader collects before taking wheel_lock */
+#define LOAD_WHEEL_BATCH 64
+
+void HashTable::load_range_run(struct load_range *r) {
+    S_UINT32 mask = hashmask(hashpower);
+    S_UINT32 wheel_hvs[LOAD_WHEEL_BATCH];
+    rel_time_t wheel_times[LOAD_WHEEL_BATCH];
+    unsigned int nwheel = 0, j;
+    size_t i;
+
+    for (i = 0; i < r->n; i++) {
+        S_UINT32 hv = r->hvs[i];
+        item **head;
+        item *it;
+
+        if (i + LOAD_PREFETCH < r->n) {
+            S_UINT32 ahead = r->hvs[i + LOAD_PREFETCH] & mask;
+            if (ahead >= r->lo && ahead < r->hi) {
+                __builtin_prefetch(&primary_hashtable[ahead], 1);
+                __builtin_prefetch(r->items[i + LOAD_PREFETCH], 1);
+            }
+        }
+        if ((hv & mask) < r->lo || (hv & mask) >= r->hi)
+            continue;
+
+        it = r->items[i];
+        it->hv = hv;
+        if (mem_limit)
+            it->it_flags |= ITEM_ACTIVE;
+        /* only if rebuild() couldn't get memory; there is one range then */
+        head = expanding ? bucket_for(hv) : &primary_hashtable[hv & mask];
+        it->h_next = *head;
+        __atomic_store_n(head, it, __ATOMIC_RELEASE);
+        r->bytes += item_size(it);
+
+        if (wheel && node_exptime(it)) {
+            wheel_hvs[nwheel] = hv;
+            wheel_times[nwheel++] = node_exptime(it);
+        }
+        if (nwheel == LOAD_WHEEL_BATCH) {
+            pthread_mutex_lock(&wheel_lock);
+            for (j = 0; j < nwheel; j++)
+                timewheel_add(wheel, wheel_hvs[j], wheel_times[j]);
+            pthread_mutex_unlock(&wheel_lock);
+            nwheel = 0;
+        }
+    }
+    if (nwheel) {
+        pthread_mutex_lock(&wheel_lock);
+        for (j = 0; j < nwheel; j++)
+            timewheel_add(wheel, wheel_hvs[j], wheel_times[j]);
+        pthread_mutex_unlock(&wheel_lock);
+    }
+}
+
+void *HashTable::bulk_load_thread(void *arg) {
+    struct load_range *r = (struct load_range *)arg;
+
+    r->ht->load_range_run(r);
+    return NULL;
+}
+
+/*
+ * Every loader reads all of hvs and links only the items whose bucket is
+ * in its range, so no two write the same bucket and none needs a lock or
+ * an atomic beyond the publishing store.
+ */
+void HashTable::bulk_load(item **items, const S_UINT32 *hvs, const size_t n,
+                          const int nthreads) {
+    struct load_range ranges[HASHTABLE_LOAD_MAX_THREADS];
+    pthread_t tids[HASHTABLE_LOAD_MAX_THREADS];
+    bool started[HASHTABLE_LOAD_MAX_THREADS];
+    unsigned int nt = nthreads < 1 ? 1 : nthreads;
+    unsigned int t;
+    S_UINT32 nbuckets;
+    size_t bytes = 0;
+
+    if (concurrent())
+        item_lock_all();
+    grow_for(hash_items + n);
+
+    nbuckets = hashsize(hashpower);
+    if (nt > HASHTABLE_LOAD_MAX_THREADS)
+        nt = HASHTABLE_LOAD_MAX_THREADS;
+    if (nt > nbuckets)
+        nt = nbuckets;
+    if (expanding)
+        nt = 1;
+    for (t = 0; t < nt; t++) {
+        ranges[t].ht = this;
+        ranges[t].items = items;
+        ranges[t].hvs = hvs;
+        ranges[t].n = n;
+        ranges[t].lo = (S_UINT32)((S_UINT64)nbuckets * t / nt);
+        ranges[t].hi = (S_UINT32)((S_UINT64)nbuckets * (t + 1) / nt);
+        ranges[t].bytes = 0;
+    }
+
+    for (t = 1; t < nt; t++) {
+        started[t] = pthread_create(&tids[t], NULL, bulk_load_thread, &ranges[t]) == 0;
+        /* no thread to be had: do its share here */
+        if (! started[t])
+            load_range_run(&ranges[t]);
+    }
+    load_range_run(&ranges[0]);
+    for (t = 1; t < nt; t++) {
+        if (started[t])
+            pthread_join(tids[t], NULL);
+    }
+
+    for (t = 0; t < nt; t++)
+        bytes += ranges[t].bytes;
+    if (concurrent()) {
+        __sync_add_and_fetch(&hash_items, n);
+        __sync_add_and_fetch(&hash_bytes, bytes);
+        item_unlock_all();
+    } else {
+        hash_items += n;
+        hash_bytes += bytes;
+    }
+}
+
+/* how many steps of expand_bucket the current migration takes */
+unsigned int HashTable::migrate_buckets(void) const {
+    return shrinking ? hashsize(hashpower) : hashsize(hashpower - 1);
+}
+
+/* pushes every item of an old chain onto its primary bucket */
+void HashTable::migrate_chain(item **head) {
+    item *it, *next;
+    int bucket;
+
+    for (it = *head; NULL != it; it = next) {
+        next = it->h_next;
+
+        bucket = it->hv & hashmask(hashpower);
+        it->h_next = primary_hashtable[bucket];
+        __atomic_store_n(&primary_hashtable[bucket], it, __ATOMIC_RELEASE);
+    }
+    *head = NULL;
+}
+
+/* the old chains that feed step b of the migration */
+void HashTable::migrate_bucket(const unsigned int b) {
+    migrate_chain(&old_hashtable[b]);
+    if (shrinking)
+        migrate_chain(&old_hashtable[b + hashsize(hashpower)]);
+}
+
+/* migrates up to hash_bulk_move buckets from the old table to the primary. */
+void HashTable::expand_move(void) {
+    int ii;
+    for (ii = 0; ii < hash_bulk_move && expanding; ++ii) {
+        migrate_bucket(expand_bucket);
+
+        expand_bucket++;
+        if (expand_bucket == migrate_buckets()) {
+            expanding = false;
+            free(old_hashtable);
+            //STATS_LOCK();
+            /* stats.hash_bytes -= hashsize(hashpower - 1) * sizeof(void *); */
+            /* stats.hash_is_expanding = 0; */
+            //STATS_UNLOCK();
+            fprintf(stderr, "Hash table %s done\n", shrinking ? "shrinking" : "expansion");
+            shrinking = false;
+        }
+    }
+}
+
+/*
+ * Concurrent flavour of expand_move(): each bucket is migrated under the
+ * stripe lock that covers it, so readers of other stripes keep running.
+ * Only the mover advances expand_bucket, and it does so while holding the
+ * lock of the bucket being passed, which keeps every reader's old/primary
+ * decision stable for as long as it holds its own stripe.
+ */
+void HashTable::expand_move_striped(void) {
+    int ii;
+    for (ii = 0; ii < hash_bulk_move && expanding; ++ii) {
+        unsigned int b = expand_bucket;
+
+        item_lock(b);
+        if (! expanding || expand_bucket != b) {
+            /* rebuild() finished the migration meanwhile */
+            item_unlock(b);
+            break;
+        }
+        migrate_begin();
+        migrate_bucket(b);
+        __sync_synchronize();
+        expand_bucket = b + 1;
+        if (expand_bucket == migrate_buckets()) {
+            /* no locked reader can be looking at the old table any more:
+               every bucket reads as migrated. Lock-free ones may. */
+            expanding = false;
+            if (lockfree)
+                epoch_retire(old_hashtable, free);
+            else
+                free(old_hashtable);
+            fprintf(stderr, "Hash table %s done\n", shrinking ? "shrinking" : "expansion");
+            shrinking = false;
+        }
+        migrate_end();
+        item_unlock(b);
+    }
+}
+
+/*
+  wake the maintenance thread to resize the hashtable. Without a running
+  maintenance thread the table is resized inline and migrated a few buckets
+  at a time by the following inserts and removes.
+ */
+void HashTable::start_resize(void) {
+    if (concurrent()) {
+        if (! __sync_bool_compare_and_swap(&started_expanding, 0, 1))
+            return;
+        /* with no thread, insert() or remove() picks it up once it drops
+           its stripe */
+        if (maintenance_running) {
+            pthread_mutex_lock(&maintenance_lock);
+            pthread_cond_signal(&maintenance_cond);
+            pthread_mutex_unlock(&maintenance_lock);
+        }
+        return;
+    }
     if (started_expanding)
         return;
-    started_expanding = true;
-    //pthread_cond_signal(&maintenance_cond);
+    started_expanding = 1;
+    if (maintenance_running) {
+        pthread_cond_signal(&maintenance_cond);
+    } else {
+        resize();
+        if (! expanding)
+            started_expanding = 0;
+    }
+}
+
+/* inline expansion for a concurrent table with no maintenance thread; called
+   without any stripe held. maintenance_lock elects a single mover. */
+void HashTable::drive_expansion(void) {
+    if (maintenance_running || ! started_expanding)
+        return;
+    if (pthread_mutex_trylock(&maintenance_lock) != 0)
+        return;
+    if (maintenance_running) {
+        /* the thread came up meanwhile and owns migration now */
+    } else if (started_expanding && ! expanding) {
+        item_lock_all();
+        resize();
+        item_unlock_all();
+        if (! expanding)
+            started_expanding = 0;
+    } else if (expanding) {
+        expand_move_striped();
+        if (! expanding)
+            started_expanding = 0;
+    }
+    pthread_mutex_unlock(&maintenance_lock);
 }
 
 /* Note: this isn't an assoc_update.  The key must not already exist to call this */
-int hashtable_insert(item *it, const S_UINT32 hv) {
-    unsigned int oldbucket;
+int HashTable::do_insert(item *it, const S_UINT32 hv) {
+    item **head;
+    S_UINT nitems;
 
 //    assert(assoc_find(ITEM_key(it), it->nkey) == 0);  /* shouldn't have duplicately named things defined */
+    assert(! inline_nodes || (it->it_flags & ITEM_INLINE));
 
-    if (expanding &&
-        (oldbucket = (hv & hashmask(hashpower - 1))) >= expand_bucket)
-    {
-        it->h_next = old_hashtable[oldbucket];
-        old_hashtable[oldbucket] = it;
-    } else {
-        it->h_next = primary_hashtable[hv & hashmask(hashpower)];
-        primary_hashtable[hv & hashmask(hashpower)] = it;
+    it->hv = hv;
+    /* new items get one pass of the hand before they can go */
+    if (mem_limit)
+        it->it_flags |= ITEM_ACTIVE;
+    head = bucket_for(hv);
+    it->h_next = *head;
+    __atomic_store_n(head, it, __ATOMIC_RELEASE);
+
+    if (wheel && node_exptime(it)) {
+        pthread_mutex_lock(&wheel_lock);
+        timewheel_add(wheel, hv, node_exptime(it));
+        pthread_mutex_unlock(&wheel_lock);
+    }
+    if (wal_log)
+        wal_append_insert(wal_log, node_key(it), node_nkey(it), node_value(it),
+                          node_nvalue(it), node_exptime(it), hv);
+
+    if (concurrent()) {
+        nitems = __sync_add_and_fetch(&hash_items, 1);
+        if (__sync_add_and_fetch(&hash_bytes, item_size(it)) > mem_limit && mem_limit)
+            evict(it);
+        if (! expanding && nitems > (hashsize(hashpower) * 3) / 2)
+            start_resize();
+        return 1;
     }
 
     hash_items++;
+    hash_bytes += item_size(it);
+    if (mem_limit && hash_bytes > mem_limit)
+        evict(it);
     if (! expanding && hash_items > (hashsize(hashpower) * 3) / 2) {
-        hashtable_expand();
-        //hashtable_start_expand();
+        start_resize();
+    } else if (expanding && ! maintenance_running) {
+        expand_move();
+        if (! expanding)
+            started_expanding = 0;
     }
 
     //MEMCACHED_ASSOC_INSERT(ITEM_key(it), it->nkey, hash_items);
     return 1;
 }
 
-void hashtable_delete(const S_CHAR *key, const S_UINT nkey, const S_UINT32 hv) {
-    item **before = _hashitem_before(key, nkey, hv);
+int HashTable::insert(item *it, const S_UINT32 hv) {
+    int ret;
 
-    if (*before) {
-        item *nxt;
+    if (! concurrent()) {
+        ret = do_insert(it, hv);
+    } else {
+        item_lock(hv);
+        ret = do_insert(it, hv);
+        item_unlock(hv);
+        drive_expansion();
+    }
+    if (wal_sync)
+        wal_commit(wal_log);
+    return ret;
+}
+
+/* takes *before out of its chain */
+void HashTable::unlink(item **before) {
+    item *nxt;
+
+    if (concurrent()) {
+        __sync_sub_and_fetch(&hash_items, 1);
+        __sync_sub_and_fetch(&hash_bytes, item_size(*before));
+    } else {
         hash_items--;
+        hash_bytes -= item_size(*before);
+    }
+    nxt = (*before)->h_next;
+    /* a lock-free reader may be standing on it; leave it pointing on */
+    if (! lockfree)
+        (*before)->h_next = 0;   /* probably pointless, but whatever. */
+    __atomic_store_n(before, nxt, __ATOMIC_RELEASE);
+}
+
+/* unlinks the expired *before and hands it to expire_func */
+void HashTable::expire(item **before) {
+    item *it = *before;
+
+    unlink(before);
+    if (concurrent())
+        __sync_add_and_fetch(&expired, 1);
+    else
+        expired++;
+    expire_func(it, expire_arg);
+}
+
+void HashTable::do_remove(const S_CHAR *key, const S_UINT nkey, const S_UINT32 hv) {
+    item **before = hashitem_before(key, nkey, hv);
+
+    if (*before) {
         /* The DTrace probe cannot be triggered as the last instruction
          * due to possible tail-optimization by the compiler
          */
         //MEMCACHED_ASSOC_DELETE(key, nkey, hash_items);
-        nxt = (*before)->h_next;
-        (*before)->h_next = 0;   /* probably pointless, but whatever. */
-        *before = nxt;
+        if (wal_log)
+            wal_append_remove(wal_log, key, nkey, hv);
+        unlink(before);
+        if (! expanding && hash_items < hashsize(hashpower) / 8 &&
+            hashpower > hashpower_min) {
+            start_resize();
+        } else if (expanding && ! concurrent() && ! maintenance_running) {
+            expand_move();
+            if (! expanding)
+                started_expanding = 0;
+        }
         return;
     }
     /* Note:  we never actually get here.  the callers don't delete things
@@ -205,129 +993,412 @@ void hashtable_delete(const S_CHAR *key, const S_UINT nkey, const S_UINT32 hv) {
     assert(*before != 0);
 }
 
+void HashTable::remove(const S_CHAR *key, const S_UINT nkey, const S_UINT32 hv) {
+    if (! concurrent()) {
+        do_remove(key, nkey, hv);
+    } else {
+        item_lock(hv);
+        do_remove(key, nkey, hv);
+        item_unlock(hv);
+        drive_expansion();
+    }
+    if (wal_sync)
+        wal_commit(wal_log);
+}
 
-static volatile int do_run_maintenance_thread = 1;
+/* migrates the next hash_bulk_move buckets; for callers driving expansion
+   themselves instead of running the maintenance thread. */
+void HashTable::move_next_bucket(void) {
+    if (concurrent()) {
+        drive_expansion();
+        return;
+    }
+    expand_move();
+    if (! expanding)
+        started_expanding = 0;
+}
 
-#define DEFAULT_HASH_BULK_MOVE 1
-int hash_bulk_move = DEFAULT_HASH_BULK_MOVE;
+void HashTable::lock(void) {
+    pthread_mutex_lock(&maintenance_lock);
+}
 
-static void hashtable_expand_move() {
-    int ii;
-    for (ii = 0; ii < hash_bulk_move && expanding; ++ii) {
-        item *it, *next;
-        int bucket;
+void HashTable::unlock(void) {
+    pthread_mutex_unlock(&maintenance_lock);
+}
 
-        for (it = old_hashtable[expand_bucket]; NULL != it; it = next) {
-            next = it->h_next;
+void HashTable::freeze(void) {
+    if (concurrent())
+        item_lock_all();
+}
 
-            bucket = hash(it->key, it->nkey, 0) & hashmask(hashpower);
-            it->h_next = primary_hashtable[bucket];
-            primary_hashtable[bucket] = it;
-        }
-        
-        old_hashtable[expand_bucket] = NULL;
+void HashTable::thaw(void) {
+    if (concurrent())
+        item_unlock_all();
+}
 
-        expand_bucket++;
-        if (expand_bucket == hashsize(hashpower - 1)) {
-            expanding = false;
-            free(old_hashtable);            
-            fprintf(stderr, "Hash table expansion done\n");
+void HashTable::walk(hashtable_walk_func fn, void *arg) {
+    item **tables[2];
+    unsigned int sizes[2], t, b;
+    item *it;
+
+    tables[0] = primary_hashtable;
+    sizes[0] = hashsize(hashpower);
+    tables[1] = expanding ? old_hashtable : NULL;
+    sizes[1] = shrinking ? hashsize(hashpower + 1) : hashsize(hashpower - 1);
+    for (t = 0; t < 2 && tables[t]; t++) {
+        for (b = 0; b < sizes[t]; b++) {
+            for (it = tables[t][b]; it; it = it->h_next)
+                fn(it, arg);
         }
-    }    
+    }
 }
-    
 
+/*
+ * The chain the clock hand finds at a primary bucket. While that bucket
+ * hasn't been migrated its items still sit in the old bucket, which holds
+ * both halves and is swept when the hand passes the lower one. Shrinking,
+ * the hand sweeps the lower of the two old buckets and leaves the upper
+ * one until it has been merged.
+ */
+item **HashTable::clock_chain(const unsigned int bucket) {
+    if (expanding && shrinking) {
+        return bucket >= expand_bucket ? &old_hashtable[bucket] : &primary_hashtable[bucket];
+    }
+    if (expanding && (bucket & hashmask(hashpower - 1)) >= expand_bucket) {
+        return bucket < hashsize(hashpower - 1) ? &old_hashtable[bucket] : NULL;
+    }
+    return &primary_hashtable[bucket];
+}
 
-static void *hashtable_maintenance_thread(void *arg) {
+/*
+ * Advances the hand of keep's stripe, which the caller holds, until the
+ * table is back under mem_limit. A stripe owns every item_lock_count-th
+ * bucket, so the hand never needs another lock. Gives up after two turns:
+ * the first may do nothing but clear bits.
+ */
+void HashTable::evict(const item *keep) {
+    S_UINT32 stripes = concurrent() ? item_lock_count : 1;
+    S_UINT32 stripe = keep->hv & (stripes - 1);
+    S_UINT32 nbuckets = hashsize(hashpower) / stripes;
+    S_UINT32 n;
 
-    while (do_run_maintenance_thread) {
-        int ii = 0;
+    for (n = 0; n < 2 * nbuckets && hash_bytes > mem_limit; n++) {
+        item **pos = clock_chain(stripe + (clock_hands[stripe]++ % nbuckets) * stripes);
 
-        /* Lock the cache, and bulk move multiple buckets to the new
-         * hash table. */
-        //item_lock_global();
-        //mutex_lock(&cache_lock);
+        while (pos && *pos && hash_bytes > mem_limit) {
+            item *it = *pos;
 
-        for (ii = 0; ii < hash_bulk_move && expanding; ++ii) {
-            item *it, *next;
-            int bucket;
+            if (it == keep) {
+                pos = &it->h_next;
+                continue;
+            }
+            if (__atomic_load_n(&it->it_flags, __ATOMIC_RELAXED) & ITEM_ACTIVE) {
+                __atomic_fetch_and(&it->it_flags, (S_UINT8)~ITEM_ACTIVE, __ATOMIC_RELAXED);
+                pos = &it->h_next;
+                continue;
+            }
+            unlink(pos);
+            __sync_add_and_fetch(&evicted, 1);
+            if (evict_func)
+                evict_func(it, evict_arg);
+        }
+    }
+}
 
-            for (it = old_hashtable[expand_bucket]; NULL != it; it = next) {
-                next = it->h_next;
+void HashTable::set_memory_limit(const size_t limit, hashtable_evict_func evict_function,
+                                 void *arg) {
+    if (concurrent())
+        item_lock_all();
+    evict_func = evict_function;
+    evict_arg = arg;
+    mem_limit = limit;
+    if (concurrent())
+        item_unlock_all();
+}
+
+/* drops every expired item in hv's chain; the caller holds its stripe */
+void HashTable::expire_chain(const S_UINT32 hv) {
+    item **pos = bucket_for(hv);
 
-                bucket = hash(it->key, it->nkey, 0) & hashmask(hashpower);
-                it->h_next = primary_hashtable[bucket];
-                primary_hashtable[bucket] = it;
+    while (*pos) {
+        if (is_expired(*pos))
+            expire(pos);
+        else
+            pos = &(*pos)->h_next;
+    }
+}
+
+S_UINT HashTable::expire_step(const S_UINT max) {
+    S_UINT32 hvs[64];
+    S_UINT done = 0, n, i, want;
+    rel_time_t now = hashtable_current_time();
+
+    if (! wheel)
+        return 0;
+    while (done < max) {
+        want = max - done < 64 ? max - done : 64;
+        pthread_mutex_lock(&wheel_lock);
+        n = timewheel_expire(wheel, now, hvs, want);
+        pthread_mutex_unlock(&wheel_lock);
+
+        /* one stripe at a time, so nothing waits on more than one chain */
+        for (i = 0; i < n; i++) {
+            if (concurrent()) {
+                item_lock(hvs[i]);
+                expire_chain(hvs[i]);
+                item_unlock(hvs[i]);
+            } else {
+                expire_chain(hvs[i]);
             }
+        }
+        done += n;
+        if (n < want)
+            break;
+    }
+    return done;
+}
 
-            old_hashtable[expand_bucket] = NULL;
+void HashTable::set_expiry(hashtable_evict_func expire_function, void *arg) {
+    if (concurrent())
+        item_lock_all();
+    pthread_mutex_lock(&wheel_lock);
+    if (! wheel)
+        wheel = timewheel_create(hashtable_current_time());
+    expire_func = expire_function;
+    expire_arg = arg;
+    pthread_mutex_unlock(&wheel_lock);
+    if (concurrent())
+        item_unlock_all();
 
-            expand_bucket++;
-            if (expand_bucket == hashsize(hashpower - 1)) {
-                expanding = false;
-                free(old_hashtable);
-                /*
-                STATS_LOCK();
-                stats.hash_bytes -= hashsize(hashpower - 1) * sizeof(void *);
-                stats.hash_is_expanding = 0;
-                STATS_UNLOCK();
-                if (settings.verbose > 1)
-                    fprintf(stderr, "Hash table expansion done\n");
-                */
+    /* a sleeping maintenance thread starts turning the wheel */
+    pthread_mutex_lock(&maintenance_lock);
+    pthread_cond_signal(&maintenance_cond);
+    pthread_mutex_unlock(&maintenance_lock);
+}
+
+void HashTable::set_wal(struct wal *log, const bool sync) {
+    if (concurrent())
+        item_lock_all();
+    wal_log = log;
+    wal_sync = log != NULL && sync;
+    if (concurrent())
+        item_unlock_all();
+}
+
+/*
+ * Waits for a signal; with a wheel to turn, a second at most. If the last
+ * expire_step() left work behind it only lets the workers in for a moment.
+ * Called with maintenance_lock held.
+ */
+void HashTable::maintenance_wait(const bool more_due) {
+    struct timeval tv;
+    struct timespec ts;
+
+    if (more_due) {
+        pthread_mutex_unlock(&maintenance_lock);
+        pthread_mutex_lock(&maintenance_lock);
+        return;
+    }
+    if (! wheel) {
+        pthread_cond_wait(&maintenance_cond, &maintenance_lock);
+        return;
+    }
+    gettimeofday(&tv, NULL);
+    ts.tv_sec = tv.tv_sec + 1;
+    ts.tv_nsec = tv.tv_usec * 1000;
+    pthread_cond_timedwait(&maintenance_cond, &maintenance_lock, &ts);
+}
+
+/* changes how many buckets are migrated per lock hold; <= 0 restores the default. */
+void HashTable::set_bulk_move(const int nbuckets) {
+    pthread_mutex_lock(&maintenance_lock);
+    hash_bulk_move = nbuckets > 0 ? nbuckets : DEFAULT_HASH_BULK_MOVE;
+    pthread_mutex_unlock(&maintenance_lock);
+}
+
+void *HashTable::maintenance_thread(void *arg) {
+    HashTable *ht = (HashTable *)arg;
+    bool more_due = false, resized = false;
+
+    pthread_mutex_lock(&ht->maintenance_lock);
+    while (ht->do_run_maintenance_thread) {
+        if (ht->concurrent()) {
+            /* Migrate under the stripe locks only; workers never wait on
+             * maintenance_lock while holding a stripe for long. */
+            if (ht->expanding) {
+                pthread_mutex_unlock(&ht->maintenance_lock);
+                ht->expand_move_striped();
+                pthread_mutex_lock(&ht->maintenance_lock);
+                continue;
+            }
+            ht->started_expanding = 0;
+            ht->maintenance_wait(more_due || resized);
+            if (ht->do_run_maintenance_thread && ht->wheel) {
+                pthread_mutex_unlock(&ht->maintenance_lock);
+                more_due = ht->expire_step(HASHTABLE_EXPIRE_STEP) == HASHTABLE_EXPIRE_STEP;
+                pthread_mutex_lock(&ht->maintenance_lock);
             }
+            /* after a resize, look again: a purge may want several steps */
+            resized = false;
+            if (ht->do_run_maintenance_thread &&
+                (ht->started_expanding || ht->resize_wanted())) {
+                pthread_mutex_unlock(&ht->maintenance_lock);
+                ht->item_lock_all();
+                resized = ht->resize();
+                ht->item_unlock_all();
+                pthread_mutex_lock(&ht->maintenance_lock);
+                if (! ht->expanding)
+                    ht->started_expanding = 0;
+            }
+            continue;
         }
 
-        //mutex_unlock(&cache_lock);
-        //item_unlock_global();
-
-        // TODO        
-        if (!expanding) {
-            /* finished expanding. tell all threads to use fine-grained locks */
-            //switch_item_lock_type(ITEM_LOCK_GRANULAR);
-            //slabs_rebalancer_resume();
-            /* We are done expanding.. just wait for next invocation */
-            //mutex_lock(&cache_lock);
-            //started_expanding = false;
-            //pthread_cond_wait(&maintenance_cond, &cache_lock);
-            /* Before doing anything, tell threads to use a global lock */
-            /* mutex_unlock(&cache_lock); */
-            /* slabs_rebalancer_pause(); */
-            /* switch_item_lock_type(ITEM_LOCK_GLOBAL); */
-            /* mutex_lock(&cache_lock); */
-            /* hashtable_expand(); */
-            /* mutex_unlock(&cache_lock); */
+        /* Bulk move multiple buckets to the new hash table while we hold
+         * the lock, then let the workers back in. */
+        ht->expand_move();
+
+        if (!ht->expanding) {
+            /* We are done resizing.. just wait for next invocation */
+            ht->started_expanding = 0;
+            ht->maintenance_wait(more_due || resized);
+            /* workers are out while we hold the lock; keep the steps small */
+            if (ht->do_run_maintenance_thread && ht->wheel)
+                more_due = ht->expire_step(HASHTABLE_EXPIRE_STEP) == HASHTABLE_EXPIRE_STEP;
+            resized = false;
+            if (ht->do_run_maintenance_thread &&
+                (ht->started_expanding || ht->resize_wanted())) {
+                resized = ht->resize();
+                if (! ht->expanding)
+                    ht->started_expanding = 0;
+            }
+        } else {
+            pthread_mutex_unlock(&ht->maintenance_lock);
+            pthread_mutex_lock(&ht->maintenance_lock);
         }
     }
+    pthread_mutex_unlock(&ht->maintenance_lock);
     return NULL;
 }
 
-//static pthread_t maintenance_tid;
-
-int start_hashtable_maintenance_thread() {
-    /* int ret; */
-    /* char *env = getenv("MEMCACHED_HASH_BULK_MOVE"); */
-    /* if (env != NULL) { */
-    /*     hash_bulk_move = atoi(env); */
-    /*     if (hash_bulk_move == 0) { */
-    /*         hash_bulk_move = DEFAULT_HASH_BULK_MOVE; */
-    /*     } */
-    /* } */
-    /* if ((ret = pthread_create(&maintenance_tid, NULL, */
-    /*                           assoc_maintenance_thread, NULL)) != 0) { */
-    /*     fprintf(stderr, "Can't create thread: %s\n", strerror(ret)); */
-    /*     return -1; */
-    /* } */
+int HashTable::start_maintenance_thread(void) {
+    int ret;
+    char *env = getenv("HASHTABLE_BULK_MOVE");
+    if (env != NULL) {
+        hash_bulk_move = atoi(env);
+        if (hash_bulk_move <= 0) {
+            hash_bulk_move = DEFAULT_HASH_BULK_MOVE;
+        }
+    }
+    pthread_mutex_lock(&maintenance_lock);
+    do_run_maintenance_thread = 1;
+    if ((ret = pthread_create(&maintenance_tid, NULL,
+                              maintenance_thread, this)) != 0) {
+        pthread_mutex_unlock(&maintenance_lock);
+        fprintf(stderr, "Can't create thread: %s\n", strerror(ret));
+        return -1;
+    }
+    maintenance_running = true;
+    /* an expansion requested before the thread existed is already underway
+       inline; the thread picks it up from expand_bucket. */
+    pthread_mutex_unlock(&maintenance_lock);
     return 0;
 }
 
-void stop_hashtable_maintenance_thread() {
-    /* mutex_lock(&cache_lock); */
-    /* do_run_maintenance_thread = 0; */
-    /* pthread_cond_signal(&maintenance_cond); */
-    /* mutex_unlock(&cache_lock); */
+void HashTable::stop_maintenance_thread(void) {
+    pthread_mutex_lock(&maintenance_lock);
+    if (! maintenance_running) {
+        pthread_mutex_unlock(&maintenance_lock);
+        return;
+    }
+    do_run_maintenance_thread = 0;
+    pthread_cond_signal(&maintenance_cond);
+    pthread_mutex_unlock(&maintenance_lock);
 
     /* Wait for the maintenance thread to stop */
-    //pthread_join(maintenance_tid, NULL);
+    pthread_join(maintenance_tid, NULL);
+    pthread_mutex_lock(&maintenance_lock);
+    maintenance_running = false;
+    /* a request the thread never saw would otherwise block every later one */
+    if (! concurrent() && ! expanding)
+        started_expanding = 0;
+    pthread_mutex_unlock(&maintenance_lock);
+}
+
+/*
+ * C interface over a single process-wide table, for callers that predate
+ * HashTable.
+ */
+static HashTable *default_hashtable = 0;
+
+void hashtable_init(const int ht_init) {
+    if (default_hashtable)
+        delete default_hashtable;
+    default_hashtable = new HashTable(ht_init);
 }
 
+item *hashtable_find(const S_CHAR *key, const S_UINT nkey, const S_UINT32 hv) {
+    return default_hashtable->find(key, nkey, hv);
+}
+
+void hashtable_find_many(const S_CHAR **keys, const S_UINT *nkeys,
+                         const S_UINT32 *hvs, item **out, const S_UINT n) {
+    default_hashtable->find_many(keys, nkeys, hvs, out, n);
+}
+
+void hashtable_reserve(const size_t expected_items) {
+    default_hashtable->reserve(expected_items);
+}
+
+void hashtable_bulk_load(item **items, const S_UINT32 *hvs, const size_t n,
+                         const int nthreads) {
+    default_hashtable->bulk_load(items, hvs, n, nthreads);
+}
+
+int hashtable_insert(item *it, const S_UINT32 hv) {
+    return default_hashtable->insert(it, hv);
+}
 
+void hashtable_delete(const S_CHAR *key, const S_UINT nkey, const S_UINT32 hv) {
+    default_hashtable->remove(key, nkey, hv);
+}
+
+void do_hashtable_move_next_bucket(void) {
+    default_hashtable->move_next_bucket();
+}
+
+int start_hashtable_maintenance_thread(void) {
+    return default_hashtable->start_maintenance_thread();
+}
+
+void stop_hashtable_maintenance_thread(void) {
+    default_hashtable->stop_maintenance_thread();
+}
+
+void hashtable_set_bulk_move(const int nbuckets) {
+    default_hashtable->set_bulk_move(nbuckets);
+}
+
+void hashtable_set_memory_limit(const size_t limit, hashtable_evict_func evict,
+                                void *arg) {
+    default_hashtable->set_memory_limit(limit, evict, arg);
+}
+
+void hashtable_set_expiry(hashtable_evict_func expire, void *arg) {
+    default_hashtable->set_expiry(expire, arg);
+}
+
+void hashtable_set_wal(struct wal *log, const bool sync) {
+    default_hashtable->set_wal(log, sync);
+}
+
+void hashtable_lock(void) {
+    default_hashtable->lock();
+}
+
+void hashtable_unlock(void) {
+    default_hashtable->unlock();
+}
+
+unsigned int hashtable_hashpower(void) {
+    return default_hashtable->power();
+}
@@ -3,35 +3,473 @@
 
 #include <stddef.h>
 #include <stdint.h>
+#include <string.h>
+#include <pthread.h>
 #include "main.h"
-#include "win.h"
+#include "portable.h"
 
 typedef struct node item, *pitem;
 
-void hashtable_init(const int hashpower_init);
-item *hashtable_find(const S_CHAR *key, const S_UINT nkey, const S_UINT32 hv);
-int hashtable_insert(item *item, const S_UINT32 hv);
-void hashtable_delete(const S_CHAR *key, const S_UINT nkey, const S_UINT32 hv);
-void do_hashtable_move_next_bucket(void);
-int start_hashtable_maintenance_thread(void);
-void stop_hashtable_maintenance_thread(void);
-//extern unsigned int hashpower;
-
+/* seconds on the clock of hashtable_current_time() */
+typedef S_UINT32 rel_time_t;
 
 /*
-  TODO
-  this only can deal with single char but wide char,
-  i think I will extent the function to wide char later with template
+  Keys are S_CHAR; BasicHashTable in basichashtable.h stores keys of other
+  char widths, S_WCHAR included. It is a separate, smaller table, not this
+  one templated: single-threaded, with no striping, lock-free reads, TTL,
+  eviction, shrinking or inline keys, and its own copy of the bucket
+  choice and incremental expansion. Its bucket_for() and expand_move()
+  follow HashTable's expansion (hashpower + 1, old buckets below
+  expand_bucket migrated), so a change to how this table expands must be
+  made there too. Keys that need any of the rest belong here, as bytes.
  */
 struct node {
-    S_CHAR * key;
+    struct node* h_next;
+    /* full hash of the key, set on insert; saves rehashing on migration
+       and rejects most chain mismatches without touching the key */
+    S_UINT32 hv;
+    S_UINT8 it_flags;
+    /* slab class the node was allocated from, 0 if not from the slabs */
+    S_UINT8 slabs_clsid;
     S_UINT nkey;
-    S_CHAR* value;
+    S_CHAR * key;
     S_UINT32 nvalue;
+    /* when the item expires, 0 for never */
+    rel_time_t exptime;
+    S_CHAR* value;
+};
+
+/* it_flags */
+#define ITEM_INLINE 1       /* the node is a struct node_inline */
+#define ITEM_ACTIVE 2       /* found since the eviction hand last passed */
+#define ITEM_EXPTIME 4      /* a node_inline with an exptime after its value */
+
+#define ITEM_INLINE_KEY_MAX 16
+#define ITEM_INLINE_VALUE_MAX 0xffff
+
+/*
+  Compact node for short keys. It shares the first fields with struct node;
+  the key follows the header directly and the value follows the key, so a
+  probe compares the key on the line it already loaded for hv.
+ */
+struct node_inline {
     struct node* h_next;
+    S_UINT32 hv;
+    S_UINT8 it_flags;
+    S_UINT8 slabs_clsid;
+    S_UINT16 nvalue;
+    S_UINT8 nkey;
+    /* key, then value; the allocation runs past the end of the struct */
+    S_CHAR data[ITEM_INLINE_KEY_MAX];
 };
 
+#define ITEM_inline(it) ((struct node_inline *)(it))
+#define ITEM_inline_size(nkey, nvalue) \
+    (offsetof(struct node_inline, data) + (nkey) + (nvalue))
+/* what a node_inline takes, counting the exptime if it has one */
+#define ITEM_inline_ntotal(it) \
+    (ITEM_inline_size(ITEM_inline(it)->nkey, ITEM_inline(it)->nvalue) + \
+     (((it)->it_flags & ITEM_EXPTIME) ? sizeof(rel_time_t) : 0))
+
+/* field access that works for either layout */
+#define ITEM_key(it) (((it)->it_flags & ITEM_INLINE) ? \
+                      ITEM_inline(it)->data : (it)->key)
+#define ITEM_nkey(it) (((it)->it_flags & ITEM_INLINE) ? \
+                       (S_UINT)ITEM_inline(it)->nkey : (it)->nkey)
+#define ITEM_value(it) (((it)->it_flags & ITEM_INLINE) ? \
+                        ITEM_inline(it)->data + ITEM_inline(it)->nkey : (it)->value)
+#define ITEM_nvalue(it) (((it)->it_flags & ITEM_INLINE) ? \
+                         (S_UINT32)ITEM_inline(it)->nvalue : (it)->nvalue)
+
+static inline rel_time_t item_exptime(const item *it) {
+    rel_time_t exptime = 0;
 
+    if (! (it->it_flags & ITEM_INLINE))
+        return it->exptime;
+    /* unaligned, after the value */
+    if (it->it_flags & ITEM_EXPTIME)
+        memcpy(&exptime, ITEM_value(it) + ITEM_inline(it)->nvalue, sizeof(exptime));
+    return exptime;
+}
+
+/*
+  Seconds since the first call, plus a little so that no live exptime is
+  0. Monotonic; item exptimes are on this clock.
+ */
+rel_time_t hashtable_current_time(void);
+
+/*
+  Hash function policy. Tables hash with it whenever the caller doesn't
+  pass hv, and callers that do must use the same function. Nodes cache
+  their hv, so expansion never rehashes whatever the policy.
+ */
+typedef S_UINT32 (*hashtable_hash_func)(const void *key, const S_UINT nkey);
+/* Jenkins lookup3, hash() in hash.c; the default */
+S_UINT32 hashtable_hash_lookup3(const void *key, const S_UINT nkey);
+S_UINT32 hashtable_hash_times33(const void *key, const S_UINT nkey);
+/* hash64() folded to 32 bits */
+S_UINT32 hashtable_hash_fast64(const void *key, const S_UINT nkey);
+
+/* how many keys find_many() keeps in flight at once */
+#define HASHTABLE_FIND_MANY_GROUP 16
+/* timing wheel entries the maintenance thread handles per step */
+#define HASHTABLE_EXPIRE_STEP 256
+/* most threads bulk_load() runs */
+#define HASHTABLE_LOAD_MAX_THREADS 64
+
+/*
+  Called with each item evicted to stay under the memory limit, already
+  unlinked, under the stripe lock of its hash. The item is the callee's to
+  free; with HASHTABLE_LOCKFREE_READS through epoch_retire().
+ */
+typedef void (*hashtable_evict_func)(item *it, void *arg);
+/* called by HashTable::walk() with each linked item */
+typedef void (*hashtable_walk_func)(const item *it, void *arg);
+
+enum hashtable_flags {
+    /*
+     * find() walks chains without taking any lock. Writers still use the
+     * stripes. Items taken out with remove() must then be freed through
+     * epoch_retire(), and a caller that keeps using an item after find()
+     * returns must hold its own epoch_enter()/epoch_exit() section.
+     */
+    HASHTABLE_LOCKFREE_READS = 1,
+    /*
+     * Every node is a struct node_inline (see slabs_item_alloc_inline()), so
+     * key compares never leave the node. Without it nodes are plain struct
+     * node and it_flags is never read.
+     */
+    HASHTABLE_INLINE_KEYS = 2
+};
+
+/*
+  A chained hashtable that owns its buckets, expansion cursor, lock and
+  maintenance thread, so a process can run several independent shards.
 
+  Constructed with nthreads > 0 the table is concurrent: find/insert/remove
+  take a striped bucket lock themselves and may be called from any number
+  of threads at once. The do_* variants skip the locking for callers that
+  already hold item_lock(hv). HASHTABLE_LOCKFREE_READS implies concurrent.
+ */
+class HashTable {
+public:
+    explicit HashTable(const int hashpower_init = 0, const int nthreads = 0,
+                       const int flags = 0,
+                       hashtable_hash_func hash_func = hashtable_hash_lookup3);
+    ~HashTable();
+
+    S_UINT32 hash_key(const S_CHAR *key, const S_UINT nkey) const {
+        return hash_func(key, nkey);
+    }
+    item *find(const S_CHAR *key, const S_UINT nkey) {
+        return find(key, nkey, hash_key(key, nkey));
+    }
+    int insert(item *it) {
+        return insert(it, hash_key(node_key(it), node_nkey(it)));
+    }
+    void remove(const S_CHAR *key, const S_UINT nkey) {
+        remove(key, nkey, hash_key(key, nkey));
+    }
+
+    item *find(const S_CHAR *key, const S_UINT nkey, const S_UINT32 hv);
+    int insert(item *it, const S_UINT32 hv);
+    void remove(const S_CHAR *key, const S_UINT nkey, const S_UINT32 hv);
+    void move_next_bucket(void);
+    /*
+     * out[i] = find(keys[i], nkeys[i], hvs[i]) for n keys. All bucket heads
+     * are prefetched before any is read and the chains are walked a hop at
+     * a time across keys, so the cache misses overlap instead of queueing.
+     */
+    void find_many(const S_CHAR **keys, const S_UINT *nkeys,
+                   const S_UINT32 *hvs, item **out, const S_UINT n);
+    /*
+     * Sizes the table for expected_items so that inserting them expands
+     * nothing: grows it at once, relinking what it holds in one pass and
+     * finishing any migration, and never shrinks it below that again.
+     * Meant for startup; locked readers wait for the relink.
+     */
+    void reserve(const size_t expected_items);
+    /*
+     * insert(items[i], hvs[i]) for n items, as when warming from a
+     * snapshot. The table is sized for them first, then the chains are
+     * built with every stripe held and no expansion in between, nthreads
+     * threads each linking the items of its own range of buckets. The keys
+     * must not be present. The memory limit isn't enforced until the next
+     * insert.
+     */
+    void bulk_load(item **items, const S_UINT32 *hvs, const size_t n,
+                   const int nthreads);
+
+    item *do_find(const S_CHAR *key, const S_UINT nkey, const S_UINT32 hv);
+    int do_insert(item *it, const S_UINT32 hv);
+    void do_remove(const S_CHAR *key, const S_UINT nkey, const S_UINT32 hv);
+    void item_lock(const S_UINT32 hv);
+    void item_unlock(const S_UINT32 hv);
+    bool concurrent(void) const { return item_lock_count != 0; }
+    bool lockfree_reads(void) const { return lockfree; }
+    bool inline_keys(void) const { return inline_nodes; }
+
+    int start_maintenance_thread(void);
+    void stop_maintenance_thread(void);
+    void set_bulk_move(const int nbuckets);
+    /*
+     * Caps what linked items take (node, key and value) at limit bytes; 0
+     * lifts the cap. Once over it, insert() evicts with CLOCK: each lock
+     * stripe sweeps a hand over its own buckets, clearing ITEM_ACTIVE and
+     * evicting items whose bit was already clear. find() only sets the bit
+     * when it isn't set, so hot items cost no writes. The item being
+     * inserted is never evicted. Nodes need their it_flags initialized.
+     */
+    void set_memory_limit(const size_t limit, hashtable_evict_func evict_function,
+                          void *arg);
+    /*
+     * Items whose exptime has passed are never found. Once this is called
+     * they are also unlinked and handed to expire_function, with the same
+     * contract as an evict callback: by a locked find() that runs into
+     * one, and by a timing wheel that remembers the hash of every item
+     * inserted with an exptime and revisits its chain when it comes due.
+     * Items inserted before the call aren't on the wheel.
+     */
+    void set_expiry(hashtable_evict_func expire_function, void *arg);
+    /*
+     * Revisits the chains of up to max wheel entries that have come due
+     * and returns how many it took. The maintenance thread calls it every
+     * second; without one, call it periodically (under lock() if the table
+     * isn't concurrent). A return of max means more may be due.
+     */
+    S_UINT expire_step(const S_UINT max);
+    /*
+     * Holds the table still for walk(): takes every stripe, so inserts,
+     * removes and migration steps wait until thaw(), and the table stays
+     * at one point between two migration steps. Lock-free readers go on.
+     * A table that isn't concurrent is held by the caller's lock() instead.
+     */
+    void freeze(void);
+    void thaw(void);
+    /*
+     * Calls fn on every linked item, expired ones too, from the primary
+     * table and, mid-migration, the old one. Call it between freeze() and
+     * thaw(); fn must not call back into the table.
+     */
+    void walk(hashtable_walk_func fn, void *arg);
+    /*
+     * Logs every insert and remove to log (see wal.h) under the stripe lock
+     * of the key, so the log has each key's changes in table order. With
+     * sync, insert() and remove() return only once their record is synced;
+     * the do_* variants never wait. Evictions, expiries and bulk_load()
+     * aren't logged. NULL stops logging. Change it only while no insert()
+     * or remove() is running.
+     */
+    void set_wal(struct wal *log, const bool sync);
+    /* serialize find/insert/remove against the maintenance thread */
+    void lock(void);
+    void unlock(void);
+
+    unsigned int power(void) const { return hashpower; }
+    S_UINT items(void) const { return hash_items; }
+    size_t bytes(void) const { return hash_bytes; }
+    S_UINT64 evictions(void) const { return evicted; }
+    S_UINT64 expirations(void) const { return expired; }
+    bool is_expanding(void) const { return expanding; }
+
+private:
+    const S_CHAR *node_key(const item *it) const {
+        return inline_nodes ? ITEM_inline(it)->data : it->key;
+    }
+    S_UINT node_nkey(const item *it) const {
+        return inline_nodes ? ITEM_inline(it)->nkey : it->nkey;
+    }
+    bool key_matches(const item *it, const S_CHAR *key, const S_UINT nkey,
+                     const S_UINT32 hv) const {
+        return hv == it->hv && nkey == node_nkey(it) &&
+            memcmp(key, node_key(it), nkey) == 0;
+    }
+    const S_CHAR *node_value(const item *it) const {
+        return inline_nodes ? ITEM_inline(it)->data + ITEM_inline(it)->nkey : it->value;
+    }
+    S_UINT32 node_nvalue(const item *it) const {
+        return inline_nodes ? ITEM_inline(it)->nvalue : it->nvalue;
+    }
+    size_t item_size(const item *it) const {
+        return inline_nodes ? ITEM_inline_ntotal(it) :
+            sizeof(item) + it->nkey + it->nvalue;
+    }
+    rel_time_t node_exptime(const item *it) const {
+        return inline_nodes ? item_exptime(it) : it->exptime;
+    }
+    bool is_expired(const item *it) const {
+        rel_time_t exptime = node_exptime(it);
+        return exptime != 0 && exptime <= hashtable_current_time();
+    }
+    /* marks a hit for the eviction hand; no write if already marked */
+    void touch(item *it) {
+        if (mem_limit && ! (__atomic_load_n(&it->it_flags, __ATOMIC_RELAXED) & ITEM_ACTIVE))
+            __atomic_fetch_or(&it->it_flags, ITEM_ACTIVE, __ATOMIC_RELAXED);
+    }
+
+    /* the table geometry a reader walks, as of one migrate_seq */
+    struct view {
+        unsigned int seq;
+        unsigned int power;
+        bool expanding;
+        bool shrinking;
+        unsigned int expand_bucket;
+        item **primary;
+        item **old;
+    };
+
+    item **bucket_for(const S_UINT32 hv);
+    bool load_view(struct view *v);
+    bool view_changed(const struct view *v);
+    static item **view_bucket(const struct view *v, const S_UINT32 hv);
+    item *find_lockfree(const S_CHAR *key, const S_UINT nkey, const S_UINT32 hv);
+    void find_group(const S_CHAR **keys, const S_UINT *nkeys,
+                    const S_UINT32 *hvs, item **out, const S_UINT n);
+    void migrate_begin(void);
+    void migrate_end(void);
+    item **hashitem_before(const S_CHAR *key, const S_UINT nkey, const S_UINT32 hv);
+    void unlink(item **before);
+    item **clock_chain(const unsigned int bucket);
+    void evict(const item *keep);
+    void expire(item **before);
+    void expire_chain(const S_UINT32 hv);
+    void maintenance_wait(const bool more_due);
+    bool resize_wanted(void) const;
+    bool resize(void);
+    void rebuild(const unsigned int power);
+    void grow_for(const size_t nitems);
+    struct load_range;
+    void load_range_run(struct load_range *r);
+    static void *bulk_load_thread(void *arg);
+    void expand(void);
+    void shrink(void);
+    void migrate_chain(item **head);
+    void migrate_bucket(const unsigned int b);
+    unsigned int migrate_buckets(void) const;
+    void expand_move(void);
+    void expand_move_striped(void);
+    void start_resize(void);
+    void drive_expansion(void);
+    void item_lock_all(void);
+    void item_unlock_all(void);
+    static void *maintenance_thread(void *arg);
+
+    /* not copyable */
+    HashTable(const HashTable &);
+    HashTable &operator=(const HashTable &);
+
+    hashtable_hash_func hash_func;
+
+    /* how many powers of 2's worth of buckets we use */
+    unsigned int hashpower;
+    /* shrinking stops here: the initial size */
+    unsigned int hashpower_min;
+
+    /* Main hash table. This is where we look except during expansion. */
+    item **primary_hashtable;
+
+    /*
+     * Previous hash table. During expansion, we look here for keys that haven't
+     * been moved over to the primary yet.
+     */
+    item **old_hashtable;
+
+    /* Number of items in the hash table. */
+    S_UINT hash_items;
+
+    /*
+     * Flag: Are we in the middle of expanding now? Also set while shrinking,
+     * which migrates the same way in the other direction.
+     */
+    volatile bool expanding;
+    volatile bool shrinking;
+    /* a resize has been asked for and not finished yet */
+    volatile int started_expanding;
+
+    /*
+     * During expansion we migrate values with bucket granularity; this is how
+     * far we've gotten so far. Ranges from 0 .. hashsize(hashpower - 1) - 1.
+     * Shrinking, it counts primary buckets: 0 .. hashsize(hashpower) - 1,
+     * each filled from old buckets b and b + hashsize(hashpower).
+     */
+    volatile unsigned int expand_bucket;
+
+    /*
+     * Striped bucket locks, indexed by hv & (item_lock_count - 1). The
+     * count never exceeds hashsize(hashpower - 1), so an old bucket and the
+     * primary buckets it splits into always share a stripe and migration
+     * only needs that one lock. Holding every stripe is the global window
+     * used to swap tables. Zero when the table isn't concurrent.
+     */
+    pthread_mutex_t *item_locks;
+    S_UINT32 item_lock_count;
+
+    /*
+     * Lock-free readers. migrate_seq is odd while a bucket is being migrated
+     * or the tables are swapped; a reader that misses retries if it moved.
+     */
+    bool lockfree;
+    volatile unsigned int migrate_seq;
+
+    /* HASHTABLE_INLINE_KEYS */
+    bool inline_nodes;
+
+    /* Bytes of the linked items, see item_size(); capped at mem_limit if set. */
+    volatile size_t hash_bytes;
+    size_t mem_limit;
+    hashtable_evict_func evict_func;
+    void *evict_arg;
+    /* per stripe, the next of its buckets to sweep; one if not concurrent */
+    unsigned int *clock_hands;
+    volatile S_UINT64 evicted;
+
+    /* set_expiry(); wheel_lock guards the wheel and nests inside stripes */
+    hashtable_evict_func expire_func;
+    void *expire_arg;
+    struct timewheel *wheel;
+    pthread_mutex_t wheel_lock;
+    volatile S_UINT64 expired;
+
+    /* set_wal() */
+    struct wal *wal_log;
+    bool wal_sync;
+
+    int hash_bulk_move;
+
+    /*
+     * Guards the table while the maintenance thread migrates buckets. Callers
+     * must hold it (lock()) around find/insert/remove once the maintenance
+     * thread has been started.
+     */
+    pthread_mutex_t maintenance_lock;
+    pthread_cond_t maintenance_cond;
+    pthread_t maintenance_tid;
+    volatile int do_run_maintenance_thread;
+    /* Set once start_maintenance_thread() has brought the thread up. */
+    bool maintenance_running;
+};
+
+/* C interface over a single process-wide HashTable */
+void hashtable_init(const int hashpower_init);
+item *hashtable_find(const S_CHAR *key, const S_UINT nkey, const S_UINT32 hv);
+void hashtable_find_many(const S_CHAR **keys, const S_UINT *nkeys,
+                         const S_UINT32 *hvs, item **out, const S_UINT n);
+void hashtable_reserve(const size_t expected_items);
+void hashtable_bulk_load(item **items, const S_UINT32 *hvs, const size_t n,
+                         const int nthreads);
+int hashtable_insert(item *item, const S_UINT32 hv);
+void hashtable_delete(const S_CHAR *key, const S_UINT nkey, const S_UINT32 hv);
+void do_hashtable_move_next_bucket(void);
+int start_hashtable_maintenance_thread(void);
+void stop_hashtable_maintenance_thread(void);
+void hashtable_set_bulk_move(const int nbuckets);
+void hashtable_set_memory_limit(const size_t limit, hashtable_evict_func evict,
+                                void *arg);
+void hashtable_set_expiry(hashtable_evict_func expire, void *arg);
+void hashtable_set_wal(struct wal *log, const bool sync);
+/* serialize find/insert/delete against the maintenance thread */
+void hashtable_lock(void);
+void hashtable_unlock(void);
+unsigned int hashtable_hashpower(void);
 
 #endif
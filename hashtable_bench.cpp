@@ -0,0 +1,623 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * Hashtable benchmarks.
+ *
+ *   hashtable_bench [nkeys] [lookups per thread]
+ *
+ * Prints single-threaded hit and miss latency for the chained and open
+ * addressing engines and for find_many() batches on the chained one, then
+ * lookups per second for the striped mutex read path and the lock-free read
+ * path at 1 to 64 reader threads. Last, memory per million keys and hit
+ * latency for nodes with separately allocated keys and values, slab nodes
+ * and inline-key nodes. Then how long filling a table takes, as on a
+ * restart: insert() one by one, after reserve(), and bulk_load() on 1 to 4
+ * threads, and what a snapshot of the table costs to write, to open and
+ * serve finds from, and to load back. Last, insert throughput with a
+ * write-ahead log at several sync intervals, without waiting for the sync
+ * and with BENCH_WAL_THREADS threads each waiting for its own, and how
+ * fast the log replays. Then S_WCHAR keys found natively in a
+ * BasicHashTable against the same keys encoded to UTF-8 for each lookup.
+ */
+#include "hashtable.h"
+#include "openhashtable.h"
+#include "hash.h"
+#include "slabs.h"
+#include "snapshot.h"
+#include "wal.h"
+#include "basichashtable.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+
+#define BENCH_MAX_THREADS 64
+#define BENCH_VALUE_SIZE 8
+#define BENCH_WAL_THREADS 4
+/* inserts per thread that wait for their sync */
+#define BENCH_WAL_COMMITS 250
+
+enum node_layout { LAYOUT_MALLOC, LAYOUT_SLAB, LAYOUT_INLINE };
+
+typedef struct {
+    HashTable *ht;
+    item *items;
+    S_UINT32 *hvs;
+    unsigned int nkeys;
+    unsigned int nlookups;
+    unsigned int seed;
+    unsigned int hits;
+} reader_arg;
+
+static double now(void) {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static item *make_items(const char *prefix, const unsigned int nkeys,
+                        S_UINT32 **hvs) {
+    item *items = (item *)calloc(nkeys, sizeof(item));
+    unsigned int i;
+
+    *hvs = (S_UINT32 *)malloc(nkeys * sizeof(S_UINT32));
+    if (items == NULL || *hvs == NULL) {
+        fprintf(stderr, "Failed to allocate %u keys\n", nkeys);
+        exit(EXIT_FAILURE);
+    }
+    for (i = 0; i < nkeys; i++) {
+        char *key = (char *)malloc(32);
+        items[i].nkey = snprintf(key, 32, "%s:%u", prefix, i);
+        items[i].key = key;
+        (*hvs)[i] = hash(key, items[i].nkey, 0);
+    }
+    return items;
+}
+
+/* times nlookups random finds against keys that are all present, or all not */
+template <class Table>
+static double lookup_ns(Table *ht, item *items, S_UINT32 *hvs,
+                        const unsigned int nkeys, const unsigned int nlookups) {
+    unsigned int x = 1, i, found = 0;
+    double start = now();
+
+    for (i = 0; i < nlookups; i++) {
+        unsigned int k;
+        x = x * 1103515245 + 12345;
+        k = (x >> 8) % nkeys;
+        if (ht->find(items[k].key, items[k].nkey, hvs[k]))
+            found++;
+    }
+    /* keep the loop from being optimized away */
+    if (found == 0xffffffff)
+        printf("?");
+    return (now() - start) * 1e9 / nlookups;
+}
+
+template <class Table>
+static void bench_engine(const char *name, Table *ht, item *items,
+                         S_UINT32 *hvs, item *misses, S_UINT32 *miss_hvs,
+                         const unsigned int nkeys, const unsigned int nlookups) {
+    unsigned int i;
+
+    for (i = 0; i < nkeys; i++) {
+        ht->insert(&items[i], hvs[i]);
+    }
+    printf("%-10s hit %6.1f ns  miss %6.1f ns\n", name,
+           lookup_ns(ht, items, hvs, nkeys, nlookups),
+           lookup_ns(ht, misses, miss_hvs, nkeys, nlookups));
+}
+
+/* lookup_ns() through find_many(), HASHTABLE_FIND_MANY_GROUP keys per call */
+static double find_many_ns(HashTable *ht, item *items, S_UINT32 *hvs,
+                           const unsigned int nkeys, const unsigned int nlookups) {
+    const S_CHAR *keys[HASHTABLE_FIND_MANY_GROUP];
+    S_UINT nks[HASHTABLE_FIND_MANY_GROUP];
+    S_UINT32 batch_hvs[HASHTABLE_FIND_MANY_GROUP];
+    item *out[HASHTABLE_FIND_MANY_GROUP];
+    unsigned int x = 1, i, j, found = 0;
+    double start = now();
+
+    for (i = 0; i + HASHTABLE_FIND_MANY_GROUP <= nlookups; i += HASHTABLE_FIND_MANY_GROUP) {
+        for (j = 0; j < HASHTABLE_FIND_MANY_GROUP; j++) {
+            unsigned int k;
+            x = x * 1103515245 + 12345;
+            k = (x >> 8) % nkeys;
+            keys[j] = items[k].key;
+            nks[j] = items[k].nkey;
+            batch_hvs[j] = hvs[k];
+        }
+        ht->find_many(keys, nks, batch_hvs, out, HASHTABLE_FIND_MANY_GROUP);
+        for (j = 0; j < HASHTABLE_FIND_MANY_GROUP; j++) {
+            if (out[j])
+                found++;
+        }
+    }
+    if (found == 0xffffffff)
+        printf("?");
+    return (now() - start) * 1e9 / i;
+}
+
+static void *reader(void *arg) {
+    reader_arg *a = (reader_arg *)arg;
+    unsigned int x = a->seed;
+    unsigned int i;
+
+    for (i = 0; i < a->nlookups; i++) {
+        unsigned int k;
+        x = x * 1103515245 + 12345;
+        k = (x >> 8) % a->nkeys;
+        if (a->ht->find(a->items[k].key, a->items[k].nkey, a->hvs[k]))
+            a->hits++;
+    }
+    return NULL;
+}
+
+static void bench_reads(const char *name, HashTable *ht, item *items,
+                        S_UINT32 *hvs, const unsigned int nkeys,
+                        const unsigned int nlookups) {
+    int nthreads;
+
+    for (nthreads = 1; nthreads <= BENCH_MAX_THREADS; nthreads *= 2) {
+        pthread_t tids[BENCH_MAX_THREADS];
+        reader_arg args[BENCH_MAX_THREADS];
+        double start, elapsed;
+        int i;
+
+        start = now();
+        for (i = 0; i < nthreads; i++) {
+            args[i].ht = ht;
+            args[i].items = items;
+            args[i].hvs = hvs;
+            args[i].nkeys = nkeys;
+            args[i].nlookups = nlookups;
+            args[i].seed = i + 1;
+            args[i].hits = 0;
+            pthread_create(&tids[i], NULL, reader, &args[i]);
+        }
+        for (i = 0; i < nthreads; i++) {
+            pthread_join(tids[i], NULL);
+        }
+        elapsed = now() - start;
+        printf("%-10s readers=%-3d %8.2f Mlookups/s\n", name, nthreads,
+               (double)nthreads * nlookups / elapsed / 1e6);
+    }
+}
+
+/* resident set size in bytes, 0 if unknown */
+static size_t rss_bytes(void) {
+    unsigned long size, resident = 0;
+    FILE *f = fopen("/proc/self/statm", "r");
+
+    if (f == NULL)
+        return 0;
+    if (fscanf(f, "%lu %lu", &size, &resident) != 2)
+        resident = 0;
+    fclose(f);
+    return resident * sysconf(_SC_PAGESIZE);
+}
+
+/* one node, its key and a BENCH_VALUE_SIZE value the way layout lays them out */
+static item *layout_node(const enum node_layout layout, const char *key,
+                         const S_UINT nkey) {
+    item *it;
+
+    switch (layout) {
+    case LAYOUT_MALLOC:
+        it = (item *)calloc(1, sizeof(item));
+        if (it) {
+            it->key = strdup(key);
+            it->nkey = nkey;
+            it->value = (S_CHAR *)malloc(BENCH_VALUE_SIZE);
+            it->nvalue = BENCH_VALUE_SIZE;
+        }
+        return it;
+    case LAYOUT_SLAB:
+        return slabs_item_alloc(key, nkey, BENCH_VALUE_SIZE, 0);
+    case LAYOUT_INLINE:
+        return slabs_item_alloc_inline(key, nkey, BENCH_VALUE_SIZE, 0);
+    }
+    return NULL;
+}
+
+/*
+ * Builds a table of nkeys nodes and reports what it grew the process by.
+ * Runs in a child so every layout starts from the same heap.
+ */
+static void bench_layout(const char *name, const enum node_layout layout,
+                         const unsigned int nkeys, const unsigned int nlookups) {
+    pid_t pid;
+
+    fflush(stdout);
+    pid = fork();
+    if (pid == 0) {
+        item **nodes = (item **)malloc(nkeys * sizeof(item *));
+        S_UINT32 *hvs = (S_UINT32 *)malloc(nkeys * sizeof(S_UINT32));
+        HashTable *ht;
+        unsigned int i, x = 1, found = 0;
+        size_t before;
+        double start, elapsed;
+        char key[32];
+
+        if (nodes == NULL || hvs == NULL) {
+            fprintf(stderr, "Failed to allocate %u keys\n", nkeys);
+            exit(EXIT_FAILURE);
+        }
+        /* touch the bookkeeping so only the table counts */
+        memset(nodes, 0, nkeys * sizeof(item *));
+        memset(hvs, 0, nkeys * sizeof(S_UINT32));
+        before = rss_bytes();
+
+        ht = new HashTable(0, 0, layout == LAYOUT_INLINE ? HASHTABLE_INLINE_KEYS : 0);
+        for (i = 0; i < nkeys; i++) {
+            S_UINT nkey = snprintf(key, sizeof(key), "bench:%u", i);
+            nodes[i] = layout_node(layout, key, nkey);
+            if (nodes[i] == NULL) {
+                fprintf(stderr, "Failed to allocate item %u\n", i);
+                exit(EXIT_FAILURE);
+            }
+            hvs[i] = hash(key, nkey, 0);
+            ht->insert(nodes[i], hvs[i]);
+        }
+        while (ht->is_expanding())
+            ht->move_next_bucket();
+
+        start = now();
+        for (i = 0; i < nlookups; i++) {
+            unsigned int k;
+            x = x * 1103515245 + 12345;
+            k = (x >> 8) % nkeys;
+            if (ht->find(ITEM_key(nodes[k]), ITEM_nkey(nodes[k]), hvs[k]))
+                found++;
+        }
+        elapsed = now() - start;
+
+        printf("%-10s %7.1f MB per 1M keys  hit %6.1f ns%s\n", name,
+               (double)(rss_bytes() - before) / nkeys,
+               elapsed * 1e9 / nlookups, found == nlookups ? "" : "  (lost keys)");
+        exit(EXIT_SUCCESS);
+    } else if (pid > 0) {
+        waitpid(pid, NULL, 0);
+    } else {
+        perror("fork");
+    }
+}
+
+/* fills a fresh table with every item in one of the ways a restart could */
+static void bench_load(item *items, S_UINT32 *hvs, const unsigned int nkeys) {
+    item **ptrs = (item **)malloc(nkeys * sizeof(item *));
+    const char *names[] = { "insert", "reserve", "bulk x1", "bulk x2", "bulk x4" };
+    unsigned int i, way;
+
+    if (ptrs == NULL) {
+        fprintf(stderr, "Failed to allocate %u keys\n", nkeys);
+        exit(EXIT_FAILURE);
+    }
+    for (i = 0; i < nkeys; i++)
+        ptrs[i] = &items[i];
+
+    for (way = 0; way < sizeof(names) / sizeof(names[0]); way++) {
+        HashTable *ht = new HashTable();
+        double start = now(), elapsed;
+
+        if (way >= 2) {
+            ht->bulk_load(ptrs, hvs, nkeys, 1 << (way - 2));
+        } else {
+            if (way == 1)
+                ht->reserve(nkeys);
+            for (i = 0; i < nkeys; i++)
+                ht->insert(&items[i], hvs[i]);
+            /* the load isn't done until the table is */
+            while (ht->is_expanding())
+                ht->move_next_bucket();
+        }
+        elapsed = now() - start;
+        printf("%-10s load %8.1f ms  %6.2f Mitems/s\n", names[way],
+               elapsed * 1e3, nkeys / elapsed / 1e6);
+        delete ht;
+    }
+    free(ptrs);
+}
+
+static void bench_snapshot(item *items, S_UINT32 *hvs, const unsigned int nkeys) {
+    const char *path = "hashtable_bench.snap";
+    HashTable *ht = new HashTable();
+    const struct snapshot_record *r;
+    unsigned int i, hits = 0;
+    double start, elapsed;
+    snapshot *s;
+    long loaded;
+
+    for (i = 0; i < nkeys; i++) {
+        item *it = slabs_item_alloc(items[i].key, items[i].nkey, BENCH_VALUE_SIZE, 0);
+        if (it == NULL) {
+            fprintf(stderr, "Failed to allocate %u keys\n", nkeys);
+            exit(EXIT_FAILURE);
+        }
+        memset(it->value, 'v', BENCH_VALUE_SIZE);
+        ht->insert(it, hvs[i]);
+    }
+
+    start = now();
+    if (snapshot_write(ht, path) != 0)
+        exit(EXIT_FAILURE);
+    elapsed = now() - start;
+    printf("%-10s write %7.1f ms\n", "snapshot", elapsed * 1e3);
+
+    start = now();
+    s = snapshot_open(path);
+    if (s == NULL)
+        exit(EXIT_FAILURE);
+    r = snapshot_find(s, items[0].key, items[0].nkey, hvs[0]);
+    elapsed = now() - start;
+    printf("%-10s open and first find %6.1f us\n", "snapshot", elapsed * 1e6);
+    hits += r != NULL;
+
+    start = now();
+    for (i = 0; i < nkeys; i++)
+        hits += snapshot_find(s, items[i].key, items[i].nkey, hvs[i]) != NULL;
+    elapsed = now() - start;
+    printf("%-10s find %6.1f ns  (%u hits)\n", "snapshot",
+           elapsed * 1e9 / nkeys, hits);
+
+    delete ht;
+    ht = new HashTable();
+    start = now();
+    loaded = snapshot_load(s, ht, 1);
+    elapsed = now() - start;
+    printf("%-10s load %8.1f ms  %6.2f Mitems/s\n", "snapshot",
+           elapsed * 1e3, loaded / elapsed / 1e6);
+    snapshot_close(s);
+    unlink(path);
+    delete ht;
+}
+
+typedef struct {
+    HashTable *ht;
+    item *items;
+    S_UINT32 *hvs;
+    unsigned int lo, hi;
+} wal_writer_arg;
+
+static void *wal_writer(void *arg) {
+    wal_writer_arg *a = (wal_writer_arg *)arg;
+    unsigned int i;
+
+    for (i = a->lo; i < a->hi; i++)
+        a->ht->insert(&a->items[i], a->hvs[i]);
+    return NULL;
+}
+
+static void bench_wal(item *items, S_UINT32 *hvs, const unsigned int nkeys) {
+    const char *path = "hashtable_bench.wal";
+    const unsigned int intervals[] = { 0, 100, 1000, 10000 };
+    unsigned int commits = BENCH_WAL_THREADS * BENCH_WAL_COMMITS;
+    wal_writer_arg args[BENCH_WAL_THREADS];
+    pthread_t tids[BENCH_WAL_THREADS];
+    struct wal_settings settings;
+    struct wal_stats st;
+    unsigned int k, t;
+    double start, elapsed;
+    HashTable *ht;
+    long replayed;
+    wal *w;
+
+    if (commits > nkeys)
+        commits = nkeys;
+    for (k = 0; k < sizeof(intervals) / sizeof(intervals[0]); k++) {
+        wal_settings_init(&settings);
+        settings.sync_interval_us = intervals[k];
+
+        /* async: the inserts only wait for room in the buffer */
+        unlink(path);
+        w = wal_open(path, &settings);
+        if (w == NULL)
+            exit(EXIT_FAILURE);
+        ht = new HashTable(0, BENCH_WAL_THREADS);
+        ht->set_wal(w, false);
+        start = now();
+        args[0].ht = ht;
+        args[0].items = items;
+        args[0].hvs = hvs;
+        args[0].lo = 0;
+        args[0].hi = nkeys;
+        wal_writer(&args[0]);
+        wal_commit(w);
+        elapsed = now() - start;
+        wal_get_stats(w, &st);
+        printf("wal %5uus async  %8.2f Mops/s  %7.1f records/sync\n",
+               intervals[k], nkeys / elapsed / 1e6,
+               (double)st.records / (st.syncs ? st.syncs : 1));
+        ht->set_wal(NULL, false);
+        wal_close(w);
+        delete ht;
+
+        /* sync: every insert waits for the sync that covers it */
+        unlink(path);
+        w = wal_open(path, &settings);
+        if (w == NULL)
+            exit(EXIT_FAILURE);
+        ht = new HashTable(0, BENCH_WAL_THREADS);
+        ht->set_wal(w, true);
+        start = now();
+        for (t = 0; t < BENCH_WAL_THREADS; t++) {
+            args[t].ht = ht;
+            args[t].items = items;
+            args[t].hvs = hvs;
+            args[t].lo = commits * t / BENCH_WAL_THREADS;
+            args[t].hi = commits * (t + 1) / BENCH_WAL_THREADS;
+            if (pthread_create(&tids[t], NULL, wal_writer, &args[t]) != 0) {
+                fprintf(stderr, "Can't create writer thread\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+        for (t = 0; t < BENCH_WAL_THREADS; t++)
+            pthread_join(tids[t], NULL);
+        elapsed = now() - start;
+        wal_get_stats(w, &st);
+        printf("wal %5uus commit %8.0f ops/s   %7.1f records/sync\n",
+               intervals[k], commits / elapsed,
+               (double)st.records / (st.syncs ? st.syncs : 1));
+        ht->set_wal(NULL, false);
+        wal_close(w);
+        delete ht;
+    }
+
+    /* the async log of the last round, replayed into slab items */
+    unlink(path);
+    wal_settings_init(&settings);
+    w = wal_open(path, &settings);
+    if (w == NULL)
+        exit(EXIT_FAILURE);
+    ht = new HashTable();
+    ht->set_wal(w, false);
+    for (k = 0; k < nkeys; k++)
+        ht->insert(&items[k], hvs[k]);
+    ht->set_wal(NULL, false);
+    wal_close(w);
+    delete ht;
+
+    ht = new HashTable();
+    start = now();
+    replayed = wal_replay(path, ht);
+    elapsed = now() - start;
+    printf("%-10s replay %7.1f ms  %6.2f Mrecords/s\n", "wal",
+           elapsed * 1e3, replayed / elapsed / 1e6);
+    delete ht;
+    unlink(path);
+}
+
+/* out must have room for 3 bytes per char; BMP only, as in the bench keys */
+static S_UINT utf8_encode(const S_WCHAR *key, const S_UINT nkey, S_CHAR *out) {
+    S_UINT i, n = 0;
+
+    for (i = 0; i < nkey; i++) {
+        unsigned int c = key[i];
+        if (c < 0x80) {
+            out[n++] = (S_CHAR)c;
+        } else if (c < 0x800) {
+            out[n++] = (S_CHAR)(0xc0 | (c >> 6));
+            out[n++] = (S_CHAR)(0x80 | (c & 0x3f));
+        } else {
+            out[n++] = (S_CHAR)(0xe0 | (c >> 12));
+            out[n++] = (S_CHAR)(0x80 | ((c >> 6) & 0x3f));
+            out[n++] = (S_CHAR)(0x80 | (c & 0x3f));
+        }
+    }
+    return n;
+}
+
+static void bench_wide(const unsigned int nkeys, const unsigned int nlookups) {
+    const S_UINT nchars = 8;
+    BasicHashTable<S_WCHAR, Times33Hash> *wide = new BasicHashTable<S_WCHAR, Times33Hash>();
+    HashTable *narrow = new HashTable(0, 0, 0, hashtable_hash_times33);
+    basic_node<S_WCHAR> *nodes = (basic_node<S_WCHAR> *)calloc(nkeys, sizeof(basic_node<S_WCHAR>));
+    S_WCHAR *keys = (S_WCHAR *)malloc((size_t)nkeys * nchars * sizeof(S_WCHAR));
+    item *items = (item *)calloc(nkeys, sizeof(item));
+    S_CHAR *utf8 = (S_CHAR *)malloc((size_t)nkeys * nchars * 3);
+    S_CHAR buf[3 * 8];
+    unsigned int i, j, id, x, hits = 0;
+    double start, native, encoded;
+
+    if (nodes == NULL || keys == NULL || items == NULL || utf8 == NULL) {
+        fprintf(stderr, "Failed to allocate %u keys\n", nkeys);
+        exit(EXIT_FAILURE);
+    }
+    for (i = 0; i < nkeys; i++) {
+        S_WCHAR *key = keys + (size_t)i * nchars;
+        /* CJK unified ideographs, the id in base 0x5000 */
+        for (j = 0, id = i; j < nchars; j++, id /= 0x5000)
+            key[j] = (S_WCHAR)(0x4e00 + id % 0x5000);
+        nodes[i].key = key;
+        nodes[i].nkey = nchars;
+        wide->insert(&nodes[i]);
+        items[i].key = utf8 + (size_t)i * nchars * 3;
+        items[i].nkey = utf8_encode(key, nchars, items[i].key);
+        narrow->insert(&items[i]);
+    }
+
+    x = 1;
+    start = now();
+    for (i = 0; i < nlookups; i++) {
+        x = x * 1103515245 + 12345;
+        const S_WCHAR *key = keys + (size_t)((x >> 8) % nkeys) * nchars;
+        hits += wide->find(key, nchars) != NULL;
+    }
+    native = now() - start;
+
+    x = 1;
+    start = now();
+    for (i = 0; i < nlookups; i++) {
+        x = x * 1103515245 + 12345;
+        const S_WCHAR *key = keys + (size_t)((x >> 8) % nkeys) * nchars;
+        hits += narrow->find(buf, utf8_encode(key, nchars, buf)) != NULL;
+    }
+    encoded = now() - start;
+
+    printf("%-10s native %6.1f ns  utf-8 %6.1f ns  (%u hits)\n", "wide",
+           native * 1e9 / nlookups, encoded * 1e9 / nlookups, hits);
+    delete wide;
+    delete narrow;
+    free(nodes);
+    free(keys);
+    free(items);
+    free(utf8);
+}
+
+int main(int argc, char **argv) {
+    unsigned int nkeys = argc > 1 ? atoi(argv[1]) : 1000000;
+    unsigned int nlookups = argc > 2 ? atoi(argv[2]) : 1000000;
+    S_UINT32 *hvs, *miss_hvs;
+    item *items = make_items("bench:key", nkeys, &hvs);
+    item *misses = make_items("bench:miss", nkeys, &miss_hvs);
+    item *copy = (item *)malloc(nkeys * sizeof(item));
+    HashTable *mutex_ht, *lockfree_ht, *chained;
+    OpenHashTable *open;
+    unsigned int i;
+
+    /* each table links its own copy of the nodes */
+    memcpy(copy, items, nkeys * sizeof(item));
+    chained = new HashTable();
+    bench_engine("chained", chained, copy, hvs, misses, miss_hvs,
+                 nkeys, nlookups);
+    printf("%-10s hit %6.1f ns  miss %6.1f ns\n", "find_many",
+           find_many_ns(chained, items, hvs, nkeys, nlookups),
+           find_many_ns(chained, misses, miss_hvs, nkeys, nlookups));
+    delete chained;
+    open = new OpenHashTable();
+    bench_engine("open", open, items, hvs, misses, miss_hvs,
+                 nkeys, nlookups);
+    delete open;
+
+    memcpy(copy, items, nkeys * sizeof(item));
+    mutex_ht = new HashTable(0, BENCH_MAX_THREADS);
+    lockfree_ht = new HashTable(0, BENCH_MAX_THREADS, HASHTABLE_LOCKFREE_READS);
+    for (i = 0; i < nkeys; i++) {
+        mutex_ht->insert(&items[i], hvs[i]);
+        lockfree_ht->insert(&copy[i], hvs[i]);
+    }
+    /* finish any expansion still pending */
+    while (mutex_ht->is_expanding())
+        mutex_ht->move_next_bucket();
+    while (lockfree_ht->is_expanding())
+        lockfree_ht->move_next_bucket();
+
+    bench_reads("mutex", mutex_ht, items, hvs, nkeys, nlookups);
+    bench_reads("lockfree", lockfree_ht, copy, hvs, nkeys, nlookups);
+
+    delete mutex_ht;
+    delete lockfree_ht;
+
+    bench_layout("malloc", LAYOUT_MALLOC, nkeys, nlookups);
+    bench_layout("slab", LAYOUT_SLAB, nkeys, nlookups);
+    bench_layout("inline", LAYOUT_INLINE, nkeys, nlookups);
+
+    bench_load(items, hvs, nkeys);
+    bench_snapshot(items, hvs, nkeys);
+    bench_wal(items, hvs, nkeys);
+    bench_wide(nkeys, nlookups);
+    return 0;
+}
@@ -1,8 +1,6 @@
 #ifndef MAIN_H
 #define MAIN_H
 
-// for windows
-#define ENDIAN_LITTLE 1
 // set the hashtable size,is 2^16
 #define HASHPOWER_DEFAULT 16
 
@@ -0,0 +1,127 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * Thread wakeups over an eventfd or a pipe.
+ */
+#include "notify.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#ifdef NOTIFY_EVENTFD
+#include <stdint.h>
+#include <sys/eventfd.h>
+#endif
+
+#ifndef NOTIFY_EVENTFD
+static int set_nonblocking(const int fd) {
+    int flags = fcntl(fd, F_GETFL, 0);
+
+    if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0)
+        return -1;
+    return 0;
+}
+#endif
+
+int notify_open(int fds[2]) {
+#ifdef NOTIFY_EVENTFD
+    int fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+    if (fd < 0)
+        return -1;
+    fds[0] = fds[1] = fd;
+    return 0;
+#else
+    int saved;
+
+    if (pipe(fds) != 0)
+        return -1;
+    if (set_nonblocking(fds[0]) == 0 && set_nonblocking(fds[1]) == 0)
+        return 0;
+    saved = errno;
+    close(fds[0]);
+    close(fds[1]);
+    errno = saved;
+    return -1;
+#endif
+}
+
+void notify_close(int fds[2]) {
+    close(fds[0]);
+    if (fds[1] != fds[0])
+        close(fds[1]);
+}
+
+int notify_send(const int send_fd) {
+#ifdef NOTIFY_EVENTFD
+    uint64_t one = 1;
+
+    while (write(send_fd, &one, sizeof(one)) != sizeof(one)) {
+        /* EAGAIN: the count is at its limit, so the wakeup is pending anyway */
+        if (errno == EAGAIN)
+            return 0;
+        if (errno != EINTR)
+            return -1;
+    }
+    return 0;
+#else
+    char buf[1] = { 'n' };
+
+    while (write(send_fd, buf, 1) != 1) {
+        /* EAGAIN: the pipe is full of wakeups already */
+        if (errno == EAGAIN)
+            return 0;
+        if (errno != EINTR)
+            return -1;
+    }
+    return 0;
+#endif
+}
+
+bool notify_drain(const int receive_fd) {
+#ifdef NOTIFY_EVENTFD
+    uint64_t count;
+    ssize_t n;
+
+    /* one read takes the whole count and resets it */
+    do {
+        n = read(receive_fd, &count, sizeof(count));
+    } while (n < 0 && errno == EINTR);
+    return n == sizeof(count);
+#else
+    char buf[256];
+    bool woken = false;
+    ssize_t n;
+
+    for (;;) {
+        n = read(receive_fd, buf, sizeof(buf));
+        if (n > 0) {
+            woken = true;
+            if ((size_t)n < sizeof(buf))
+                break;
+        } else if (n < 0 && errno == EINTR) {
+            continue;
+        } else {
+            break;
+        }
+    }
+    return woken;
+#endif
+}
+
+int notify_wait(const int receive_fd) {
+    struct pollfd pfd;
+
+    pfd.fd = receive_fd;
+    pfd.events = POLLIN;
+    while (!notify_drain(receive_fd)) {
+        pfd.revents = 0;
+        if (poll(&pfd, 1, -1) < 0 && errno != EINTR)
+            return -1;
+        if (pfd.revents & POLLNVAL) {
+            errno = EBADF;
+            return -1;
+        }
+    }
+    return 0;
+}
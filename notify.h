@@ -0,0 +1,40 @@
+#ifndef NOTIFY_H
+#define NOTIFY_H
+
+#include <stdbool.h>
+
+/*
+  Wakeups for a thread that sleeps in poll() or a libevent loop: an
+  eventfd on Linux, a pipe elsewhere.
+
+  A wakeup carries nothing. What the thread has to do goes in a queue
+  first, such as a ring_queue, and then the sender wakes it. Sends before
+  the thread drains add up to one wakeup, so it takes them all with one
+  read, however many there were.
+
+  Both fds are nonblocking. With an eventfd they are the same fd, so a
+  thread costs NOTIFY_FDS descriptors instead of two.
+ */
+
+#if defined(__linux__)
+#define NOTIFY_EVENTFD 1
+#define NOTIFY_FDS 1
+#else
+#define NOTIFY_FDS 2
+#endif
+
+/*
+ * Like pipe(): fds[0] is watched for reading, fds[1] is sent on.
+ * Returns 0, or -1 with errno set.
+ */
+int notify_open(int fds[2]);
+void notify_close(int fds[2]);
+
+/* Returns 0, or -1 with errno set */
+int notify_send(const int send_fd);
+/* takes every wakeup sent so far; true if there was any */
+bool notify_drain(const int receive_fd);
+/* sleeps until there is a wakeup, then drains. Returns 0, or -1 with errno set */
+int notify_wait(const int receive_fd);
+
+#endif
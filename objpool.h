@@ -0,0 +1,309 @@
+#ifndef OBJPOOL_H
+#define OBJPOOL_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "portable.h"
+
+/*
+  Pool of small fixed-size objects with a cache per thread, for hot
+  objects that one thread allocates and another frees, such as CQ_ITEMs,
+  which the dispatcher takes and the workers give back.
+
+  Each thread has a cache of up to 2 * BATCH objects, found through a
+  pthread key, that alloc() and free() use without a lock. An empty cache
+  takes a batch of BATCH from the shared depot under its mutex, or mallocs
+  one; a full cache hands BATCH to the depot and keeps the rest, so a
+  thread that alternates alloc and free doesn't go back and forth. The
+  depot keeps at most depot_limit batches (0 for no limit), and objects
+  past that go back to malloc, so a burst doesn't hold memory forever.
+
+  Objects are malloc'd one by one and handed out uninitialized: T is plain
+  data. A thread's cache goes back to the depot when the thread exits.
+  The pool must outlive every thread using it; its destructor frees what
+  the depot and the caches hold.
+ */
+
+#define OBJPOOL_BATCH 32
+
+struct objpool_stats {
+    S_UINT64 allocs;
+    S_UINT64 cache_hits;        /* allocs the thread's cache served */
+    S_UINT64 depot_gets;        /* batches caches took from the depot */
+    S_UINT64 depot_puts;        /* batches caches gave the depot */
+    S_UINT64 created;           /* objects malloc'd */
+    S_UINT64 released;          /* objects freed back to malloc */
+    S_UINT64 depot_objects;     /* in the depot now */
+};
+
+template <typename T, unsigned int BATCH = OBJPOOL_BATCH>
+class ObjectPool {
+public:
+    explicit ObjectPool(const unsigned int depot_limit = 0);
+    ~ObjectPool();
+
+    /* NULL if there's none cached and malloc fails */
+    T *alloc(void);
+    void free(T *obj);
+
+    /* counters of threads still running are a moment behind */
+    void get_stats(struct objpool_stats *st);
+
+private:
+    struct magazine {
+        magazine *next;
+        T *objs[BATCH];
+    };
+    struct cache {
+        ObjectPool *pool;
+        cache *prev;
+        cache *next;
+        /* only its thread writes these; get_stats() reads them */
+        S_UINT64 allocs;
+        S_UINT64 hits;
+        unsigned int count;
+        T *objs[2 * BATCH];
+    };
+
+    static void count(S_UINT64 *counter, const S_UINT64 n) {
+        __atomic_store_n(counter, *counter + n, __ATOMIC_RELAXED);
+    }
+    cache *get_cache(void);
+    static void cache_exit(void *arg);
+    void refill(cache *c);
+    bool depot_put(T **objs);
+    void release(T **objs, const unsigned int n);
+
+    /* not copyable */
+    ObjectPool(const ObjectPool &);
+    ObjectPool &operator=(const ObjectPool &);
+
+    pthread_key_t cache_key;
+    pthread_mutex_t depot_lock;
+    /* the rest is under depot_lock */
+    magazine *full;
+    unsigned int nfull;
+    unsigned int depot_limit;
+    /* spare magazines, so that moving a batch doesn't malloc */
+    magazine *empty;
+    cache *caches;
+    /* counters of caches whose thread has exited */
+    S_UINT64 exited_allocs;
+    S_UINT64 exited_hits;
+    S_UINT64 depot_gets;
+    S_UINT64 depot_puts;
+    S_UINT64 created;
+    S_UINT64 released;
+};
+
+template <typename T, unsigned int BATCH>
+ObjectPool<T, BATCH>::ObjectPool(const unsigned int depot_limit_init)
+    : full(0),
+      nfull(0),
+      depot_limit(depot_limit_init),
+      empty(0),
+      caches(0),
+      exited_allocs(0),
+      exited_hits(0),
+      depot_gets(0),
+      depot_puts(0),
+      created(0),
+      released(0) {
+    pthread_mutex_init(&depot_lock, NULL);
+    if (pthread_key_create(&cache_key, cache_exit) != 0) {
+        fprintf(stderr, "Can't create object pool thread key\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+template <typename T, unsigned int BATCH>
+ObjectPool<T, BATCH>::~ObjectPool() {
+    magazine *mag;
+    cache *c;
+
+    pthread_key_delete(cache_key);
+    while ((c = caches) != NULL) {
+        caches = c->next;
+        release(c->objs, c->count);
+        ::free(c);
+    }
+    while ((mag = full) != NULL) {
+        full = mag->next;
+        release(mag->objs, BATCH);
+        ::free(mag);
+    }
+    while ((mag = empty) != NULL) {
+        empty = mag->next;
+        ::free(mag);
+    }
+    pthread_mutex_destroy(&depot_lock);
+}
+
+template <typename T, unsigned int BATCH>
+T *ObjectPool<T, BATCH>::alloc(void) {
+    cache *c = get_cache();
+
+    if (c == NULL)
+        return NULL;
+    count(&c->allocs, 1);
+    if (c->count > 0) {
+        count(&c->hits, 1);
+    } else {
+        refill(c);
+        if (c->count == 0)
+            return NULL;
+    }
+    return c->objs[--c->count];
+}
+
+template <typename T, unsigned int BATCH>
+void ObjectPool<T, BATCH>::free(T *obj) {
+    cache *c = get_cache();
+
+    if (c == NULL) {
+        ::free(obj);
+        return;
+    }
+    if (c->count == 2 * BATCH) {
+        /* the newest half; the older ones stay for the next allocs */
+        if (!depot_put(&c->objs[BATCH]))
+            release(&c->objs[BATCH], BATCH);
+        c->count = BATCH;
+    }
+    c->objs[c->count++] = obj;
+}
+
+template <typename T, unsigned int BATCH>
+void ObjectPool<T, BATCH>::get_stats(struct objpool_stats *st) {
+    cache *c;
+
+    memset(st, 0, sizeof(*st));
+    pthread_mutex_lock(&depot_lock);
+    st->allocs = exited_allocs;
+    st->cache_hits = exited_hits;
+    for (c = caches; c != NULL; c = c->next) {
+        st->allocs += __atomic_load_n(&c->allocs, __ATOMIC_RELAXED);
+        st->cache_hits += __atomic_load_n(&c->hits, __ATOMIC_RELAXED);
+    }
+    st->depot_gets = depot_gets;
+    st->depot_puts = depot_puts;
+    st->created = created;
+    st->released = __atomic_load_n(&released, __ATOMIC_RELAXED);
+    st->depot_objects = (S_UINT64)nfull * BATCH;
+    pthread_mutex_unlock(&depot_lock);
+}
+
+/* this thread's cache, made on its first use of the pool */
+template <typename T, unsigned int BATCH>
+typename ObjectPool<T, BATCH>::cache *ObjectPool<T, BATCH>::get_cache(void) {
+    cache *c = (cache *)pthread_getspecific(cache_key);
+
+    if (c != NULL)
+        return c;
+    c = (cache *)calloc(1, sizeof(cache));
+    if (c == NULL)
+        return NULL;
+    c->pool = this;
+    pthread_mutex_lock(&depot_lock);
+    c->next = caches;
+    if (caches != NULL)
+        caches->prev = c;
+    caches = c;
+    pthread_mutex_unlock(&depot_lock);
+    pthread_setspecific(cache_key, c);
+    return c;
+}
+
+/* pthread key destructor: gives an exiting thread's objects to the depot */
+template <typename T, unsigned int BATCH>
+void ObjectPool<T, BATCH>::cache_exit(void *arg) {
+    cache *c = (cache *)arg;
+    ObjectPool *pool = c->pool;
+
+    while (c->count >= BATCH) {
+        c->count -= BATCH;
+        if (!pool->depot_put(&c->objs[c->count]))
+            pool->release(&c->objs[c->count], BATCH);
+    }
+    pool->release(c->objs, c->count);
+
+    pthread_mutex_lock(&pool->depot_lock);
+    if (c->prev != NULL)
+        c->prev->next = c->next;
+    else
+        pool->caches = c->next;
+    if (c->next != NULL)
+        c->next->prev = c->prev;
+    pool->exited_allocs += c->allocs;
+    pool->exited_hits += c->hits;
+    pthread_mutex_unlock(&pool->depot_lock);
+    ::free(c);
+}
+
+/* fills an empty cache with a batch from the depot, or new objects */
+template <typename T, unsigned int BATCH>
+void ObjectPool<T, BATCH>::refill(cache *c) {
+    magazine *mag;
+    unsigned int i;
+
+    pthread_mutex_lock(&depot_lock);
+    if ((mag = full) != NULL) {
+        full = mag->next;
+        nfull--;
+        memcpy(c->objs, mag->objs, sizeof(mag->objs));
+        c->count = BATCH;
+        mag->next = empty;
+        empty = mag;
+        depot_gets++;
+    }
+    pthread_mutex_unlock(&depot_lock);
+    if (mag != NULL)
+        return;
+
+    for (i = 0; i < BATCH; i++) {
+        if ((c->objs[c->count] = (T *)malloc(sizeof(T))) == NULL)
+            break;
+        c->count++;
+    }
+    pthread_mutex_lock(&depot_lock);
+    created += c->count;
+    pthread_mutex_unlock(&depot_lock);
+}
+
+/* moves BATCH objects to the depot; false if it's full or out of memory */
+template <typename T, unsigned int BATCH>
+bool ObjectPool<T, BATCH>::depot_put(T **objs) {
+    magazine *mag;
+
+    pthread_mutex_lock(&depot_lock);
+    if (depot_limit > 0 && nfull >= depot_limit) {
+        pthread_mutex_unlock(&depot_lock);
+        return false;
+    }
+    if ((mag = empty) != NULL)
+        empty = mag->next;
+    else if ((mag = (magazine *)malloc(sizeof(magazine))) == NULL) {
+        pthread_mutex_unlock(&depot_lock);
+        return false;
+    }
+    memcpy(mag->objs, objs, sizeof(mag->objs));
+    mag->next = full;
+    full = mag;
+    nfull++;
+    depot_puts++;
+    pthread_mutex_unlock(&depot_lock);
+    return true;
+}
+
+template <typename T, unsigned int BATCH>
+void ObjectPool<T, BATCH>::release(T **objs, const unsigned int n) {
+    unsigned int i;
+
+    for (i = 0; i < n; i++)
+        ::free(objs[i]);
+    __sync_fetch_and_add(&released, (S_UINT64)n);
+}
+
+#endif
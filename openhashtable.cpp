@@ -0,0 +1,228 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * Open addressing hash table with cache line sized buckets.
+ */
+#include "openhashtable.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#define hashsize(n) ((unsigned long int)1<<(n))
+#define hashmask(n) (hashsize(n)-1)
+
+/* a bucket holds about 8 items, so start 3 powers below the chained table */
+#define OPEN_HASHPOWER_DEFAULT (HASHPOWER_DEFAULT - 3)
+
+#define SLOT_MASK ((1u << OPEN_BUCKET_SLOTS) - 1)
+
+/* top bits of the hash, never 0 so that 0 can mark an empty slot */
+static inline S_UINT8 hash_tag(const S_UINT32 hv) {
+    return (S_UINT8)((hv >> 24) | 0x80);
+}
+
+/*
+ * Returns a bitmask of the slots whose tag equals tag. The overflow byte
+ * shares the 8-byte word and is masked off. The portable version may report
+ * extra slots; callers compare keys anyway.
+ */
+static inline unsigned int match_tags(const struct open_bucket *b, const S_UINT8 tag) {
+#if defined(__SSE2__)
+    __m128i tags = _mm_loadl_epi64((const __m128i *)b->tags);
+    __m128i eq = _mm_cmpeq_epi8(tags, _mm_set1_epi8((char)tag));
+    return (unsigned int)_mm_movemask_epi8(eq) & SLOT_MASK;
+#else
+    const uint64_t lows = 0x0101010101010101ULL;
+    const uint64_t highs = 0x8080808080808080ULL;
+    uint64_t word, x, zero, mask = 0;
+    int i;
+
+    memcpy(&word, b->tags, sizeof(word));
+    x = word ^ (lows * tag);
+    zero = (x - lows) & ~x & highs;
+    for (i = 0; i < OPEN_BUCKET_SLOTS; i++) {
+        if (zero & ((uint64_t)0x80 << (8 * i)))
+            mask |= 1u << i;
+    }
+    return (unsigned int)mask;
+#endif
+}
+
+static inline unsigned int empty_slots(const struct open_bucket *b) {
+    unsigned int mask = 0;
+    int i;
+    for (i = 0; i < OPEN_BUCKET_SLOTS; i++) {
+        if (b->tags[i] == 0)
+            mask |= 1u << i;
+    }
+    return mask;
+}
+
+OpenHashTable::OpenHashTable(const int hashpower_init,
+                             hashtable_hash_func hash_function)
+    : hash_func(hash_function),
+      hashpower(OPEN_HASHPOWER_DEFAULT),
+      buckets(0),
+      hash_items(0) {
+    if (hashpower_init) {
+        hashpower = hashpower_init;
+    }
+    buckets = alloc_buckets(hashpower);
+    if (! buckets) {
+        fprintf(stderr, "Failed to init hashtable.\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+OpenHashTable::~OpenHashTable() {
+    free(buckets);
+}
+
+struct open_bucket *OpenHashTable::alloc_buckets(const unsigned int power) {
+    void *mem;
+    size_t len = hashsize(power) * sizeof(struct open_bucket);
+
+    /* keep every bucket on a line of its own */
+    if (posix_memalign(&mem, 64, len) != 0)
+        return NULL;
+    memset(mem, 0, len);
+    return (struct open_bucket *)mem;
+}
+
+item *OpenHashTable::find(const S_CHAR *key, const S_UINT nkey, const S_UINT32 hv) {
+    const S_UINT8 tag = hash_tag(hv);
+    unsigned long int i = hv & hashmask(hashpower);
+    unsigned long int n;
+
+    /* once per bucket at most: a table that couldn't grow may overflow all */
+    for (n = 0; n < hashsize(hashpower); n++) {
+        const struct open_bucket *b = &buckets[i];
+        unsigned int m = match_tags(b, tag);
+
+        while (m) {
+            int slot = __builtin_ctz(m);
+            item *it = b->items[slot];
+            if (it && (hv == it->hv) && (nkey == it->nkey) &&
+                (memcmp(key, it->key, nkey) == 0))
+                return it;
+            m &= m - 1;
+        }
+        if (b->overflow == 0)
+            return NULL;
+        i = (i + 1) & hashmask(hashpower);
+    }
+    return NULL;
+}
+
+/*
+ * Stores it in the first free slot along its probe sequence. Returns false,
+ * changing nothing, if every bucket is full.
+ */
+bool OpenHashTable::place(item *it, const S_UINT32 hv) {
+    unsigned long int home = hv & hashmask(hashpower);
+    unsigned long int i = home;
+    unsigned long int n;
+    struct open_bucket *b;
+    unsigned int m = 0;
+    int slot;
+
+    for (n = 0; n < hashsize(hashpower); n++) {
+        m = empty_slots(&buckets[i]);
+        if (m)
+            break;
+        i = (i + 1) & hashmask(hashpower);
+    }
+    if (! m)
+        return false;
+    /* the buckets it probed past now overflow on its behalf */
+    for (; home != i; home = (home + 1) & hashmask(hashpower)) {
+        if (buckets[home].overflow < 255)
+            buckets[home].overflow++;
+    }
+    b = &buckets[i];
+    slot = __builtin_ctz(m);
+    b->tags[slot] = hash_tag(hv);
+    b->items[slot] = it;
+    return true;
+}
+
+/* doubles the bucket array and reinserts everything. */
+void OpenHashTable::expand(void) {
+    struct open_bucket *old = buckets;
+    unsigned long int n = hashsize(hashpower);
+    struct open_bucket *bigger = alloc_buckets(hashpower + 1);
+    unsigned long int i;
+    int slot;
+
+    if (! bigger) {
+        /* Bad news, but we can keep running. */
+        return;
+    }
+    buckets = bigger;
+    hashpower++;
+    for (i = 0; i < n; i++) {
+        for (slot = 0; slot < OPEN_BUCKET_SLOTS; slot++) {
+            item *it = old[i].items[slot];
+            /* at most half full after doubling, so there is always room */
+            if (old[i].tags[slot])
+                place(it, it->hv);
+        }
+    }
+    free(old);
+}
+
+/*
+ * Note: the key must not already exist to call this. Returns 0 if the table
+ * is full and couldn't grow.
+ */
+int OpenHashTable::insert(item *it, const S_UINT32 hv) {
+    /* long probe runs start past 3/4 occupancy */
+    if (hash_items + 1 > (hashsize(hashpower) * OPEN_BUCKET_SLOTS * 3) / 4)
+        expand();
+    it->hv = hv;
+    if (! place(it, hv))
+        return 0;
+    hash_items++;
+    return 1;
+}
+
+void OpenHashTable::remove(const S_CHAR *key, const S_UINT nkey, const S_UINT32 hv) {
+    const S_UINT8 tag = hash_tag(hv);
+    unsigned long int home = hv & hashmask(hashpower);
+    unsigned long int i = home;
+    unsigned long int n;
+
+    for (n = 0; n < hashsize(hashpower); n++) {
+        struct open_bucket *b = &buckets[i];
+        unsigned int m = match_tags(b, tag);
+
+        while (m) {
+            int slot = __builtin_ctz(m);
+            item *it = b->items[slot];
+            if (it && (hv == it->hv) && (nkey == it->nkey) &&
+                (memcmp(key, it->key, nkey) == 0)) {
+                b->tags[slot] = 0;
+                b->items[slot] = NULL;
+                hash_items--;
+                /* the buckets it probed past no longer overflow on its behalf */
+                for (; home != i; home = (home + 1) & hashmask(hashpower)) {
+                    if (buckets[home].overflow < 255)
+                        buckets[home].overflow--;
+                }
+                return;
+            }
+            m &= m - 1;
+        }
+        if (b->overflow == 0)
+            break;
+        i = (i + 1) & hashmask(hashpower);
+    }
+    /* Note:  we never actually get here.  the callers don't delete things
+       they can't find. */
+    assert(0);
+}
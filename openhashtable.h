@@ -0,0 +1,74 @@
+#ifndef OPENHASHTABLE_H
+#define OPENHASHTABLE_H
+
+#include "hashtable.h"
+
+/*
+  Open addressing engine with the same find/insert/remove interface as
+  HashTable.
+
+  Each bucket is one cache line: 7 one-byte hash tags, an overflow count
+  and 7 item pointers. A probe compares all tags of a bucket at once and
+  only dereferences items whose tag matched, so a miss usually touches a
+  single line and no item at all. Buckets are probed linearly; overflow
+  counts how many items probed past a bucket, letting lookups stop at the
+  first bucket nothing ever spilled out of.
+
+  If the bucket array can't be doubled, inserts go on filling it, and
+  once every bucket is full insert() returns 0.
+
+  Not synchronized: callers serialize access, as with a non-concurrent
+  HashTable.
+ */
+
+#define OPEN_BUCKET_SLOTS 7
+
+struct open_bucket {
+    S_UINT8 tags[OPEN_BUCKET_SLOTS];    /* 0 means the slot is empty */
+    S_UINT8 overflow;
+    item *items[OPEN_BUCKET_SLOTS];
+};
+
+class OpenHashTable {
+public:
+    explicit OpenHashTable(const int hashpower_init = 0,
+                           hashtable_hash_func hash_func = hashtable_hash_lookup3);
+    ~OpenHashTable();
+
+    S_UINT32 hash_key(const S_CHAR *key, const S_UINT nkey) const {
+        return hash_func(key, nkey);
+    }
+    item *find(const S_CHAR *key, const S_UINT nkey) {
+        return find(key, nkey, hash_key(key, nkey));
+    }
+    int insert(item *it) {
+        return insert(it, hash_key(it->key, it->nkey));
+    }
+    void remove(const S_CHAR *key, const S_UINT nkey) {
+        remove(key, nkey, hash_key(key, nkey));
+    }
+
+    item *find(const S_CHAR *key, const S_UINT nkey, const S_UINT32 hv);
+    int insert(item *it, const S_UINT32 hv);
+    void remove(const S_CHAR *key, const S_UINT nkey, const S_UINT32 hv);
+
+    /* buckets are hashsize(power()); each holds OPEN_BUCKET_SLOTS items */
+    unsigned int power(void) const { return hashpower; }
+    S_UINT items(void) const { return hash_items; }
+
+private:
+    struct open_bucket *alloc_buckets(const unsigned int power);
+    bool place(item *it, const S_UINT32 hv);
+    void expand(void);
+
+    /* not copyable */
+    OpenHashTable(const OpenHashTable &);
+    OpenHashTable &operator=(const OpenHashTable &);
+
+    hashtable_hash_func hash_func;
+    unsigned int hashpower;
+    struct open_bucket *buckets;
+    S_UINT hash_items;
+};
+
+#endif
@@ -0,0 +1,39 @@
+#ifndef PORTABLE_H
+#define PORTABLE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <wchar.h>
+
+/*
+  Types and platform facts the rest of the tree relies on, from the
+  standard headers instead of <windows.h>.
+ */
+
+typedef uint32_t S_UINT32;
+/* the platform's wide char: UTF-16 on Windows, UTF-32 elsewhere */
+typedef wchar_t S_WCHAR;
+
+typedef unsigned int S_UINT;
+typedef char S_CHAR;
+typedef uint8_t S_UINT8;
+typedef uint16_t S_UINT16;
+typedef unsigned long long S_UINT64;
+
+/*
+  Byte order, for hash.c's word-at-a-time reads. Set ENDIAN_LITTLE or
+  ENDIAN_BIG to 1 on the command line for a compiler that doesn't say.
+ */
+#if ! defined(ENDIAN_LITTLE) && ! defined(ENDIAN_BIG)
+# if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#  define ENDIAN_LITTLE 1
+# elif defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#  define ENDIAN_BIG 1
+# elif defined(_WIN32) || defined(_M_IX86) || defined(_M_X64) || defined(_M_ARM64)
+#  define ENDIAN_LITTLE 1
+# else
+#  error "Unknown byte order: define ENDIAN_LITTLE or ENDIAN_BIG"
+# endif
+#endif
+
+#endif
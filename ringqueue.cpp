@@ -0,0 +1,118 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * Bounded multi-producer, single-consumer ring, after Dmitry Vyukov's
+ * bounded MPMC queue.
+ */
+#include "ringqueue.h"
+
+#include <stdlib.h>
+
+#define CACHE_LINE 64
+
+/*
+ * seq == pos: free for the producer claiming pos.
+ * seq == pos + 1: filled, for the consumer at pos.
+ * The consumer frees it for the next lap with pos + capacity.
+ */
+struct ring_slot {
+    volatile unsigned int seq;
+    void *item;
+};
+
+struct ring_queue {
+    struct ring_slot *slots;
+    unsigned int mask;
+    char pad0[CACHE_LINE];
+    /* next position producers claim */
+    volatile unsigned int tail;
+    char pad1[CACHE_LINE];
+    /* next position the consumer pops; only it touches this */
+    unsigned int head;
+    char pad2[CACHE_LINE];
+    /* set by the producer that writes a wakeup, cleared by the consumer */
+    volatile int wakeup_pending;
+};
+
+ring_queue *ring_queue_create(const unsigned int capacity) {
+    ring_queue *q = (ring_queue *)calloc(1, sizeof(ring_queue));
+    unsigned int size = 1, i;
+
+    if (q == NULL)
+        return NULL;
+    while (size < capacity)
+        size <<= 1;
+    q->slots = (struct ring_slot *)calloc(size, sizeof(struct ring_slot));
+    if (q->slots == NULL) {
+        free(q);
+        return NULL;
+    }
+    for (i = 0; i < size; i++)
+        q->slots[i].seq = i;
+    q->mask = size - 1;
+    return q;
+}
+
+void ring_queue_free(ring_queue *q) {
+    if (q == NULL)
+        return;
+    free(q->slots);
+    free(q);
+}
+
+bool ring_queue_push(ring_queue *q, void *item) {
+    unsigned int pos = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+    struct ring_slot *slot;
+    int diff;
+
+    for (;;) {
+        slot = &q->slots[pos & q->mask];
+        diff = (int)(__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) - pos);
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&q->tail, &pos, pos + 1, true,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+        } else if (diff < 0) {
+            /* the consumer hasn't freed it since the last lap */
+            return false;
+        } else {
+            /* another producer took pos */
+            pos = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+        }
+    }
+    slot->item = item;
+    __atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+void *ring_queue_pop(ring_queue *q) {
+    struct ring_slot *slot = &q->slots[q->head & q->mask];
+    void *item;
+
+    if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != q->head + 1)
+        return NULL;
+    item = slot->item;
+    __atomic_store_n(&slot->seq, q->head + q->mask + 1, __ATOMIC_RELEASE);
+    q->head++;
+    return item;
+}
+
+/*
+ * The fence orders the push's release store of slot->seq before the read
+ * of the flag; without it the store can still be in the store buffer when
+ * the flag reads 1, and the consumer, clearing it and looking at the slot
+ * at that moment, sees neither. Pairs with the fence in ring_queue_woken():
+ * either the consumer's pops see the item or this sees the flag clear.
+ */
+bool ring_queue_need_wakeup(ring_queue *q) {
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&q->wakeup_pending, __ATOMIC_SEQ_CST))
+        return false;
+    return __atomic_exchange_n(&q->wakeup_pending, 1, __ATOMIC_SEQ_CST) == 0;
+}
+
+/* the flag must be clear before the consumer looks at the slots again;
+   pairs with the fence in ring_queue_need_wakeup() */
+void ring_queue_woken(ring_queue *q) {
+    __atomic_store_n(&q->wakeup_pending, 0, __ATOMIC_SEQ_CST);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
@@ -0,0 +1,37 @@
+#ifndef RINGQUEUE_H
+#define RINGQUEUE_H
+
+#include <stdbool.h>
+
+/*
+  Bounded lock-free queue of pointers for any number of producers and one
+  consumer, such as a worker's queue of new connections.
+
+  Each slot carries a sequence number saying whose turn it is, so a push
+  is one compare-and-swap on the tail and a pop takes no atomic
+  read-modify-write at all; neither ever blocks. The consumer may only be
+  one thread at a time.
+
+  Wakeups: a consumer that sleeps on a pipe or eventfd only needs to be
+  woken once per batch. After a push, ring_queue_need_wakeup() is true for
+  the first producer since the consumer last called ring_queue_woken(),
+  and only that one writes to the pipe. The consumer calls
+  ring_queue_woken() as it wakes and then pops until the queue is empty,
+  so whatever is pushed after its last pop gets a wakeup of its own.
+ */
+
+typedef struct ring_queue ring_queue;
+
+/* room for capacity items, rounded up to a power of 2; NULL if no memory */
+ring_queue *ring_queue_create(const unsigned int capacity);
+void ring_queue_free(ring_queue *q);
+
+/* false if the queue is full */
+bool ring_queue_push(ring_queue *q, void *item);
+/* the oldest item, or NULL if the queue is empty. Consumer only. */
+void *ring_queue_pop(ring_queue *q);
+
+bool ring_queue_need_wakeup(ring_queue *q);
+void ring_queue_woken(ring_queue *q);
+
+#endif
@@ -0,0 +1,368 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * Slabs memory allocation, after memcached's slabs.c.
+ *
+ * Every class has a depot: a free list threaded through the free chunks
+ * plus the uncarved tail of its newest page, both under the class lock.
+ * Threads allocate from and free to their own magazines and only visit the
+ * depot to move half a magazine at a time. A thread's magazines go back to
+ * the depots when it exits.
+ */
+#include "slabs.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+#include <pthread.h>
+
+#define CHUNK_ALIGN_BYTES 8
+
+typedef struct {
+    unsigned int size;          /* sizes of items */
+    unsigned int perslab;       /* how many items per slab */
+
+    pthread_mutex_t lock;       /* guards everything below */
+    void *slots;                /* list of item ptrs */
+    unsigned int sl_curr;       /* total free items in list */
+
+    char *end_page_ptr;         /* pointer to next free item at end of page, or 0 */
+    unsigned int end_page_free; /* number of items remaining at end of last alloced page */
+
+    unsigned int slabs;         /* how many slabs were allocated for this class */
+
+    /* counts folded in from threads that have exited */
+    long long used;
+    long long requested;
+} slabclass_t;
+
+/* one thread's free chunks and counters */
+typedef struct slabs_cache slabs_cache;
+struct slabs_cache {
+    void *mag[SLABS_MAX_CLASSES + 1][SLABS_MAGAZINE_SIZE];
+    unsigned int nmag[SLABS_MAX_CLASSES + 1];
+    /* may go negative when chunks are freed by another thread */
+    long long used[SLABS_MAX_CLASSES + 1];
+    long long requested[SLABS_MAX_CLASSES + 1];
+    slabs_cache *prev, *next;
+};
+
+static slabclass_t slabclass[SLABS_MAX_CLASSES + 1];
+static unsigned int power_largest;
+
+static size_t mem_limit = 0;
+static double mem_factor = SLABS_FACTOR_DEFAULT;
+static size_t mem_malloced = 0;
+static pthread_mutex_t mem_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static pthread_once_t slabs_once = PTHREAD_ONCE_INIT;
+
+/* live thread caches, for stats */
+static slabs_cache *caches = NULL;
+static pthread_mutex_t caches_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t cache_key;
+
+static void depot_put(slabclass_t *p, void **chunks, const unsigned int n);
+
+static void release_cache(void *arg) {
+    slabs_cache *c = (slabs_cache *)arg;
+    unsigned int id;
+
+    for (id = 1; id <= power_largest; id++) {
+        depot_put(&slabclass[id], c->mag[id], c->nmag[id]);
+    }
+
+    pthread_mutex_lock(&caches_lock);
+    for (id = 1; id <= power_largest; id++) {
+        pthread_mutex_lock(&slabclass[id].lock);
+        slabclass[id].used += c->used[id];
+        slabclass[id].requested += c->requested[id];
+        pthread_mutex_unlock(&slabclass[id].lock);
+    }
+    if (c->prev)
+        c->prev->next = c->next;
+    else
+        caches = c->next;
+    if (c->next)
+        c->next->prev = c->prev;
+    pthread_mutex_unlock(&caches_lock);
+    free(c);
+}
+
+/* sets up the classes, sized by the factor */
+static void do_slabs_init(void) {
+    unsigned int i = 0;
+    unsigned int size = SLABS_CHUNK_MIN;
+
+    while (++i < SLABS_MAX_CLASSES && size <= SLABS_PAGE_SIZE / mem_factor) {
+        /* Make sure items are always n-byte aligned */
+        if (size % CHUNK_ALIGN_BYTES)
+            size += CHUNK_ALIGN_BYTES - (size % CHUNK_ALIGN_BYTES);
+
+        slabclass[i].size = size;
+        slabclass[i].perslab = SLABS_PAGE_SIZE / size;
+        pthread_mutex_init(&slabclass[i].lock, NULL);
+        size = (unsigned int)(size * mem_factor);
+    }
+
+    power_largest = i;
+    slabclass[power_largest].size = SLABS_PAGE_SIZE;
+    slabclass[power_largest].perslab = 1;
+    pthread_mutex_init(&slabclass[power_largest].lock, NULL);
+
+    if (pthread_key_create(&cache_key, release_cache) != 0) {
+        perror("Can't create slabs cache key");
+        exit(EXIT_FAILURE);
+    }
+}
+
+void slabs_init(const size_t limit, const double factor) {
+    mem_limit = limit;
+    if (factor > 1.0)
+        mem_factor = factor;
+    pthread_once(&slabs_once, do_slabs_init);
+}
+
+static slabs_cache *get_cache(void) {
+    slabs_cache *c;
+
+    pthread_once(&slabs_once, do_slabs_init);
+    c = (slabs_cache *)pthread_getspecific(cache_key);
+    if (c)
+        return c;
+
+    c = (slabs_cache *)calloc(1, sizeof(slabs_cache));
+    if (c == NULL) {
+        perror("Can't allocate slabs cache");
+        exit(EXIT_FAILURE);
+    }
+    pthread_mutex_lock(&caches_lock);
+    c->next = caches;
+    if (caches)
+        caches->prev = c;
+    caches = c;
+    pthread_mutex_unlock(&caches_lock);
+    pthread_setspecific(cache_key, c);
+    return c;
+}
+
+unsigned int slabs_clsid(const size_t size) {
+    unsigned int res = 1;
+
+    if (size == 0)
+        return 0;
+    pthread_once(&slabs_once, do_slabs_init);
+    while (size > slabclass[res].size)
+        if (res++ == power_largest)     /* won't fit in the biggest slab */
+            return 0;
+    return res;
+}
+
+/* gets a fresh page for the class; the caller holds its lock */
+static int do_slabs_newslab(slabclass_t *p) {
+    char *ptr;
+
+    pthread_mutex_lock(&mem_lock);
+    if (mem_limit && mem_malloced + SLABS_PAGE_SIZE > mem_limit) {
+        pthread_mutex_unlock(&mem_lock);
+        return 0;
+    }
+    mem_malloced += SLABS_PAGE_SIZE;
+    pthread_mutex_unlock(&mem_lock);
+
+    ptr = (char *)malloc(SLABS_PAGE_SIZE);
+    if (ptr == NULL) {
+        pthread_mutex_lock(&mem_lock);
+        mem_malloced -= SLABS_PAGE_SIZE;
+        pthread_mutex_unlock(&mem_lock);
+        return 0;
+    }
+
+    p->end_page_ptr = ptr;
+    p->end_page_free = p->perslab;
+    p->slabs++;
+    return 1;
+}
+
+/* moves up to n chunks from the depot into chunks; returns how many */
+static unsigned int depot_get(slabclass_t *p, void **chunks, const unsigned int n) {
+    unsigned int got = 0;
+
+    pthread_mutex_lock(&p->lock);
+    while (got < n) {
+        if (p->sl_curr > 0) {
+            void *ptr = p->slots;
+            p->slots = *(void **)ptr;
+            p->sl_curr--;
+            chunks[got++] = ptr;
+        } else if (p->end_page_free > 0 || do_slabs_newslab(p)) {
+            chunks[got++] = p->end_page_ptr;
+            if (--p->end_page_free != 0) {
+                p->end_page_ptr += p->size;
+            } else {
+                p->end_page_ptr = 0;
+            }
+        } else {
+            break;
+        }
+    }
+    pthread_mutex_unlock(&p->lock);
+    return got;
+}
+
+static void depot_put(slabclass_t *p, void **chunks, const unsigned int n) {
+    unsigned int i;
+
+    if (n == 0)
+        return;
+    pthread_mutex_lock(&p->lock);
+    for (i = 0; i < n; i++) {
+        *(void **)chunks[i] = p->slots;
+        p->slots = chunks[i];
+    }
+    p->sl_curr += n;
+    pthread_mutex_unlock(&p->lock);
+}
+
+void *slabs_alloc(const size_t size, const unsigned int id) {
+    slabs_cache *c = get_cache();
+
+    if (id < 1 || id > power_largest)
+        return NULL;
+    assert(size <= slabclass[id].size);
+
+    if (c->nmag[id] == 0) {
+        c->nmag[id] = depot_get(&slabclass[id], c->mag[id], SLABS_MAGAZINE_SIZE / 2);
+        if (c->nmag[id] == 0)
+            return NULL;
+    }
+    c->used[id]++;
+    c->requested[id] += size;
+    return c->mag[id][--c->nmag[id]];
+}
+
+void slabs_free(void *ptr, const size_t size, const unsigned int id) {
+    slabs_cache *c = get_cache();
+
+    assert(id >= 1 && id <= power_largest);
+    assert(size <= slabclass[id].size);
+
+    if (c->nmag[id] == SLABS_MAGAZINE_SIZE) {
+        depot_put(&slabclass[id], c->mag[id] + SLABS_MAGAZINE_SIZE / 2,
+                  SLABS_MAGAZINE_SIZE / 2);
+        c->nmag[id] = SLABS_MAGAZINE_SIZE / 2;
+    }
+    c->mag[id][c->nmag[id]++] = ptr;
+    c->used[id]--;
+    c->requested[id] -= size;
+}
+
+unsigned int slabs_classes(void) {
+    pthread_once(&slabs_once, do_slabs_init);
+    return power_largest;
+}
+
+int slabs_class_stats(const unsigned int id, struct slabs_stats *st) {
+    slabclass_t *p;
+    slabs_cache *c;
+    long long used, requested;
+
+    pthread_once(&slabs_once, do_slabs_init);
+    if (id < 1 || id > power_largest)
+        return -1;
+    p = &slabclass[id];
+
+    pthread_mutex_lock(&caches_lock);
+    pthread_mutex_lock(&p->lock);
+    st->chunk_size = p->size;
+    st->perslab = p->perslab;
+    st->pages = p->slabs;
+    used = p->used;
+    requested = p->requested;
+    pthread_mutex_unlock(&p->lock);
+    /* other threads' counters are read without their cooperation */
+    for (c = caches; c != NULL; c = c->next) {
+        used += c->used[id];
+        requested += c->requested[id];
+    }
+    pthread_mutex_unlock(&caches_lock);
+
+    st->used_chunks = used > 0 ? used : 0;
+    st->requested_bytes = requested > 0 ? requested : 0;
+    st->fragmentation = st->used_chunks == 0 ? 0.0 :
+        1.0 - (double)st->requested_bytes / ((double)st->used_chunks * st->chunk_size);
+    return 0;
+}
+
+item *slabs_item_alloc(const S_CHAR *key, const S_UINT nkey, const S_UINT32 nvalue,
+                       const rel_time_t exptime) {
+    size_t ntotal = sizeof(item) + nkey + nvalue;
+    unsigned int id = slabs_clsid(ntotal);
+    item *it;
+
+    if (id == 0) {
+        it = (item *)malloc(ntotal);
+    } else {
+        it = (item *)slabs_alloc(ntotal, id);
+    }
+    if (it == NULL)
+        return NULL;
+
+    it->h_next = NULL;
+    it->hv = 0;
+    it->it_flags = 0;
+    it->slabs_clsid = id;
+    it->nkey = nkey;
+    it->key = (S_CHAR *)(it + 1);
+    memcpy(it->key, key, nkey);
+    it->nvalue = nvalue;
+    it->exptime = exptime;
+    it->value = it->key + nkey;
+    return it;
+}
+
+item *slabs_item_alloc_inline(const S_CHAR *key, const S_UINT nkey, const S_UINT32 nvalue,
+                              const rel_time_t exptime) {
+    size_t ntotal = ITEM_inline_size(nkey, nvalue) + (exptime ? sizeof(exptime) : 0);
+    unsigned int id;
+    struct node_inline *it;
+
+    if (nkey > ITEM_INLINE_KEY_MAX || nvalue > ITEM_INLINE_VALUE_MAX)
+        return NULL;
+    id = slabs_clsid(ntotal);
+    if (id == 0) {
+        it = (struct node_inline *)malloc(ntotal);
+    } else {
+        it = (struct node_inline *)slabs_alloc(ntotal, id);
+    }
+    if (it == NULL)
+        return NULL;
+
+    it->h_next = NULL;
+    it->hv = 0;
+    it->it_flags = ITEM_INLINE;
+    it->slabs_clsid = id;
+    it->nkey = nkey;
+    memcpy(it->data, key, nkey);
+    it->nvalue = nvalue;
+    if (exptime) {
+        it->it_flags |= ITEM_EXPTIME;
+        memcpy(it->data + nkey + nvalue, &exptime, sizeof(exptime));
+    }
+    return (item *)it;
+}
+
+void slabs_item_free(item *it) {
+    size_t ntotal;
+
+    if (it->slabs_clsid == 0) {
+        free(it);
+        return;
+    }
+    if (it->it_flags & ITEM_INLINE) {
+        ntotal = ITEM_inline_ntotal(it);
+    } else {
+        ntotal = sizeof(item) + it->nkey + it->nvalue;
+    }
+    slabs_free(it, ntotal, it->slabs_clsid);
+}
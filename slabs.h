@@ -0,0 +1,73 @@
+#ifndef SLABS_H
+#define SLABS_H
+
+#include <stddef.h>
+#include "hashtable.h"
+
+/*
+  Slab allocator for hashtable items.
+
+  Memory comes in SLABS_PAGE_SIZE pages, each carved into equal chunks of
+  one size class; class sizes grow by the factor given to slabs_init().
+  Each thread keeps a small magazine of free chunks per class, so alloc and
+  free only take the class lock when a magazine runs dry or overflows, and
+  then move half a magazine at a time.
+
+  slabs_item_alloc() puts the node, its key and its value in one chunk;
+  slabs_item_alloc_inline() does the same with the compact node_inline
+  header for tables created with HASHTABLE_INLINE_KEYS.
+ */
+
+#define SLABS_PAGE_SIZE (1024 * 1024)
+#define SLABS_MAX_CLASSES 64
+#define SLABS_CHUNK_MIN 48
+#define SLABS_FACTOR_DEFAULT 1.25
+/* free chunks a thread keeps per class */
+#define SLABS_MAGAZINE_SIZE 32
+
+struct slabs_stats {
+    size_t chunk_size;
+    unsigned int perslab;           /* chunks per page */
+    unsigned int pages;
+    S_UINT64 used_chunks;           /* handed out and not yet freed */
+    S_UINT64 requested_bytes;       /* what the used chunks were asked for */
+    /* share of the used chunks' bytes lost to rounding up to chunk_size */
+    double fragmentation;
+};
+
+/*
+ * Sets up the size classes. limit caps the memory taken for pages, 0 for
+ * no cap. Call before the first allocation; otherwise the defaults (no
+ * cap, SLABS_FACTOR_DEFAULT) are used.
+ */
+void slabs_init(const size_t limit, const double factor);
+
+/* the class for an object of this size, 0 if it is too big for any */
+unsigned int slabs_clsid(const size_t size);
+void *slabs_alloc(const size_t size, const unsigned int id);
+void slabs_free(void *ptr, const size_t size, const unsigned int id);
+
+/* number of classes; ids run from 1 to this */
+unsigned int slabs_classes(void);
+/* returns -1 for an unknown class. Counts from running threads lag a bit. */
+int slabs_class_stats(const unsigned int id, struct slabs_stats *st);
+
+/*
+ * Allocates a node with room for nkey bytes of key, copied from key, and
+ * nvalue bytes of value, all in one chunk, expiring at exptime (0 for
+ * never). Items too big for any class fall back to malloc(). Returns NULL
+ * when out of memory.
+ */
+item *slabs_item_alloc(const S_CHAR *key, const S_UINT nkey, const S_UINT32 nvalue,
+                       const rel_time_t exptime);
+/*
+ * The same as a struct node_inline, which only takes room for an exptime
+ * if it has one. Returns NULL as well if the key is longer than
+ * ITEM_INLINE_KEY_MAX or the value than ITEM_INLINE_VALUE_MAX.
+ */
+item *slabs_item_alloc_inline(const S_CHAR *key, const S_UINT nkey, const S_UINT32 nvalue,
+                              const rel_time_t exptime);
+/* frees either kind */
+void slabs_item_free(item *it);
+
+#endif
@@ -0,0 +1,418 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * Hashtable snapshots: written from one consistent point of a table,
+ * read back through mmap().
+ */
+#include "snapshot.h"
+#include "hash64.h"
+#include "slabs.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define SNAPSHOT_BYTE_ORDER 0x01020304
+#define SNAPSHOT_HASH_PROBE "snapshot hash check"
+/* the body checksum is chained over blocks this big */
+#define SNAPSHOT_CHECKSUM_BLOCK (1024 * 1024)
+
+#define hashsize(n) ((S_UINT64)1<<(n))
+
+struct snapshot {
+    const char *base;
+    size_t size;
+    const struct snapshot_header *hdr;
+    const S_UINT64 *buckets;
+    S_UINT32 mask;
+};
+
+/* what a record takes in the file, padded so the next one is aligned */
+static size_t record_size(const S_UINT nkey, const S_UINT32 nvalue) {
+    return (sizeof(struct snapshot_record) + nkey + nvalue + 7) & ~(size_t)7;
+}
+
+static S_UINT64 body_checksum(const char *body, size_t len) {
+    S_UINT64 sum = 0;
+    size_t n;
+
+    while (len > 0) {
+        n = len < SNAPSHOT_CHECKSUM_BLOCK ? len : SNAPSHOT_CHECKSUM_BLOCK;
+        sum = hash64(body, n, sum);
+        body += n;
+        len -= n;
+    }
+    return sum;
+}
+
+static S_UINT64 header_checksum(const struct snapshot_header *h) {
+    return hash64(h, offsetof(struct snapshot_header, header_checksum), 0);
+}
+
+/* both passes of snapshot_write() */
+struct snapshot_writer {
+    bool inline_keys;
+    /* items expired by then are left out; wall is the same moment */
+    rel_time_t now;
+    time_t wall;
+    unsigned int power;
+    S_UINT32 mask;
+    char *base;
+    /*
+     * In the mapped file. Placing starts each at the end of its chain and
+     * moves it down a record at a time, so it ends at the chain's start.
+     */
+    S_UINT64 *buckets;
+    /* sized: the bytes of each chain; placed: the offset its chain ends at */
+    S_UINT64 *ends;
+    S_UINT64 nitems;
+};
+
+/* the fields of either node layout; plain nodes may not set it_flags */
+struct record_fields {
+    const S_CHAR *key;
+    S_UINT nkey;
+    const S_CHAR *value;
+    S_UINT32 nvalue;
+    rel_time_t exptime;
+};
+
+static bool writer_takes(const struct snapshot_writer *w, const item *it,
+                         struct record_fields *f) {
+    if (w->inline_keys) {
+        f->key = ITEM_inline(it)->data;
+        f->nkey = ITEM_inline(it)->nkey;
+        f->value = f->key + f->nkey;
+        f->nvalue = ITEM_inline(it)->nvalue;
+        f->exptime = item_exptime(it);
+    } else {
+        f->key = it->key;
+        f->nkey = it->nkey;
+        f->value = it->value;
+        f->nvalue = it->nvalue;
+        f->exptime = it->exptime;
+    }
+    return f->exptime == 0 || f->exptime > w->now;
+}
+
+static void size_item(const item *it, void *arg) {
+    struct snapshot_writer *w = (struct snapshot_writer *)arg;
+    struct record_fields f;
+
+    if (! writer_takes(w, it, &f))
+        return;
+    w->ends[it->hv & w->mask] += record_size(f.nkey, f.nvalue);
+    w->nitems++;
+}
+
+static void place_item(const item *it, void *arg) {
+    struct snapshot_writer *w = (struct snapshot_writer *)arg;
+    struct snapshot_record *r;
+    struct record_fields f;
+    S_UINT32 b = it->hv & w->mask;
+    size_t size;
+
+    if (! writer_takes(w, it, &f))
+        return;
+    size = record_size(f.nkey, f.nvalue);
+    w->buckets[b] -= size;
+    r = (struct snapshot_record *)(w->base + w->buckets[b]);
+    r->exptime = f.exptime ? (S_UINT64)w->wall + (f.exptime - w->now) : 0;
+    /* the record placed before this one follows it, unless there was none */
+    r->next = w->buckets[b] + size == w->ends[b] ? 0 : (S_UINT32)size;
+    r->hv = it->hv;
+    r->nkey = f.nkey;
+    r->nvalue = f.nvalue;
+    memcpy((S_CHAR *)(r + 1), f.key, f.nkey);
+    memcpy((S_CHAR *)(r + 1) + f.nkey, f.value, f.nvalue);
+}
+
+/*
+ * Sizes the table's chains, lays them out in fd and copies the items in,
+ * all while the table is frozen. Returns the mapped file, or NULL.
+ */
+static char *write_frozen(HashTable *ht, const int fd, struct snapshot_writer *w,
+                          size_t *size) {
+    S_UINT64 nbuckets, b, off;
+    void *base;
+
+    w->power = ht->power();
+    nbuckets = hashsize(w->power);
+    w->now = hashtable_current_time();
+    w->wall = time(NULL);
+    w->mask = (S_UINT32)(nbuckets - 1);
+    w->ends = (S_UINT64 *)calloc(nbuckets, sizeof(S_UINT64));
+    if (w->ends == NULL) {
+        fprintf(stderr, "Failed to allocate %llu snapshot buckets\n", nbuckets);
+        return NULL;
+    }
+    ht->walk(size_item, w);
+
+    off = sizeof(struct snapshot_header) + nbuckets * sizeof(S_UINT64);
+    for (b = 0; b < nbuckets; b++) {
+        if (w->ends[b] != 0) {
+            off += w->ends[b];
+            w->ends[b] = off;
+        }
+    }
+    *size = off;
+    if (ftruncate(fd, off) != 0) {
+        fprintf(stderr, "Failed to size snapshot: %s\n", strerror(errno));
+        free(w->ends);
+        return NULL;
+    }
+    base = mmap(NULL, off, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (base == MAP_FAILED) {
+        fprintf(stderr, "Failed to map snapshot: %s\n", strerror(errno));
+        free(w->ends);
+        return NULL;
+    }
+    w->base = (char *)base;
+    w->buckets = (S_UINT64 *)(w->base + sizeof(struct snapshot_header));
+    memcpy(w->buckets, w->ends, nbuckets * sizeof(S_UINT64));
+    ht->walk(place_item, w);
+    free(w->ends);
+    return w->base;
+}
+
+int snapshot_write(HashTable *ht, const char *path) {
+    struct snapshot_writer w;
+    struct snapshot_header *h;
+    size_t len = strlen(path), size = 0;
+    char *tmp = (char *)malloc(len + sizeof(".tmp"));
+    char *base;
+    int fd, ret = 0;
+
+    if (tmp == NULL) {
+        fprintf(stderr, "Failed to allocate snapshot path\n");
+        return -1;
+    }
+    memcpy(tmp, path, len);
+    memcpy(tmp + len, ".tmp", sizeof(".tmp"));
+    fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        fprintf(stderr, "Failed to create %s: %s\n", tmp, strerror(errno));
+        free(tmp);
+        return -1;
+    }
+
+    memset(&w, 0, sizeof(w));
+    w.inline_keys = ht->inline_keys();
+    ht->freeze();
+    base = write_frozen(ht, fd, &w, &size);
+    ht->thaw();
+
+    if (base != NULL) {
+        h = (struct snapshot_header *)base;
+        memcpy(h->magic, SNAPSHOT_MAGIC, sizeof(h->magic));
+        h->version = SNAPSHOT_VERSION;
+        h->byte_order = SNAPSHOT_BYTE_ORDER;
+        h->hashpower = w.power;
+        h->hash_check = ht->hash_key(SNAPSHOT_HASH_PROBE, strlen(SNAPSHOT_HASH_PROBE));
+        h->nitems = w.nitems;
+        h->file_size = size;
+        h->created = w.wall;
+        h->body_checksum = body_checksum(base + sizeof(*h), size - sizeof(*h));
+        h->header_checksum = header_checksum(h);
+        if (msync(base, size, MS_SYNC) != 0) {
+            fprintf(stderr, "Failed to write %s: %s\n", tmp, strerror(errno));
+            ret = -1;
+        }
+        munmap(base, size);
+    } else {
+        ret = -1;
+    }
+    if (fsync(fd) != 0 && ret == 0) {
+        fprintf(stderr, "Failed to sync %s: %s\n", tmp, strerror(errno));
+        ret = -1;
+    }
+    close(fd);
+    if (ret == 0 && rename(tmp, path) != 0) {
+        fprintf(stderr, "Failed to rename %s to %s: %s\n", tmp, path, strerror(errno));
+        ret = -1;
+    }
+    if (ret != 0)
+        unlink(tmp);
+    free(tmp);
+    return ret;
+}
+
+static bool header_ok(const snapshot *s, const char *path) {
+    const struct snapshot_header *h = s->hdr;
+
+    if (memcmp(h->magic, SNAPSHOT_MAGIC, sizeof(h->magic)) != 0) {
+        fprintf(stderr, "%s is not a snapshot\n", path);
+    } else if (h->byte_order != SNAPSHOT_BYTE_ORDER) {
+        fprintf(stderr, "%s was written in the other byte order\n", path);
+    } else if (h->version != SNAPSHOT_VERSION) {
+        fprintf(stderr, "%s is snapshot version %u, expected %u\n", path,
+                (unsigned int)h->version, SNAPSHOT_VERSION);
+    } else if (h->header_checksum != header_checksum(h)) {
+        fprintf(stderr, "%s: header checksum mismatch\n", path);
+    } else if (h->file_size != s->size || h->hashpower > 32 ||
+               sizeof(*h) + hashsize(h->hashpower) * sizeof(S_UINT64) > s->size) {
+        fprintf(stderr, "%s is truncated\n", path);
+    } else {
+        return true;
+    }
+    return false;
+}
+
+snapshot *snapshot_open(const char *path) {
+    snapshot *s;
+    struct stat st;
+    void *base;
+    int fd = open(path, O_RDONLY);
+
+    if (fd < 0) {
+        fprintf(stderr, "Failed to open %s: %s\n", path, strerror(errno));
+        return NULL;
+    }
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(struct snapshot_header)) {
+        fprintf(stderr, "%s is not a snapshot\n", path);
+        close(fd);
+        return NULL;
+    }
+    base = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) {
+        fprintf(stderr, "Failed to map %s: %s\n", path, strerror(errno));
+        return NULL;
+    }
+    s = (snapshot *)calloc(1, sizeof(snapshot));
+    if (s == NULL) {
+        fprintf(stderr, "Failed to allocate snapshot\n");
+        munmap(base, st.st_size);
+        return NULL;
+    }
+    s->base = (const char *)base;
+    s->size = st.st_size;
+    s->hdr = (const struct snapshot_header *)base;
+    if (! header_ok(s, path)) {
+        snapshot_close(s);
+        return NULL;
+    }
+    s->buckets = (const S_UINT64 *)(s->base + sizeof(struct snapshot_header));
+    s->mask = (S_UINT32)(hashsize(s->hdr->hashpower) - 1);
+    /* lookups touch a chain here and there; don't read around them */
+    madvise((void *)s->base, s->size, MADV_RANDOM);
+    return s;
+}
+
+void snapshot_close(snapshot *s) {
+    munmap((void *)s->base, s->size);
+    free(s);
+}
+
+int snapshot_verify(snapshot *s) {
+    S_UINT64 sum;
+
+    madvise((void *)s->base, s->size, MADV_SEQUENTIAL);
+    sum = body_checksum(s->base + sizeof(struct snapshot_header),
+                        s->size - sizeof(struct snapshot_header));
+    madvise((void *)s->base, s->size, MADV_RANDOM);
+    if (sum != s->hdr->body_checksum) {
+        fprintf(stderr, "Snapshot body checksum mismatch\n");
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Stays inside the mapping whatever the offsets say, so an unverified
+ * snapshot can give wrong answers but not a fault.
+ */
+const struct snapshot_record *snapshot_find(const snapshot *s, const S_CHAR *key,
+                                            const S_UINT nkey, const S_UINT32 hv) {
+    const struct snapshot_record *r;
+    S_UINT64 off = s->buckets[hv & s->mask];
+
+    while (off != 0 && (off & 7) == 0 && off + sizeof(*r) <= s->size) {
+        r = (const struct snapshot_record *)(s->base + off);
+        if (r->hv == hv && r->nkey == nkey &&
+            off + sizeof(*r) + (S_UINT64)r->nkey + r->nvalue <= s->size &&
+            memcmp(SNAPSHOT_key(r), key, nkey) == 0) {
+            if (r->exptime != 0 && r->exptime <= (S_UINT64)time(NULL))
+                return NULL;
+            return r;
+        }
+        if (r->next == 0)
+            break;
+        off += r->next;
+    }
+    return NULL;
+}
+
+S_UINT64 snapshot_items(const snapshot *s) {
+    return s->hdr->nitems;
+}
+
+bool snapshot_hash_matches(const snapshot *s, const HashTable *ht) {
+    return ht->hash_key(SNAPSHOT_HASH_PROBE, strlen(SNAPSHOT_HASH_PROBE)) ==
+        s->hdr->hash_check;
+}
+
+long snapshot_load(snapshot *s, HashTable *ht, const int nthreads) {
+    const struct snapshot_record *r;
+    rel_time_t now = hashtable_current_time(), exptime;
+    S_UINT64 wall = time(NULL), b, off;
+    bool inline_keys = ht->inline_keys();
+    size_t n = 0, i;
+    item **items;
+    S_UINT32 *hvs;
+    item *it;
+
+    if (! snapshot_hash_matches(s, ht)) {
+        fprintf(stderr, "Snapshot was written with another hash function\n");
+        return -1;
+    }
+    if (snapshot_verify(s) != 0)
+        return -1;
+    items = (item **)malloc(s->hdr->nitems * sizeof(item *) + 1);
+    hvs = (S_UINT32 *)malloc(s->hdr->nitems * sizeof(S_UINT32) + 1);
+    if (items == NULL || hvs == NULL) {
+        fprintf(stderr, "Failed to allocate %llu snapshot items\n", s->hdr->nitems);
+        free(items);
+        free(hvs);
+        return -1;
+    }
+
+    madvise((void *)s->base, s->size, MADV_SEQUENTIAL);
+    for (b = 0; b <= s->mask; b++) {
+        for (off = s->buckets[b]; off != 0; off = r->next ? off + r->next : 0) {
+            r = (const struct snapshot_record *)(s->base + off);
+            if (r->exptime != 0 && r->exptime <= wall)
+                continue;
+            exptime = r->exptime ? now + (rel_time_t)(r->exptime - wall) : 0;
+            if (inline_keys)
+                it = slabs_item_alloc_inline(SNAPSHOT_key(r), r->nkey, r->nvalue, exptime);
+            else
+                it = slabs_item_alloc(SNAPSHOT_key(r), r->nkey, r->nvalue, exptime);
+            if (it == NULL) {
+                fprintf(stderr, "Failed to allocate snapshot item %lu\n",
+                        (unsigned long)n);
+                for (i = 0; i < n; i++)
+                    slabs_item_free(items[i]);
+                free(items);
+                free(hvs);
+                madvise((void *)s->base, s->size, MADV_RANDOM);
+                return -1;
+            }
+            memcpy(ITEM_value(it), SNAPSHOT_value(r), r->nvalue);
+            items[n] = it;
+            hvs[n] = r->hv;
+            n++;
+        }
+    }
+    madvise((void *)s->base, s->size, MADV_RANDOM);
+
+    ht->bulk_load(items, hvs, n, nthreads);
+    free(items);
+    free(hvs);
+    return (long)n;
+}
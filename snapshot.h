@@ -0,0 +1,102 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <stddef.h>
+#include "hashtable.h"
+
+/*
+  On-disk snapshot of a HashTable, for restarting warm.
+
+  The file is a header, an array of hashsize(hashpower) bucket offsets and
+  the records, packed chain by chain in bucket order:
+
+    struct snapshot_header
+    S_UINT64 buckets[hashsize(hashpower)]   offset of the first record, 0 if empty
+    struct snapshot_record, key, value, padded to 8 bytes ...
+
+  Offsets are from the start of the file and a record's next is relative
+  to the record, so the file means the same wherever it is mapped and is
+  usable straight from mmap(): snapshot_open() reads only the header and
+  snapshot_find() faults in the pages of the chain it walks. Exptimes are
+  wall clock seconds, since item exptimes don't outlive the process.
+
+  The header carries its own checksum, checked on open, and one of the
+  body, hash64() chained over it a block at a time, which snapshot_verify()
+  and snapshot_load() check.
+
+  Values are in host byte order; a snapshot from the other byte order is
+  refused rather than converted.
+ */
+
+#define SNAPSHOT_MAGIC "HTSNAP\0"
+#define SNAPSHOT_VERSION 1
+
+struct snapshot_header {
+    char magic[8];              /* SNAPSHOT_MAGIC */
+    S_UINT32 version;           /* SNAPSHOT_VERSION */
+    S_UINT32 byte_order;        /* 0x01020304 as the writer stored it */
+    S_UINT32 hashpower;
+    /* the writer's hash of a fixed key, so tables hashing otherwise refuse it */
+    S_UINT32 hash_check;
+    S_UINT64 nitems;
+    S_UINT64 file_size;
+    S_UINT64 created;           /* wall clock seconds at the consistent point */
+    S_UINT64 body_checksum;     /* of everything after the header */
+    S_UINT64 header_checksum;   /* of the header up to this field */
+};
+
+struct snapshot_record {
+    S_UINT64 exptime;           /* wall clock seconds, 0 for never */
+    S_UINT32 next;              /* bytes on to the next record of the chain, 0 at its end */
+    S_UINT32 hv;
+    S_UINT32 nkey;
+    S_UINT32 nvalue;
+    /* key, then value */
+};
+
+#define SNAPSHOT_key(r) ((const S_CHAR *)((r) + 1))
+#define SNAPSHOT_value(r) (SNAPSHOT_key(r) + (r)->nkey)
+
+typedef struct snapshot snapshot;
+
+/*
+ * Writes every unexpired item of ht to path, atomically replacing it. The
+ * items are taken between freeze() and thaw(), so the snapshot is one
+ * consistent point of the table, between two migration steps if it is
+ * migrating; only the copy into the page cache happens in that window.
+ * A table that isn't concurrent must be under the caller's lock(). Returns
+ * 0, or -1 after printing why.
+ */
+int snapshot_write(HashTable *ht, const char *path);
+
+/*
+ * Maps path read-only after checking its header; the records are left to
+ * fault in as they are used. Returns NULL after printing why.
+ */
+snapshot *snapshot_open(const char *path);
+void snapshot_close(snapshot *s);
+/* reads the whole body to check its checksum; 0 if it matches, else -1 */
+int snapshot_verify(snapshot *s);
+
+/*
+ * The record for key, hashed to hv by the function the snapshot was
+ * written with, or NULL if it isn't there or has expired. Points into the
+ * mapping, valid until snapshot_close().
+ */
+const struct snapshot_record *snapshot_find(const snapshot *s, const S_CHAR *key,
+                                            const S_UINT nkey, const S_UINT32 hv);
+
+S_UINT64 snapshot_items(const snapshot *s);
+/* whether ht hashes keys the way the snapshot's writer did */
+bool snapshot_hash_matches(const snapshot *s, const HashTable *ht);
+
+/*
+ * Verifies the snapshot and copies its unexpired records into ht with
+ * bulk_load() on nthreads threads, allocating them from the slabs (inline
+ * nodes if ht has HASHTABLE_INLINE_KEYS). None of the keys may be in ht
+ * already. Returns how many were loaded, or -1 after printing why, with
+ * nothing loaded.
+ */
+long snapshot_load(snapshot *s, HashTable *ht, const int nthreads);
+
+#endif
@@ -0,0 +1,190 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * Stand-in for memcached.h and the parts of libevent that thread.cpp uses,
+ * so that the build can compile thread.cpp without the rest of memcached.
+ * Only declarations: nothing built against it is ever linked. The types
+ * follow memcached 1.4; item and rel_time_t are the ones in hashtable.h.
+ */
+#ifndef MEMCACHED_H
+#define MEMCACHED_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <unistd.h>
+#include "hashtable.h"
+
+/* libevent */
+#define EV_READ     0x02
+#define EV_PERSIST  0x10
+
+struct event_base;
+struct event {
+    void *ev_opaque[16];
+};
+
+struct event_base *event_base_new(void);
+void event_set(struct event *ev, int fd, short events,
+               void (*callback)(int, short, void *), void *arg);
+int event_base_set(struct event_base *base, struct event *ev);
+int event_add(struct event *ev, const struct timeval *timeout);
+int event_base_loop(struct event_base *base, int flags);
+
+/* cache.h */
+typedef struct cache_t cache_t;
+typedef int cache_constructor_t(void *obj, void *notused1, int notused2);
+typedef void cache_destructor_t(void *obj, void *notused);
+cache_t *cache_create(const char *name, size_t bufsize, size_t align,
+                      cache_constructor_t *constructor,
+                      cache_destructor_t *destructor);
+
+/* trace.h */
+#define MEMCACHED_CONN_DISPATCH(arg0, arg1)
+
+#define likely(x)   __builtin_expect(!!(x), 1)
+#define unlikely(x) __builtin_expect(!!(x), 0)
+
+#define mutex_lock(x)   pthread_mutex_lock(x)
+#define mutex_unlock(x) pthread_mutex_unlock(x)
+
+#define SUFFIX_SIZE 24
+#define MAX_NUMBER_OF_SLAB_CLASSES (63 + 1)
+
+typedef void (*ADD_STAT)(const char *key, const uint16_t klen,
+                         const char *val, const uint32_t vlen,
+                         const void *cookie);
+
+enum conn_states {
+    conn_listening,
+    conn_new_cmd,
+    conn_waiting,
+    conn_read,
+    conn_parse_cmd,
+    conn_write,
+    conn_nread,
+    conn_swallow,
+    conn_closing,
+    conn_mwrite,
+    conn_max_state
+};
+
+enum network_transport {
+    local_transport,
+    tcp_transport,
+    udp_transport
+};
+
+#define IS_UDP(x) (x == udp_transport)
+
+enum item_lock_types {
+    ITEM_LOCK_GRANULAR = 0,
+    ITEM_LOCK_GLOBAL
+};
+
+enum store_item_type {
+    NOT_STORED = 0, STORED, EXISTS, NOT_FOUND
+};
+
+enum delta_result_type {
+    OK = 0, NON_NUMERIC, EOM, DELTA_ITEM_NOT_FOUND, DELTA_ITEM_CAS_MISMATCH
+};
+
+struct slab_stats {
+    uint64_t  set_cmds;
+    uint64_t  get_hits;
+    uint64_t  touch_hits;
+    uint64_t  delete_hits;
+    uint64_t  cas_hits;
+    uint64_t  cas_badval;
+    uint64_t  incr_hits;
+    uint64_t  decr_hits;
+};
+
+struct thread_stats {
+    pthread_mutex_t   mutex;
+    uint64_t          get_cmds;
+    uint64_t          get_misses;
+    uint64_t          touch_cmds;
+    uint64_t          touch_misses;
+    uint64_t          delete_misses;
+    uint64_t          incr_misses;
+    uint64_t          decr_misses;
+    uint64_t          cas_misses;
+    uint64_t          bytes_read;
+    uint64_t          bytes_written;
+    uint64_t          flush_cmds;
+    uint64_t          conn_yields;
+    uint64_t          auth_cmds;
+    uint64_t          auth_errors;
+    struct slab_stats slab_stats[MAX_NUMBER_OF_SLAB_CLASSES];
+};
+
+struct stats {
+    unsigned int  curr_conns;
+    unsigned int  total_conns;
+    unsigned int  reserved_fds;
+};
+
+struct settings {
+    int verbose;
+    int num_threads;
+};
+
+extern struct stats stats;
+extern struct settings settings;
+
+typedef struct {
+    pthread_t thread_id;        /* unique ID of this thread */
+    struct event_base *base;    /* libevent handle this thread uses */
+    struct event notify_event;  /* listen event for notify pipe */
+    int notify_receive_fd;      /* receiving end of notify pipe */
+    int notify_send_fd;         /* sending end of notify pipe */
+    struct thread_stats stats;  /* Stats generated by this thread */
+    struct conn_queue *new_conn_queue; /* queue of new connections to handle */
+    cache_t *suffix_cache;      /* suffix cache */
+    uint8_t item_lock_type;     /* use fine-grained or global item lock */
+    int index;                  /* its slot in thread.cpp's threads */
+} LIBEVENT_THREAD;
+
+typedef struct {
+    pthread_t thread_id;        /* unique ID of this thread */
+    struct event_base *base;    /* libevent handle this thread uses */
+} LIBEVENT_DISPATCHER_THREAD;
+
+typedef struct conn conn;
+struct conn {
+    int sfd;
+    LIBEVENT_THREAD *thread;    /* the worker that owns this connection */
+};
+
+conn *conn_new(const int sfd, const enum conn_states init_state,
+               const int event_flags, const int read_buffer_size,
+               enum network_transport transport, struct event_base *base);
+void do_accept_new_conns(const bool do_accept);
+
+item *do_item_alloc(char *key, const size_t nkey, const int flags,
+                    const rel_time_t exptime, const int nbytes,
+                    const uint32_t cur_hv);
+item *do_item_get(const char *key, const size_t nkey, const uint32_t hv);
+item *do_item_touch(const char *key, const size_t nkey, uint32_t exptime,
+                    const uint32_t hv);
+int do_item_link(item *it, const uint32_t hv);
+void do_item_unlink(item *it, const uint32_t hv);
+void do_item_remove(item *it);
+void do_item_update(item *it);
+int do_item_replace(item *it, item *new_it, const uint32_t hv);
+void do_item_flush_expired(void);
+char *do_item_cachedump(const unsigned int slabs_clsid,
+                        const unsigned int limit, unsigned int *bytes);
+void do_item_stats(ADD_STAT add_stats, void *c);
+void do_item_stats_totals(ADD_STAT add_stats, void *c);
+void do_item_stats_sizes(ADD_STAT add_stats, void *c);
+enum delta_result_type do_add_delta(conn *c, const char *key,
+                                    const size_t nkey, const bool incr,
+                                    const int64_t delta, char *buf,
+                                    uint64_t *cas, const uint32_t hv);
+enum store_item_type do_store_item(item *item, int comm, conn* c,
+                                   const uint32_t hv);
+
+#endif /* MEMCACHED_H */
@@ -15,13 +15,18 @@ int main(void)
 {
     
     item i1;
-    i1.key = "key";
+    memset(&i1, 0, sizeof(i1));
+    i1.key = (S_CHAR *)"key";
     i1.nkey = strlen(i1.key)+1;
-    i1.value = "value";
+    i1.value = (S_CHAR *)"value";
     i1.nvalue = strlen(i1.value)+1;
     i1.h_next = 0;
-    hashtable_init();
-    hashtable_insert(i1,0);
+    hashtable_init(0);
+    hashtable_insert(&i1, hashtable_hash_lookup3(i1.key, i1.nkey));
+    if (hashtable_find(i1.key, i1.nkey, hashtable_hash_lookup3(i1.key, i1.nkey)) != &i1) {
+        fprintf(stderr, "find key=%s fail\n", i1.key);
+        return 1;
+    }
     return 0;
 }
 
@@ -7,8 +7,9 @@
 #include <string.h>
 #include "times33hash.h"
 #include "hashtable.h"
+#include "basichashtable.h"
 #include <iostream>
-#include "win.h"
+#include "portable.h"
 #include <locale.h>
 
 #define UNICODE
@@ -20,8 +21,8 @@ int main(void)
 {
     setlocale(LC_ALL, "chs");
     FILE *fh;    
-    S_CHAR *key = "i am student";
-    S_WCHAR *key2 = L"Ƿǳɰתͷ123";
+    const S_CHAR *key = "i am student";
+    const S_WCHAR *key2 = L"Ƿǳɰתͷ123";
         
     fh = fopen("test.log","a");
     printf("key=%s, the hash value is %d\n", key, Times33Hash::hash(key, strlen(key)));
@@ -35,10 +36,25 @@ int main(void)
 
     hashtable_init(0);
     item it;
+    memset(&it, 0, sizeof(it));
+    it.key = (S_CHAR *)key;
+    it.nkey = strlen(key);
     
-    int i = hashtable_insert(key, strlen(key), 4381);
-    if (i!=1) {
-        wprintf("insert key=%s fail", key);
+    int i = hashtable_insert(&it, hashtable_hash_lookup3(key, it.nkey));
+    if (i!=1 || hashtable_find(key, it.nkey, hashtable_hash_lookup3(key, it.nkey)) != &it) {
+        printf("insert key=%s fail\n", key);
+        return 1;
+    }
+
+    // the wide key as it is, no re-encoding
+    BasicHashTable<S_WCHAR, Times33Hash> wide;
+    basic_node<S_WCHAR> node;
+    memset(&node, 0, sizeof(node));
+    node.key = key2;
+    node.nkey = wcslen(key2);
+    wide.insert(&node);
+    if (wide.find(key2, wcslen(key2)) != &node) {
+        wprintf(L"insert key=%s fail\n", key2);
         return 1;
     }
     
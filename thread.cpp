@@ -2,7 +2,14 @@
 /*
  * Thread management for memcached.
  */
+#include "affinity.h"
+#include "dispatch.h"
+#include "hash.h"
 #include "hashtable.h"
+#include "memcached.h"
+#include "notify.h"
+#include "objpool.h"
+#include "ringqueue.h"
 #include <assert.h>
 #include <stdio.h>
 #include <errno.h>
@@ -10,31 +17,48 @@
 #include <errno.h>
 #include <string.h>
 #include <pthread.h>
+#include <sched.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
 
 #ifdef __sun
 #include <atomic.h>
 #endif
 
-#define ITEMS_PER_ALLOC 64
+/* connections a worker can have waiting before the dispatcher waits on it */
+#define CQ_RING_SIZE 4096
+/*
+ * Free CQ_ITEM batches the depot keeps per worker, enough for the batches
+ * in flight back to the dispatcher; past that they go back to malloc.
+ */
+#define CQI_DEPOT_BATCHES 4
+
+/* What a worker is asked to do by an item on its queue. */
+enum conn_queue_item_modes {
+    queue_new_conn,             /* take over sfd */
+    queue_lock_granular,        /* flip the lock type and report in */
+    queue_lock_global
+};
 
 /* An item in the connection queue. */
 typedef struct conn_queue_item CQ_ITEM;
 struct conn_queue_item {
+    enum conn_queue_item_modes mode;
     int               sfd;
     enum conn_states  init_state;
     int               event_flags;
     int               read_buffer_size;
     enum network_transport     transport;
-    CQ_ITEM          *next;
 };
 
-/* A connection queue. */
+/*
+ * A connection queue, which also carries the worker's other commands. A
+ * lock-free ring: the dispatcher pushes, the worker that owns it pops,
+ * and a burst of pushes wakes the worker once.
+ */
 typedef struct conn_queue CQ;
 struct conn_queue {
-    CQ_ITEM *head;
-    CQ_ITEM *tail;
-    pthread_mutex_t lock;
-    pthread_cond_t  cond;
+    ring_queue *ring;
 };
 
 /* Lock for cache operations (item_*, assoc_*) */
@@ -50,9 +74,29 @@ pthread_mutex_t atomics_mutex = PTHREAD_MUTEX_INITIALIZER;
 /* Lock for global stats */
 static pthread_mutex_t stats_lock;
 
-/* Free list of CQ_ITEM structs */
-static CQ_ITEM *cqi_freelist;
-static pthread_mutex_t cqi_freelist_lock;
+/*
+ * Free CQ_ITEM structs: the dispatcher allocates from its own cache and
+ * each worker frees into its own, meeting in the pool's depot a batch at
+ * a time. Never deleted, as workers may still use it while exiting.
+ */
+static ObjectPool<CQ_ITEM> *cqi_pool;
+
+/*
+ * Picks the worker for each new connection. The workers publish no load:
+ * requests waiting are counted per conn, outside this file, so two-choices
+ * goes by conns.
+ */
+static dispatcher *conn_dispatcher;
+static enum dispatch_policy conn_dispatch_policy = DISPATCH_ROUND_ROBIN;
+
+/* Where the workers run: an affinity spec (see affinity.h), NULL for anywhere */
+static const char *worker_affinity;
+static cpu_topology *topology;
+/* the CPU each worker was started on, -1 if not pinned */
+static int *worker_cpus;
+
+static CQ_ITEM *cqi_new(void);
+static void cq_send(LIBEVENT_THREAD *thread, CQ_ITEM *item);
 
 static pthread_mutex_t *item_locks;
 /* size of the item lock hash table */
@@ -69,8 +113,16 @@ static LIBEVENT_DISPATCHER_THREAD dispatcher_thread;
 /*
  * Each libevent instance has a wakeup pipe, which other threads
  * can use to signal that they've put a new connection on its queue.
+ * Each worker allocates its own, on its node, and fills in its slot.
  */
-static LIBEVENT_THREAD *threads;
+static LIBEVENT_THREAD **threads;
+
+/* What thread_init() hands a worker to set itself up from */
+typedef struct {
+    int index;
+    int notify_receive_fd;
+    int notify_send_fd;
+} worker_start;
 
 /*
  * Number of worker threads that have finished setting themselves up.
@@ -122,9 +174,9 @@ void item_unlock_global(void) {
 }
 
 void item_lock(uint32_t hv) {
-    uint8_t *lock_type = pthread_getspecific(item_lock_type_key);
+    uint8_t *lock_type = (uint8_t *)pthread_getspecific(item_lock_type_key);
     if (likely(*lock_type == ITEM_LOCK_GRANULAR)) {
-        mutex_lock(&item_locks[(hv & hashmask(hashpower)) % item_lock_count]);
+        mutex_lock(&item_locks[(hv & hashmask(hashtable_hashpower())) % item_lock_count]);
     } else {
         mutex_lock(&item_global_lock);
     }
@@ -138,7 +190,7 @@ void item_lock(uint32_t hv) {
  * switch so it should stay safe.
  */
 void *item_trylock(uint32_t hv) {
-    pthread_mutex_t *lock = &item_locks[(hv & hashmask(hashpower)) % item_lock_count];
+    pthread_mutex_t *lock = &item_locks[(hv & hashmask(hashtable_hashpower())) % item_lock_count];
     if (pthread_mutex_trylock(lock) == 0) {
         return lock;
     }
@@ -150,9 +202,9 @@ void item_trylock_unlock(void *lock) {
 }
 
 void item_unlock(uint32_t hv) {
-    uint8_t *lock_type = pthread_getspecific(item_lock_type_key);
+    uint8_t *lock_type = (uint8_t *)pthread_getspecific(item_lock_type_key);
     if (likely(*lock_type == ITEM_LOCK_GRANULAR)) {
-        mutex_unlock(&item_locks[(hv & hashmask(hashpower)) % item_lock_count]);
+        mutex_unlock(&item_locks[(hv & hashmask(hashtable_hashpower())) % item_lock_count]);
     } else {
         mutex_unlock(&item_global_lock);
     }
@@ -172,29 +224,33 @@ static void register_thread_initialized(void) {
 }
 
 void switch_item_lock_type(enum item_lock_types type) {
-    char buf[1];
+    enum conn_queue_item_modes mode;
+    CQ_ITEM *item;
     int i;
 
     switch (type) {
         case ITEM_LOCK_GRANULAR:
-            buf[0] = 'l';
+            mode = queue_lock_granular;
             break;
         case ITEM_LOCK_GLOBAL:
-            buf[0] = 'g';
+            mode = queue_lock_global;
             break;
         default:
             fprintf(stderr, "Unknown lock type: %d\n", type);
             assert(1 == 0);
-            break;
+            return;
     }
 
     pthread_mutex_lock(&init_lock);
     init_count = 0;
     for (i = 0; i < settings.num_threads; i++) {
-        if (write(threads[i].notify_send_fd, buf, 1) != 1) {
-            perror("Failed writing to notify pipe");
-            /* TODO: This is a fatal problem. Can it ever happen temporarily? */
+        /* every worker has to report in, so failing here would hang us */
+        if ((item = cqi_new()) == NULL) {
+            fprintf(stderr, "Failed to allocate memory for lock switch\n");
+            exit(EXIT_FAILURE);
         }
+        item->mode = mode;
+        cq_send(threads[i], item);
     }
     wait_for_thread_registration(settings.num_threads);
     pthread_mutex_unlock(&init_lock);
@@ -204,107 +260,87 @@ void switch_item_lock_type(enum item_lock_types type) {
  * Initializes a connection queue.
  */
 static void cq_init(CQ *cq) {
-    pthread_mutex_init(&cq->lock, NULL);
-    pthread_cond_init(&cq->cond, NULL);
-    cq->head = NULL;
-    cq->tail = NULL;
+    cq->ring = ring_queue_create(CQ_RING_SIZE);
+    if (cq->ring == NULL) {
+        perror("Failed to allocate memory for connection queue");
+        exit(EXIT_FAILURE);
+    }
 }
 
 /*
  * Looks for an item on a connection queue, but doesn't block if there isn't
- * one.
+ * one. Only the worker owning the queue may call this.
  * Returns the item, or NULL if no item is available
  */
 static CQ_ITEM *cq_pop(CQ *cq) {
-    CQ_ITEM *item;
-
-    pthread_mutex_lock(&cq->lock);
-    item = cq->head;
-    if (NULL != item) {
-        cq->head = item->next;
-        if (NULL == cq->head)
-            cq->tail = NULL;
-    }
-    pthread_mutex_unlock(&cq->lock);
-
-    return item;
+    return (CQ_ITEM *)ring_queue_pop(cq->ring);
 }
 
 /*
- * Adds an item to a connection queue.
+ * Called by the worker when it wakes, before it pops the queue empty.
  */
-static void cq_push(CQ *cq, CQ_ITEM *item) {
-    item->next = NULL;
+static void cq_woken(CQ *cq) {
+    ring_queue_woken(cq->ring);
+}
 
-    pthread_mutex_lock(&cq->lock);
-    if (NULL == cq->tail)
-        cq->head = item;
-    else
-        cq->tail->next = item;
-    cq->tail = item;
-    pthread_cond_signal(&cq->cond);
-    pthread_mutex_unlock(&cq->lock);
+/*
+ * Adds an item to a connection queue. If the worker is that far behind,
+ * waits for it to make room rather than drop the connection.
+ * Returns true if the worker has to be woken for it: false when a wakeup
+ * written for an earlier item hasn't been taken yet.
+ */
+static bool cq_push(CQ *cq, CQ_ITEM *item) {
+    while (!ring_queue_push(cq->ring, item))
+        sched_yield();
+    return ring_queue_need_wakeup(cq->ring);
 }
 
 /*
  * Returns a fresh connection queue item.
  */
 static CQ_ITEM *cqi_new(void) {
-    CQ_ITEM *item = NULL;
-    pthread_mutex_lock(&cqi_freelist_lock);
-    if (cqi_freelist) {
-        item = cqi_freelist;
-        cqi_freelist = item->next;
-    }
-    pthread_mutex_unlock(&cqi_freelist_lock);
-
-    if (NULL == item) {
-        int i;
-
-        /* Allocate a bunch of items at once to reduce fragmentation */
-        item = malloc(sizeof(CQ_ITEM) * ITEMS_PER_ALLOC);
-        if (NULL == item)
-            return NULL;
-
-        /*
-         * Link together all the new items except the first one
-         * (which we'll return to the caller) for placement on
-         * the freelist.
-         */
-        for (i = 2; i < ITEMS_PER_ALLOC; i++)
-            item[i - 1].next = &item[i];
-
-        pthread_mutex_lock(&cqi_freelist_lock);
-        item[ITEMS_PER_ALLOC - 1].next = cqi_freelist;
-        cqi_freelist = &item[1];
-        pthread_mutex_unlock(&cqi_freelist_lock);
-    }
-
-    return item;
+    return cqi_pool->alloc();
 }
 
 
 /*
- * Frees a connection queue item (adds it to the freelist.)
+ * Frees a connection queue item (back to this thread's cache.)
  */
 static void cqi_free(CQ_ITEM *item) {
-    pthread_mutex_lock(&cqi_freelist_lock);
-    item->next = cqi_freelist;
-    cqi_freelist = item;
-    pthread_mutex_unlock(&cqi_freelist_lock);
+    cqi_pool->free(item);
+}
+
+
+/*
+ * Queues an item for a worker and wakes it, unless a wakeup it hasn't
+ * taken yet will find the item anyway.
+ */
+static void cq_send(LIBEVENT_THREAD *thread, CQ_ITEM *item) {
+    if (!cq_push(thread->new_conn_queue, item))
+        return;
+    if (notify_send(thread->notify_send_fd) != 0) {
+        perror("Writing to thread notify fd");
+    }
 }
 
 
 /*
  * Creates a worker thread.
  */
-static void create_worker(void *(*func)(void *), void *arg) {
+static void create_worker(void *(*func)(void *), void *arg, int *cpu) {
     pthread_t       thread;
     pthread_attr_t  attr;
     int             ret;
 
     pthread_attr_init(&attr);
 
+    /* pinned from the start, so that all it allocates is on its node */
+    if (*cpu >= 0 && affinity_set_attr(&attr, *cpu) != 0) {
+        fprintf(stderr, "Can't pin thread to CPU %d: %s\n", *cpu,
+                strerror(errno));
+        *cpu = -1;
+    }
+
     if ((ret = pthread_create(&thread, &attr, func, arg)) != 0) {
         fprintf(stderr, "Can't create thread: %s\n",
                 strerror(ret));
@@ -323,10 +359,27 @@ void accept_new_conns(const bool do_accept) {
 /****************************** LIBEVENT THREADS *****************************/
 
 /*
- * Set up a thread's information.
+ * Set up a thread's information. Done by the worker itself, so that the
+ * memory, its stats included, lands on its NUMA node. Nothing reads its
+ * slot in threads before it has registered.
  */
-static void setup_thread(LIBEVENT_THREAD *me) {
-    me->base = event_init();
+static LIBEVENT_THREAD *setup_thread_local(const worker_start *start) {
+    LIBEVENT_THREAD *me = (LIBEVENT_THREAD *)calloc(1, sizeof(LIBEVENT_THREAD));
+    if (me == NULL) {
+        perror("Failed to allocate thread descriptor");
+        exit(EXIT_FAILURE);
+    }
+    me->thread_id = pthread_self();
+    me->index = start->index;
+    me->notify_receive_fd = start->notify_receive_fd;
+    me->notify_send_fd = start->notify_send_fd;
+
+    if (pthread_mutex_init(&me->stats.mutex, NULL) != 0) {
+        perror("Failed to initialize mutex");
+        exit(EXIT_FAILURE);
+    }
+
+    me->base = event_base_new();
     if (! me->base) {
         fprintf(stderr, "Can't allocate event base\n");
         exit(1);
@@ -342,31 +395,29 @@ static void setup_thread(LIBEVENT_THREAD *me) {
         exit(1);
     }
 
-    me->new_conn_queue = malloc(sizeof(struct conn_queue));
+    me->new_conn_queue = (struct conn_queue *)malloc(sizeof(struct conn_queue));
     if (me->new_conn_queue == NULL) {
         perror("Failed to allocate memory for connection queue");
         exit(EXIT_FAILURE);
     }
     cq_init(me->new_conn_queue);
 
-    if (pthread_mutex_init(&me->stats.mutex, NULL) != 0) {
-        perror("Failed to initialize mutex");
-        exit(EXIT_FAILURE);
-    }
-
     me->suffix_cache = cache_create("suffix", SUFFIX_SIZE, sizeof(char*),
                                     NULL, NULL);
     if (me->suffix_cache == NULL) {
         fprintf(stderr, "Failed to create suffix cache\n");
         exit(EXIT_FAILURE);
     }
+
+    threads[me->index] = me;
+    return me;
 }
 
 /*
  * Worker thread: main event loop
  */
 static void *worker_libevent(void *arg) {
-    LIBEVENT_THREAD *me = arg;
+    LIBEVENT_THREAD *me = setup_thread_local((const worker_start *)arg);
 
     /* Any per-thread setup can happen here; thread_init() will block until
      * all threads have finished initializing.
@@ -387,56 +438,107 @@ static void *worker_libevent(void *arg) {
 
 
 /*
- * Processes an incoming "handle a new connection" item. This is called when
- * input arrives on the libevent wakeup pipe.
+ * Processes the items on the connection queue: new connections and lock
+ * type switches. This is called when the libevent notify fd is readable;
+ * one wakeup covers every item queued since the last one.
  */
 static void thread_libevent_process(int fd, short which, void *arg) {
-    LIBEVENT_THREAD *me = arg;
+    LIBEVENT_THREAD *me = (LIBEVENT_THREAD *)arg;
     CQ_ITEM *item;
-    char buf[1];
 
-    if (read(fd, buf, 1) != 1)
+    if (!notify_drain(fd))
         if (settings.verbose > 0)
-            fprintf(stderr, "Can't read from libevent pipe\n");
-
-    switch (buf[0]) {
-    case 'c':
-    item = cq_pop(me->new_conn_queue);
-
-    if (NULL != item) {
-        conn *c = conn_new(item->sfd, item->init_state, item->event_flags,
-                           item->read_buffer_size, item->transport, me->base);
-        if (c == NULL) {
-            if (IS_UDP(item->transport)) {
-                fprintf(stderr, "Can't listen for events on UDP socket\n");
-                exit(1);
-            } else {
-                if (settings.verbose > 0) {
-                    fprintf(stderr, "Can't listen for events on fd %d\n",
-                        item->sfd);
+            fprintf(stderr, "Can't read from libevent notify fd\n");
+
+    cq_woken(me->new_conn_queue);
+
+    while (NULL != (item = cq_pop(me->new_conn_queue))) {
+        switch (item->mode) {
+        case queue_new_conn: {
+            conn *c = conn_new(item->sfd, item->init_state, item->event_flags,
+                               item->read_buffer_size, item->transport, me->base);
+            if (c == NULL) {
+                if (IS_UDP(item->transport)) {
+                    fprintf(stderr, "Can't listen for events on UDP socket\n");
+                    exit(1);
+                } else {
+                    if (settings.verbose > 0) {
+                        fprintf(stderr, "Can't listen for events on fd %d\n",
+                            item->sfd);
+                    }
+                    dispatch_conn_closed(conn_dispatcher, me->index);
+                    close(item->sfd);
                 }
-                close(item->sfd);
+            } else {
+                c->thread = me;
             }
-        } else {
-            c->thread = me;
+            break;
+        }
+        /* we were told to flip the lock type and report in */
+        case queue_lock_granular:
+            me->item_lock_type = ITEM_LOCK_GRANULAR;
+            register_thread_initialized();
+            break;
+        case queue_lock_global:
+            me->item_lock_type = ITEM_LOCK_GLOBAL;
+            register_thread_initialized();
+            break;
         }
         cqi_free(item);
     }
-        break;
-    /* we were told to flip the lock type and report in */
-    case 'l':
-    me->item_lock_type = ITEM_LOCK_GRANULAR;
-    register_thread_initialized();
-        break;
-    case 'g':
-    me->item_lock_type = ITEM_LOCK_GLOBAL;
-    register_thread_initialized();
-        break;
-    }
 }
 
-/* Which thread we assigned a connection to most recently. */
-static int last_thread = -1;
+/*
+ * Sets how new connections are spread over the worker threads; see
+ * dispatch.h. Called before thread_init().
+ */
+void thread_set_dispatch_policy(enum dispatch_policy policy) {
+    conn_dispatch_policy = policy;
+}
+
+/*
+ * Sets the CPUs the worker threads run on: "auto", a CPU list such as
+ * "0-3,8", or "none"; see affinity.h. Called before thread_init().
+ */
+void thread_set_affinity(const char *spec) {
+    worker_affinity = spec;
+}
+
+/*
+ * Called when a connection on this worker closes, so that the dispatch
+ * policy knows what each worker holds.
+ */
+void thread_conn_closed(LIBEVENT_THREAD *me) {
+    dispatch_conn_closed(conn_dispatcher, me->index);
+}
+
+/*
+ * Picks the worker for a new connection. The peer's address, without the
+ * port, is only looked up when the policy hashes it.
+ */
+static int pick_thread(int sfd, enum network_transport transport) {
+    struct sockaddr_storage addr;
+    socklen_t addrlen = sizeof(addr);
+
+    /* each worker gets one of every UDP socket */
+    if (IS_UDP(transport))
+        return dispatch_next(conn_dispatcher);
+
+    if (dispatcher_policy(conn_dispatcher) == DISPATCH_PEER_HASH &&
+        getpeername(sfd, (struct sockaddr *)&addr, &addrlen) == 0) {
+        if (addr.ss_family == AF_INET) {
+            struct sockaddr_in *in = (struct sockaddr_in *)&addr;
+            return dispatch_pick(conn_dispatcher, &in->sin_addr,
+                                 sizeof(in->sin_addr));
+        }
+        if (addr.ss_family == AF_INET6) {
+            struct sockaddr_in6 *in6 = (struct sockaddr_in6 *)&addr;
+            return dispatch_pick(conn_dispatcher, &in6->sin6_addr,
+                                 sizeof(in6->sin6_addr));
+        }
+    }
+    return dispatch_pick(conn_dispatcher, NULL, 0);
+}
 
 /*
  * Dispatches a new connection to another thread. This is only ever called
@@ -446,26 +548,26 @@ static int last_thread = -1;
 void dispatch_conn_new(int sfd, enum conn_states init_state, int event_flags,
                        int read_buffer_size, enum network_transport transport) {
     CQ_ITEM *item = cqi_new();
-    char buf[1];
-    int tid = (last_thread + 1) % settings.num_threads;
+    if (item == NULL) {
+        close(sfd);
+        /* given that malloc failed this may also fail, but let's try */
+        fprintf(stderr, "Failed to allocate memory for connection object\n");
+        return ;
+    }
 
-    LIBEVENT_THREAD *thread = threads + tid;
+    int tid = pick_thread(sfd, transport);
 
-    last_thread = tid;
+    LIBEVENT_THREAD *thread = threads[tid];
 
+    item->mode = queue_new_conn;
     item->sfd = sfd;
     item->init_state = init_state;
     item->event_flags = event_flags;
     item->read_buffer_size = read_buffer_size;
     item->transport = transport;
 
-    cq_push(thread->new_conn_queue, item);
-
     MEMCACHED_CONN_DISPATCH(sfd, thread->thread_id);
-    buf[0] = 'c';
-    if (write(thread->notify_send_fd, buf, 1) != 1) {
-        perror("Writing to thread notify pipe");
-    }
+    cq_send(thread, item);
 }
 
 /*
@@ -659,35 +761,35 @@ void STATS_UNLOCK() {
 void threadlocal_stats_reset(void) {
     int ii, sid;
     for (ii = 0; ii < settings.num_threads; ++ii) {
-        pthread_mutex_lock(&threads[ii].stats.mutex);
-
-        threads[ii].stats.get_cmds = 0;
-        threads[ii].stats.get_misses = 0;
-        threads[ii].stats.touch_cmds = 0;
-        threads[ii].stats.touch_misses = 0;
-        threads[ii].stats.delete_misses = 0;
-        threads[ii].stats.incr_misses = 0;
-        threads[ii].stats.decr_misses = 0;
-        threads[ii].stats.cas_misses = 0;
-        threads[ii].stats.bytes_read = 0;
-        threads[ii].stats.bytes_written = 0;
-        threads[ii].stats.flush_cmds = 0;
-        threads[ii].stats.conn_yields = 0;
-        threads[ii].stats.auth_cmds = 0;
-        threads[ii].stats.auth_errors = 0;
+        pthread_mutex_lock(&threads[ii]->stats.mutex);
+
+        threads[ii]->stats.get_cmds = 0;
+        threads[ii]->stats.get_misses = 0;
+        threads[ii]->stats.touch_cmds = 0;
+        threads[ii]->stats.touch_misses = 0;
+        threads[ii]->stats.delete_misses = 0;
+        threads[ii]->stats.incr_misses = 0;
+        threads[ii]->stats.decr_misses = 0;
+        threads[ii]->stats.cas_misses = 0;
+        threads[ii]->stats.bytes_read = 0;
+        threads[ii]->stats.bytes_written = 0;
+        threads[ii]->stats.flush_cmds = 0;
+        threads[ii]->stats.conn_yields = 0;
+        threads[ii]->stats.auth_cmds = 0;
+        threads[ii]->stats.auth_errors = 0;
 
         for(sid = 0; sid < MAX_NUMBER_OF_SLAB_CLASSES; sid++) {
-            threads[ii].stats.slab_stats[sid].set_cmds = 0;
-            threads[ii].stats.slab_stats[sid].get_hits = 0;
-            threads[ii].stats.slab_stats[sid].touch_hits = 0;
-            threads[ii].stats.slab_stats[sid].delete_hits = 0;
-            threads[ii].stats.slab_stats[sid].incr_hits = 0;
-            threads[ii].stats.slab_stats[sid].decr_hits = 0;
-            threads[ii].stats.slab_stats[sid].cas_hits = 0;
-            threads[ii].stats.slab_stats[sid].cas_badval = 0;
+            threads[ii]->stats.slab_stats[sid].set_cmds = 0;
+            threads[ii]->stats.slab_stats[sid].get_hits = 0;
+            threads[ii]->stats.slab_stats[sid].touch_hits = 0;
+            threads[ii]->stats.slab_stats[sid].delete_hits = 0;
+            threads[ii]->stats.slab_stats[sid].incr_hits = 0;
+            threads[ii]->stats.slab_stats[sid].decr_hits = 0;
+            threads[ii]->stats.slab_stats[sid].cas_hits = 0;
+            threads[ii]->stats.slab_stats[sid].cas_badval = 0;
         }
 
-        pthread_mutex_unlock(&threads[ii].stats.mutex);
+        pthread_mutex_unlock(&threads[ii]->stats.mutex);
     }
 }
 
@@ -699,43 +801,43 @@ void threadlocal_stats_aggregate(struct thread_stats *stats) {
     memset(stats, 0, sizeof(*stats));
 
     for (ii = 0; ii < settings.num_threads; ++ii) {
-        pthread_mutex_lock(&threads[ii].stats.mutex);
-
-        stats->get_cmds += threads[ii].stats.get_cmds;
-        stats->get_misses += threads[ii].stats.get_misses;
-        stats->touch_cmds += threads[ii].stats.touch_cmds;
-        stats->touch_misses += threads[ii].stats.touch_misses;
-        stats->delete_misses += threads[ii].stats.delete_misses;
-        stats->decr_misses += threads[ii].stats.decr_misses;
-        stats->incr_misses += threads[ii].stats.incr_misses;
-        stats->cas_misses += threads[ii].stats.cas_misses;
-        stats->bytes_read += threads[ii].stats.bytes_read;
-        stats->bytes_written += threads[ii].stats.bytes_written;
-        stats->flush_cmds += threads[ii].stats.flush_cmds;
-        stats->conn_yields += threads[ii].stats.conn_yields;
-        stats->auth_cmds += threads[ii].stats.auth_cmds;
-        stats->auth_errors += threads[ii].stats.auth_errors;
+        pthread_mutex_lock(&threads[ii]->stats.mutex);
+
+        stats->get_cmds += threads[ii]->stats.get_cmds;
+        stats->get_misses += threads[ii]->stats.get_misses;
+        stats->touch_cmds += threads[ii]->stats.touch_cmds;
+        stats->touch_misses += threads[ii]->stats.touch_misses;
+        stats->delete_misses += threads[ii]->stats.delete_misses;
+        stats->decr_misses += threads[ii]->stats.decr_misses;
+        stats->incr_misses += threads[ii]->stats.incr_misses;
+        stats->cas_misses += threads[ii]->stats.cas_misses;
+        stats->bytes_read += threads[ii]->stats.bytes_read;
+        stats->bytes_written += threads[ii]->stats.bytes_written;
+        stats->flush_cmds += threads[ii]->stats.flush_cmds;
+        stats->conn_yields += threads[ii]->stats.conn_yields;
+        stats->auth_cmds += threads[ii]->stats.auth_cmds;
+        stats->auth_errors += threads[ii]->stats.auth_errors;
 
         for (sid = 0; sid < MAX_NUMBER_OF_SLAB_CLASSES; sid++) {
             stats->slab_stats[sid].set_cmds +=
-                threads[ii].stats.slab_stats[sid].set_cmds;
+                threads[ii]->stats.slab_stats[sid].set_cmds;
             stats->slab_stats[sid].get_hits +=
-                threads[ii].stats.slab_stats[sid].get_hits;
+                threads[ii]->stats.slab_stats[sid].get_hits;
             stats->slab_stats[sid].touch_hits +=
-                threads[ii].stats.slab_stats[sid].touch_hits;
+                threads[ii]->stats.slab_stats[sid].touch_hits;
             stats->slab_stats[sid].delete_hits +=
-                threads[ii].stats.slab_stats[sid].delete_hits;
+                threads[ii]->stats.slab_stats[sid].delete_hits;
             stats->slab_stats[sid].decr_hits +=
-                threads[ii].stats.slab_stats[sid].decr_hits;
+                threads[ii]->stats.slab_stats[sid].decr_hits;
             stats->slab_stats[sid].incr_hits +=
-                threads[ii].stats.slab_stats[sid].incr_hits;
+                threads[ii]->stats.slab_stats[sid].incr_hits;
             stats->slab_stats[sid].cas_hits +=
-                threads[ii].stats.slab_stats[sid].cas_hits;
+                threads[ii]->stats.slab_stats[sid].cas_hits;
             stats->slab_stats[sid].cas_badval +=
-                threads[ii].stats.slab_stats[sid].cas_badval;
+                threads[ii]->stats.slab_stats[sid].cas_badval;
         }
 
-        pthread_mutex_unlock(&threads[ii].stats.mutex);
+        pthread_mutex_unlock(&threads[ii]->stats.mutex);
     }
 }
 
@@ -772,6 +874,7 @@ void slab_stats_aggregate(struct thread_stats *stats, struct slab_stats *out) {
 void thread_init(int nthreads, struct event_base *main_base) {
     int         i;
     int         power;
+    worker_start *starts;
 
     pthread_mutex_init(&cache_lock, NULL);
     pthread_mutex_init(&stats_lock, NULL);
@@ -779,8 +882,22 @@ void thread_init(int nthreads, struct event_base *main_base) {
     pthread_mutex_init(&init_lock, NULL);
     pthread_cond_init(&init_cond, NULL);
 
-    pthread_mutex_init(&cqi_freelist_lock, NULL);
-    cqi_freelist = NULL;
+    cqi_pool = new ObjectPool<CQ_ITEM>(nthreads * CQI_DEPOT_BATCHES);
+
+    conn_dispatcher = dispatcher_create(nthreads, conn_dispatch_policy);
+    if (conn_dispatcher == NULL) {
+        perror("Can't allocate the connection dispatcher");
+        exit(1);
+    }
+
+    topology = topology_load();
+    worker_cpus = (int *)calloc(nthreads, sizeof(int));
+    if (topology == NULL || worker_cpus == NULL) {
+        perror("Can't allocate the CPU topology");
+        exit(1);
+    }
+    if (affinity_plan(topology, worker_affinity, nthreads, worker_cpus) != 0)
+        exit(1);
 
     /* Want a wide lock table, but don't waste memory */
     if (nthreads < 3) {
@@ -796,19 +913,20 @@ void thread_init(int nthreads, struct event_base *main_base) {
 
     item_lock_count = hashsize(power);
 
-    item_locks = calloc(item_lock_count, sizeof(pthread_mutex_t));
+    item_locks = (pthread_mutex_t *)calloc(item_lock_count, sizeof(pthread_mutex_t));
     if (! item_locks) {
         perror("Can't allocate item locks");
         exit(1);
     }
-    for (i = 0; i < item_lock_count; i++) {
+    for (i = 0; i < (int)item_lock_count; i++) {
         pthread_mutex_init(&item_locks[i], NULL);
     }
     pthread_key_create(&item_lock_type_key, NULL);
     pthread_mutex_init(&item_global_lock, NULL);
 
-    threads = calloc(nthreads, sizeof(LIBEVENT_THREAD));
-    if (! threads) {
+    threads = (LIBEVENT_THREAD **)calloc(nthreads, sizeof(LIBEVENT_THREAD *));
+    starts = (worker_start *)calloc(nthreads, sizeof(worker_start));
+    if (! threads || ! starts) {
         perror("Can't allocate thread descriptors");
         exit(1);
     }
@@ -818,27 +936,30 @@ void thread_init(int nthreads, struct event_base *main_base) {
 
     for (i = 0; i < nthreads; i++) {
         int fds[2];
-        if (pipe(fds)) {
-            perror("Can't create notify pipe");
+        if (notify_open(fds)) {
+            perror("Can't create notify fd");
             exit(1);
         }
 
-        threads[i].notify_receive_fd = fds[0];
-        threads[i].notify_send_fd = fds[1];
-
-        setup_thread(&threads[i]);
-        /* Reserve three fds for the libevent base, and two for the pipe */
-        stats.reserved_fds += 5;
+        starts[i].index = i;
+        starts[i].notify_receive_fd = fds[0];
+        starts[i].notify_send_fd = fds[1];
+        /* Reserve three fds for the libevent base, and the notify fds */
+        stats.reserved_fds += 3 + NOTIFY_FDS;
     }
 
-    /* Create threads after we've done all the libevent setup. */
+    /* Each worker sets up the rest itself; see setup_thread_local(). */
     for (i = 0; i < nthreads; i++) {
-        create_worker(worker_libevent, &threads[i]);
+        create_worker(worker_libevent, &starts[i], &worker_cpus[i]);
     }
 
     /* Wait for all the threads to set themselves up before returning. */
     pthread_mutex_lock(&init_lock);
     wait_for_thread_registration(nthreads);
     pthread_mutex_unlock(&init_lock);
+    free(starts);
+
+    if (worker_affinity != NULL || settings.verbose > 0)
+        affinity_report(stderr, topology, nthreads, worker_cpus);
 }
 
@@ -0,0 +1,495 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * Connection handoff benchmarks.
+ *
+ *   thread_bench [nworkers] [nconns] [affinity]
+ *
+ * Runs the path a new connection takes through thread.cpp, without
+ * libevent: the dispatcher takes a CQ_ITEM off the freelist, pushes it on
+ * the next worker's connection queue round robin and wakes that worker
+ * through its notify pipe; the worker pops the item and frees it. Prints
+ * handoffs per second and the latency from push to pop, for 1, 2, 4 ...
+ * up to nworkers workers, with two queues:
+ *
+ *   mutex  the old CQ: a list under a mutex, a pipe byte per connection
+ *          and one pop per byte
+ *   ring   the ring_queue thread.cpp uses now, with its notify fd (an
+ *          eventfd on Linux): a wakeup only when the worker has none
+ *          pending, and it pops all it finds
+ *
+ * and two ways to get CQ_ITEMs:
+ *
+ *   list   the old freelist under one mutex
+ *   pool   the ObjectPool thread.cpp uses now, with its hit rate and
+ *          depot traffic
+ *
+ * affinity pins the workers as thread.cpp does ("auto", or a CPU list
+ * such as "0-3"; see affinity.h), and the topology is printed first.
+ *
+ * Then simulates each dispatch policy under skewed clients (see
+ * bench_dispatch) and prints the latency percentiles requests see.
+ */
+#include <errno.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include "affinity.h"
+#include "dispatch.h"
+#include "notify.h"
+#include "objpool.h"
+#include "ringqueue.h"
+#include "timewheel.h"
+
+#define ITEMS_PER_ALLOC 64
+#define CQ_RING_SIZE 4096
+
+/* dispatch simulation; a tick is a millisecond */
+#define SIM_WORKERS 8
+#define SIM_HOSTS 64
+#define SIM_TICKS 300000
+#define SIM_WARMUP 30000
+#define SIM_ARRIVAL_EVERY 10        /* ticks between new connections */
+#define SIM_LIFETIME 5000           /* mean ticks a connection lives */
+#define SIM_UTILIZATION 0.7
+#define SIM_HIST 1000000            /* 0.1 ms buckets */
+
+/* An item in the connection queue. */
+typedef struct conn_queue_item CQ_ITEM;
+struct conn_queue_item {
+    int sfd;
+    /* when the dispatcher pushed it, in nanoseconds */
+    unsigned long long pushed;
+    CQ_ITEM *next;
+};
+
+/* A connection queue. */
+typedef struct conn_queue CQ;
+struct conn_queue {
+    CQ_ITEM *head;
+    CQ_ITEM *tail;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+};
+
+typedef struct {
+    pthread_t thread_id;
+    int notify_receive_fd;
+    int notify_send_fd;
+    bool use_ring;
+    CQ new_conn_queue;
+    ring_queue *ring;
+    unsigned long long handled;
+    unsigned long long latency_sum;
+    unsigned long long latency_max;
+} worker_thread;
+
+/* Free list of CQ_ITEM structs */
+static CQ_ITEM *cqi_freelist;
+static pthread_mutex_t cqi_freelist_lock = PTHREAD_MUTEX_INITIALIZER;
+/* used instead of the free list when set */
+static ObjectPool<CQ_ITEM> *cqi_pool;
+/* CPU of each worker, -1 for any; NULL if not pinning */
+static int *worker_cpus;
+
+static unsigned long long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void cq_init(CQ *cq) {
+    pthread_mutex_init(&cq->lock, NULL);
+    pthread_cond_init(&cq->cond, NULL);
+    cq->head = NULL;
+    cq->tail = NULL;
+}
+
+static CQ_ITEM *cq_pop(CQ *cq) {
+    CQ_ITEM *item;
+
+    pthread_mutex_lock(&cq->lock);
+    item = cq->head;
+    if (NULL != item) {
+        cq->head = item->next;
+        if (NULL == cq->head)
+            cq->tail = NULL;
+    }
+    pthread_mutex_unlock(&cq->lock);
+
+    return item;
+}
+
+static void cq_push(CQ *cq, CQ_ITEM *item) {
+    item->next = NULL;
+
+    pthread_mutex_lock(&cq->lock);
+    if (NULL == cq->tail)
+        cq->head = item;
+    else
+        cq->tail->next = item;
+    cq->tail = item;
+    pthread_cond_signal(&cq->cond);
+    pthread_mutex_unlock(&cq->lock);
+}
+
+static CQ_ITEM *cqi_new(void) {
+    CQ_ITEM *item = NULL;
+    int i;
+
+    if (cqi_pool != NULL) {
+        if ((item = cqi_pool->alloc()) == NULL) {
+            fprintf(stderr, "Failed to allocate connection queue items\n");
+            exit(EXIT_FAILURE);
+        }
+        return item;
+    }
+    pthread_mutex_lock(&cqi_freelist_lock);
+    if (cqi_freelist) {
+        item = cqi_freelist;
+        cqi_freelist = item->next;
+    }
+    pthread_mutex_unlock(&cqi_freelist_lock);
+
+    if (NULL == item) {
+        item = (CQ_ITEM *)malloc(sizeof(CQ_ITEM) * ITEMS_PER_ALLOC);
+        if (NULL == item) {
+            fprintf(stderr, "Failed to allocate connection queue items\n");
+            exit(EXIT_FAILURE);
+        }
+        for (i = 2; i < ITEMS_PER_ALLOC; i++)
+            item[i - 1].next = &item[i];
+
+        pthread_mutex_lock(&cqi_freelist_lock);
+        item[ITEMS_PER_ALLOC - 1].next = cqi_freelist;
+        cqi_freelist = &item[1];
+        pthread_mutex_unlock(&cqi_freelist_lock);
+    }
+    return item;
+}
+
+static void cqi_free(CQ_ITEM *item) {
+    if (cqi_pool != NULL) {
+        cqi_pool->free(item);
+        return;
+    }
+    pthread_mutex_lock(&cqi_freelist_lock);
+    item->next = cqi_freelist;
+    cqi_freelist = item;
+    pthread_mutex_unlock(&cqi_freelist_lock);
+}
+
+/* returns false for the stop item */
+static bool handle(worker_thread *me, CQ_ITEM *item) {
+    unsigned long long latency;
+
+    if (item->sfd < 0) {
+        cqi_free(item);
+        return false;
+    }
+    latency = now_ns() - item->pushed;
+    me->handled++;
+    me->latency_sum += latency;
+    if (latency > me->latency_max)
+        me->latency_max = latency;
+    cqi_free(item);
+    return true;
+}
+
+/*
+ * With the mutex queue, reads a byte from the notify pipe and takes one
+ * item, as thread.cpp did; with the ring, waits on the notify fd and takes
+ * all there are.
+ */
+static void *worker(void *arg) {
+    worker_thread *me = (worker_thread *)arg;
+    CQ_ITEM *item;
+    bool running = true;
+    char buf[1];
+    ssize_t n;
+
+    while (running) {
+        if (me->use_ring) {
+            if (notify_wait(me->notify_receive_fd) != 0) {
+                perror("Can't wait on notify fd");
+                exit(EXIT_FAILURE);
+            }
+            ring_queue_woken(me->ring);
+            while (running && NULL != (item = (CQ_ITEM *)ring_queue_pop(me->ring)))
+                running = handle(me, item);
+            continue;
+        }
+        n = read(me->notify_receive_fd, buf, 1);
+        if (n != 1) {
+            if (n < 0 && errno == EINTR)
+                continue;
+            perror("Can't read from notify pipe");
+            exit(EXIT_FAILURE);
+        }
+        item = cq_pop(&me->new_conn_queue);
+        if (NULL != item)
+            running = handle(me, item);
+    }
+    return NULL;
+}
+
+static void dispatch(worker_thread *thread, const int sfd) {
+    CQ_ITEM *item = cqi_new();
+    char buf[1];
+
+    item->sfd = sfd;
+    item->pushed = now_ns();
+    if (thread->use_ring) {
+        while (!ring_queue_push(thread->ring, item))
+            sched_yield();
+        if (ring_queue_need_wakeup(thread->ring) &&
+            notify_send(thread->notify_send_fd) != 0) {
+            perror("Writing to thread notify fd");
+            exit(EXIT_FAILURE);
+        }
+        return;
+    }
+    cq_push(&thread->new_conn_queue, item);
+    buf[0] = 'c';
+    if (write(thread->notify_send_fd, buf, 1) != 1) {
+        perror("Writing to thread notify pipe");
+        exit(EXIT_FAILURE);
+    }
+}
+
+static void bench_handoff(const int nworkers, const unsigned int nconns,
+                          const bool use_ring, const bool use_pool) {
+    worker_thread *threads = (worker_thread *)calloc(nworkers, sizeof(worker_thread));
+    unsigned long long handled = 0, latency_sum = 0, latency_max = 0;
+    unsigned int i;
+    int t, fds[2];
+    double start, elapsed;
+    struct objpool_stats st;
+    pthread_attr_t attr;
+
+    if (threads == NULL) {
+        fprintf(stderr, "Failed to allocate %d workers\n", nworkers);
+        exit(EXIT_FAILURE);
+    }
+    if (use_pool)
+        cqi_pool = new ObjectPool<CQ_ITEM>();
+    for (t = 0; t < nworkers; t++) {
+        if (use_ring ? notify_open(fds) : pipe(fds)) {
+            perror("Can't create notify fd");
+            exit(EXIT_FAILURE);
+        }
+        threads[t].notify_receive_fd = fds[0];
+        threads[t].notify_send_fd = fds[1];
+        threads[t].use_ring = use_ring;
+        cq_init(&threads[t].new_conn_queue);
+        threads[t].ring = ring_queue_create(CQ_RING_SIZE);
+        if (threads[t].ring == NULL) {
+            fprintf(stderr, "Failed to allocate connection queue\n");
+            exit(EXIT_FAILURE);
+        }
+        pthread_attr_init(&attr);
+        if (worker_cpus != NULL && worker_cpus[t] >= 0 &&
+            affinity_set_attr(&attr, worker_cpus[t]) != 0) {
+            perror("Can't pin thread");
+            exit(EXIT_FAILURE);
+        }
+        if (pthread_create(&threads[t].thread_id, &attr, worker, &threads[t]) != 0) {
+            fprintf(stderr, "Can't create thread\n");
+            exit(EXIT_FAILURE);
+        }
+        pthread_attr_destroy(&attr);
+    }
+
+    start = now_ns() / 1e9;
+    for (i = 0; i < nconns; i++)
+        dispatch(&threads[i % nworkers], (int)i);
+    for (t = 0; t < nworkers; t++)
+        dispatch(&threads[t], -1);
+    for (t = 0; t < nworkers; t++)
+        pthread_join(threads[t].thread_id, NULL);
+    elapsed = now_ns() / 1e9 - start;
+
+    for (t = 0; t < nworkers; t++) {
+        handled += threads[t].handled;
+        latency_sum += threads[t].latency_sum;
+        if (threads[t].latency_max > latency_max)
+            latency_max = threads[t].latency_max;
+        fds[0] = threads[t].notify_receive_fd;
+        fds[1] = threads[t].notify_send_fd;
+        notify_close(fds);
+        ring_queue_free(threads[t].ring);
+    }
+    printf("%-5s %-4s %2d workers %8.2f Mhandoffs/s  latency avg %8.1f us  max %8.1f us\n",
+           use_ring ? "ring" : "mutex", use_pool ? "pool" : "list", nworkers,
+           handled / elapsed / 1e6,
+           handled ? latency_sum / 1e3 / handled : 0.0, latency_max / 1e3);
+    if (use_pool) {
+        /* the workers have exited, so their caches are in the depot */
+        cqi_pool->get_stats(&st);
+        printf("           pool: %.1f%% cache hits, %llu depot gets, %llu puts, "
+               "%llu created, %llu released\n",
+               st.allocs ? 100.0 * st.cache_hits / st.allocs : 0.0,
+               st.depot_gets, st.depot_puts, st.created, st.released);
+        delete cqi_pool;
+        cqi_pool = NULL;
+    }
+    free(threads);
+}
+
+static unsigned long long sim_seed;
+
+/* uniform in (0, 1) */
+static double sim_random(void) {
+    sim_seed = sim_seed * 6364136223846793005ULL + 1442695040888963407ULL;
+    return ((sim_seed >> 11) + 0.5) / 9007199254740992.0;
+}
+
+/* Pareto with minimum 1 and shape alpha, capped */
+static double sim_pareto(const double alpha, const double cap) {
+    double x = pow(sim_random(), -1.0 / alpha);
+    return x < cap ? x : cap;
+}
+
+struct sim_conn {
+    double rate;                /* requests per tick */
+    int worker;
+};
+
+/* the tick latency is at or under which the given share of requests saw */
+static double sim_percentile(const double *hist, const double total,
+                             const double share) {
+    double seen = 0;
+    int i;
+
+    for (i = 0; i < SIM_HIST; i++) {
+        seen += hist[i];
+        if (seen >= total * share)
+            return i / 10.0;
+    }
+    return SIM_HIST / 10.0;
+}
+
+/*
+ * Skewed clients in simulated time. SIM_HOSTS client hosts, a few far
+ * heavier than the rest, open a connection every SIM_ARRIVAL_EVERY ticks, each living
+ * SIM_LIFETIME ticks on average and sending requests at its host's rate
+ * times its own, again a few far heavier. Each worker serves as much per
+ * tick as keeps the whole at SIM_UTILIZATION if spread evenly, and queues
+ * the rest; a request waits for the queue ahead of it. With publish_load
+ * workers publish their queue as the dispatch load, which the server
+ * doesn't do (see thread.cpp), so without it two-choices goes by conns as
+ * it does there. Every policy sees the same clients. Latencies of 100 s
+ * and more all count as 100 s.
+ */
+static void bench_dispatch(const enum dispatch_policy policy, const bool publish_load) {
+    double host_rate[SIM_HOSTS], demand[SIM_WORKERS], backlog[SIM_WORKERS];
+    double mean_rate = 0, capacity, total = 0, latency, busiest;
+    double *hist = (double *)calloc(SIM_HIST, sizeof(double));
+    unsigned int nslots = SIM_LIFETIME / SIM_ARRIVAL_EVERY * 4, nfree = 0, n, k;
+    struct sim_conn *conns = (struct sim_conn *)malloc(nslots * sizeof(struct sim_conn));
+    S_UINT32 *free_slots = (S_UINT32 *)malloc(nslots * sizeof(S_UINT32));
+    S_UINT32 keys[256], next_slot = 0, slot, now;
+    char name[32];
+    dispatcher *d = dispatcher_create(SIM_WORKERS, policy);
+    timewheel *wheel = timewheel_create(0);
+    int h, w;
+
+    if (hist == NULL || conns == NULL || free_slots == NULL || d == NULL ||
+        wheel == NULL) {
+        fprintf(stderr, "Failed to allocate the dispatch simulation\n");
+        exit(EXIT_FAILURE);
+    }
+    sim_seed = 42;
+    for (h = 0; h < SIM_HOSTS; h++) {
+        host_rate[h] = sim_pareto(1.5, 50);
+        mean_rate += host_rate[h] / SIM_HOSTS;
+    }
+    /* conn rates are Pareto 2.0, mean 2 */
+    capacity = (double)SIM_LIFETIME / SIM_ARRIVAL_EVERY * mean_rate * 2 /
+        (SIM_WORKERS * SIM_UTILIZATION);
+    memset(demand, 0, sizeof(demand));
+    memset(backlog, 0, sizeof(backlog));
+
+    for (now = 1; now <= SIM_TICKS; now++) {
+        while ((n = timewheel_expire(wheel, now, keys, 256)) > 0) {
+            for (k = 0; k < n; k++) {
+                demand[conns[keys[k]].worker] -= conns[keys[k]].rate;
+                dispatch_conn_closed(d, conns[keys[k]].worker);
+                free_slots[nfree++] = keys[k];
+            }
+        }
+        if (now % SIM_ARRIVAL_EVERY == 0 && (nfree > 0 || next_slot < nslots)) {
+            slot = nfree > 0 ? free_slots[--nfree] : next_slot++;
+            h = (int)(sim_random() * SIM_HOSTS);
+            conns[slot].rate = host_rate[h] * sim_pareto(2.0, 1000);
+            conns[slot].worker = dispatch_pick(d, &h, sizeof(h));
+            demand[conns[slot].worker] += conns[slot].rate;
+            timewheel_add(wheel, slot,
+                          now + 1 + (S_UINT32)(-log(sim_random()) * SIM_LIFETIME));
+        }
+        for (w = 0; w < SIM_WORKERS; w++) {
+            backlog[w] += demand[w];
+            if (now > SIM_WARMUP && demand[w] > 0) {
+                latency = backlog[w] / capacity;
+                hist[latency * 10 < SIM_HIST ? (int)(latency * 10) : SIM_HIST - 1] += demand[w];
+                total += demand[w];
+            }
+            backlog[w] = backlog[w] > capacity ? backlog[w] - capacity : 0;
+            if (publish_load)
+                dispatch_set_load(d, w, (S_UINT32)backlog[w]);
+        }
+    }
+
+    snprintf(name, sizeof(name), "%s%s", dispatch_policy_name(policy),
+             publish_load ? "+load" : "");
+    busiest = 0;
+    for (w = 0; w < SIM_WORKERS; w++)
+        if (demand[w] > busiest)
+            busiest = demand[w];
+    printf("%-17s latency p50 %8.1f ms  p99 %8.1f ms  p99.9 %8.1f ms  "
+           "busiest worker at %3.0f%%\n",
+           name, sim_percentile(hist, total, 0.5),
+           sim_percentile(hist, total, 0.99), sim_percentile(hist, total, 0.999),
+           100.0 * busiest / capacity);
+    timewheel_free(wheel);
+    dispatcher_free(d);
+    free(free_slots);
+    free(conns);
+    free(hist);
+}
+
+int main(int argc, char **argv) {
+    int nworkers = argc > 1 ? atoi(argv[1]) : 4;
+    unsigned int nconns = argc > 2 ? atoi(argv[2]) : 1000000;
+    cpu_topology *topology = NULL;
+    int n;
+
+    if (argc > 3) {
+        topology = topology_load();
+        worker_cpus = (int *)calloc(nworkers, sizeof(int));
+        if (topology == NULL || worker_cpus == NULL) {
+            fprintf(stderr, "Failed to allocate the CPU topology\n");
+            exit(EXIT_FAILURE);
+        }
+        if (affinity_plan(topology, argv[3], nworkers, worker_cpus) != 0)
+            exit(EXIT_FAILURE);
+        affinity_report(stdout, topology, nworkers, worker_cpus);
+    }
+    for (n = 1; n <= nworkers; n *= 2) {
+        bench_handoff(n, nconns, false, false);
+        bench_handoff(n, nconns, true, false);
+        bench_handoff(n, nconns, true, true);
+    }
+    bench_dispatch(DISPATCH_ROUND_ROBIN, false);
+    bench_dispatch(DISPATCH_LEAST_CONNS, false);
+    bench_dispatch(DISPATCH_TWO_CHOICES, false);
+    bench_dispatch(DISPATCH_TWO_CHOICES, true);
+    bench_dispatch(DISPATCH_PEER_HASH, false);
+    topology_free(topology);
+    free(worker_cpus);
+    return 0;
+}
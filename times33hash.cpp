@@ -1,12 +1,28 @@
 #include "times33hash.h"
+#include "times33hash_test.h"
+
+#include <pthread.h>
+#include <string.h>
 
 /*
-  for single char
+  h = h*33 + c is linear, so a long key can be split across lanes: lane j
+  of an accumulator collects every char at positions = j (mod width), each
+  step multiplying the accumulator by 33^width. At the end lane j is
+  weighted by the power of 33 its last char would have had in the serial
+  loop and the lanes are summed. Everything is mod 2^32, exactly like the
+  serial loop, so the result is bit-identical; the tail goes serial.
  */
-S_UINT32 Times33Hash::hash(const S_CHAR *key, S_UINT klen)
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define TIMES33_SIMD 1
+#include <immintrin.h>
+#endif
+
+/* keys shorter than this don't amortize the final lane reduction */
+#define TIMES33_SIMD_MIN 32
+
+template <typename C>
+static S_UINT32 times33(const C *k, S_UINT klen, S_UINT32 hashval)
 {
-    const S_CHAR* k = key;
-    S_UINT32 hashval = 5381;
     for (; klen>=8; klen-=8) {
         hashval = (hashval<<5) + hashval + *(k++);
         hashval = (hashval<<5) + hashval + *(k++);
@@ -26,36 +42,236 @@ S_UINT32 Times33Hash::hash(const S_CHAR *key, S_UINT klen)
     case 2: hashval = (hashval<<5) + hashval + *(k++);
     case 1: hashval = (hashval<<5) + hashval + *(k++); break;
     case 0: break;
-    }        
+    }
     return hashval;
 }
 
+#ifdef TIMES33_SIMD
+
+/* 33^n mod 2^32 for n = 0..32, filled once before any kernel is chosen */
+static S_UINT32 pow33[33];
+static pthread_once_t pow33_once = PTHREAD_ONCE_INIT;
+
+static void init_pow33(void)
+{
+    int i;
+    pow33[0] = 1;
+    for (i = 1; i <= 32; i++)
+        pow33[i] = pow33[i - 1] * 33;
+}
+
+template <typename C> static inline bool char_is_signed(void) { return (C)-1 < 0; }
+
+/* SSE2 has no 32-bit mullo; build it from the two 32x32->64 multiplies */
+__attribute__((target("sse2")))
+static inline __m128i mullo32_sse2(__m128i a, __m128i b)
+{
+    __m128i even = _mm_mul_epu32(a, b);
+    __m128i odd = _mm_mul_epu32(_mm_srli_epi64(a, 32), _mm_srli_epi64(b, 32));
+    return _mm_unpacklo_epi32(_mm_shuffle_epi32(even, _MM_SHUFFLE(0, 0, 2, 0)),
+                              _mm_shuffle_epi32(odd, _MM_SHUFFLE(0, 0, 2, 0)));
+}
+
+/* four chars widened to 32-bit lanes the way the serial loop promotes them */
+template <typename C>
+__attribute__((target("sse2")))
+static inline __m128i load4_sse2(const C *p)
+{
+    const __m128i zero = _mm_setzero_si128();
+    __m128i x;
+
+    if (sizeof(C) == 1) {
+        int v;
+        memcpy(&v, p, 4);
+        x = _mm_cvtsi32_si128(v);
+        x = _mm_unpacklo_epi8(x, char_is_signed<C>() ? _mm_cmplt_epi8(x, zero) : zero);
+        return _mm_unpacklo_epi16(x, char_is_signed<C>() ? _mm_srai_epi16(x, 15) : zero);
+    } else if (sizeof(C) == 2) {
+        x = _mm_loadl_epi64((const __m128i *)p);
+        return _mm_unpacklo_epi16(x, char_is_signed<C>() ? _mm_srai_epi16(x, 15) : zero);
+    }
+    return _mm_loadu_si128((const __m128i *)p);
+}
+
+__attribute__((target("sse2")))
+static inline S_UINT32 hsum_sse2(__m128i v)
+{
+    v = _mm_add_epi32(v, _mm_shuffle_epi32(v, _MM_SHUFFLE(1, 0, 3, 2)));
+    v = _mm_add_epi32(v, _mm_shuffle_epi32(v, _MM_SHUFFLE(2, 3, 0, 1)));
+    return (S_UINT32)_mm_cvtsi128_si32(v);
+}
+
+/* 16 chars per step: four accumulators of four lanes */
+template <typename C>
+__attribute__((target("sse2")))
+static S_UINT32 times33_sse2(const C *k, S_UINT klen)
+{
+    const __m128i step = _mm_set1_epi32((int)pow33[16]);
+    __m128i acc0 = _mm_setzero_si128(), acc1 = acc0, acc2 = acc0, acc3 = acc0;
+    __m128i sum;
+    S_UINT32 hashval = 5381;
+
+    for (; klen >= 16; klen -= 16, k += 16) {
+        acc0 = _mm_add_epi32(mullo32_sse2(acc0, step), load4_sse2(k));
+        acc1 = _mm_add_epi32(mullo32_sse2(acc1, step), load4_sse2(k + 4));
+        acc2 = _mm_add_epi32(mullo32_sse2(acc2, step), load4_sse2(k + 8));
+        acc3 = _mm_add_epi32(mullo32_sse2(acc3, step), load4_sse2(k + 12));
+        hashval *= pow33[16];
+    }
+    /* lane j of accumulator a last saw the char 15 - (4a + j) from the end */
+    sum = mullo32_sse2(acc0, _mm_setr_epi32(pow33[15], pow33[14], pow33[13], pow33[12]));
+    sum = _mm_add_epi32(sum, mullo32_sse2(acc1, _mm_setr_epi32(pow33[11], pow33[10], pow33[9], pow33[8])));
+    sum = _mm_add_epi32(sum, mullo32_sse2(acc2, _mm_setr_epi32(pow33[7], pow33[6], pow33[5], pow33[4])));
+    sum = _mm_add_epi32(sum, mullo32_sse2(acc3, _mm_setr_epi32(pow33[3], pow33[2], pow33[1], pow33[0])));
+    hashval += hsum_sse2(sum);
+    return times33(k, klen, hashval);
+}
+
+template <typename C>
+__attribute__((target("avx2")))
+static inline __m256i load8_avx2(const C *p)
+{
+    if (sizeof(C) == 1) {
+        __m128i x = _mm_loadl_epi64((const __m128i *)p);
+        return char_is_signed<C>() ? _mm256_cvtepi8_epi32(x) : _mm256_cvtepu8_epi32(x);
+    } else if (sizeof(C) == 2) {
+        __m128i x = _mm_loadu_si128((const __m128i *)p);
+        return char_is_signed<C>() ? _mm256_cvtepi16_epi32(x) : _mm256_cvtepu16_epi32(x);
+    }
+    return _mm256_loadu_si256((const __m256i *)p);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i weights_avx2(const int top)
+{
+    return _mm256_setr_epi32(pow33[top], pow33[top - 1], pow33[top - 2], pow33[top - 3],
+                             pow33[top - 4], pow33[top - 5], pow33[top - 6], pow33[top - 7]);
+}
+
+/* 32 chars per step: four accumulators of eight lanes */
+template <typename C>
+__attribute__((target("avx2")))
+static S_UINT32 times33_avx2(const C *k, S_UINT klen)
+{
+    const __m256i step = _mm256_set1_epi32((int)pow33[32]);
+    __m256i acc0 = _mm256_setzero_si256(), acc1 = acc0, acc2 = acc0, acc3 = acc0;
+    __m256i sum;
+    __m128i half;
+    S_UINT32 hashval = 5381;
+
+    for (; klen >= 32; klen -= 32, k += 32) {
+        acc0 = _mm256_add_epi32(_mm256_mullo_epi32(acc0, step), load8_avx2(k));
+        acc1 = _mm256_add_epi32(_mm256_mullo_epi32(acc1, step), load8_avx2(k + 8));
+        acc2 = _mm256_add_epi32(_mm256_mullo_epi32(acc2, step), load8_avx2(k + 16));
+        acc3 = _mm256_add_epi32(_mm256_mullo_epi32(acc3, step), load8_avx2(k + 24));
+        hashval *= pow33[32];
+    }
+    sum = _mm256_mullo_epi32(acc0, weights_avx2(31));
+    sum = _mm256_add_epi32(sum, _mm256_mullo_epi32(acc1, weights_avx2(23)));
+    sum = _mm256_add_epi32(sum, _mm256_mullo_epi32(acc2, weights_avx2(15)));
+    sum = _mm256_add_epi32(sum, _mm256_mullo_epi32(acc3, weights_avx2(7)));
+    half = _mm_add_epi32(_mm256_castsi256_si128(sum), _mm256_extracti128_si256(sum, 1));
+    half = _mm_add_epi32(half, _mm_shuffle_epi32(half, _MM_SHUFFLE(1, 0, 3, 2)));
+    half = _mm_add_epi32(half, _mm_shuffle_epi32(half, _MM_SHUFFLE(2, 3, 0, 1)));
+    hashval += (S_UINT32)_mm_cvtsi128_si32(half);
+    return times33(k, klen, hashval);
+}
+
+template <typename C>
+static S_UINT32 times33_serial(const C *k, S_UINT klen)
+{
+    return times33(k, klen, 5381);
+}
+
+typedef S_UINT32 (*times33_char_func)(const S_CHAR *, S_UINT);
+typedef S_UINT32 (*times33_wchar_func)(const S_WCHAR *, S_UINT);
+
+/*
+  Read by every hashing thread and written by times33_use(), so only
+  through the __atomic builtins: a thread that loads a kernel (acquire)
+  also sees the pow33 table filled before it was stored (release).
+ */
+static times33_char_func times33_char_impl = 0;
+static times33_wchar_func times33_wchar_impl = 0;
+
+static void times33_use(times33_char_func char_impl, times33_wchar_func wchar_impl)
+{
+    pthread_once(&pow33_once, init_pow33);
+    __atomic_store_n(&times33_wchar_impl, wchar_impl, __ATOMIC_RELEASE);
+    __atomic_store_n(&times33_char_impl, char_impl, __ATOMIC_RELEASE);
+}
+
+/* picks the widest kernel this CPU runs; racing callers pick the same one */
+static void times33_dispatch(void)
+{
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        times33_use(times33_avx2<S_CHAR>, times33_avx2<S_WCHAR>);
+    else if (__builtin_cpu_supports("sse2"))
+        times33_use(times33_sse2<S_CHAR>, times33_sse2<S_WCHAR>);
+    else
+        times33_use(times33_serial<S_CHAR>, times33_serial<S_WCHAR>);
+}
+
+#endif /* TIMES33_SIMD */
+
+bool times33_set_kernel(const enum times33_kernel kernel)
+{
+#ifdef TIMES33_SIMD
+    __builtin_cpu_init();
+    switch (kernel) {
+    case TIMES33_AVX2:
+        if (! __builtin_cpu_supports("avx2"))
+            return false;
+        times33_use(times33_avx2<S_CHAR>, times33_avx2<S_WCHAR>);
+        return true;
+    case TIMES33_SSE2:
+        if (! __builtin_cpu_supports("sse2"))
+            return false;
+        times33_use(times33_sse2<S_CHAR>, times33_sse2<S_WCHAR>);
+        return true;
+    case TIMES33_SERIAL:
+        times33_use(times33_serial<S_CHAR>, times33_serial<S_WCHAR>);
+        return true;
+    }
+    return false;
+#else
+    return kernel == TIMES33_SERIAL;
+#endif
+}
+
+/*
+  for single char
+ */
+S_UINT32 Times33Hash::hash(const S_CHAR *key, S_UINT klen)
+{
+#ifdef TIMES33_SIMD
+    if (klen >= TIMES33_SIMD_MIN) {
+        times33_char_func impl = __atomic_load_n(&times33_char_impl, __ATOMIC_ACQUIRE);
+        if (! impl) {
+            times33_dispatch();
+            impl = __atomic_load_n(&times33_char_impl, __ATOMIC_ACQUIRE);
+        }
+        return impl(key, klen);
+    }
+#endif
+    return times33(key, klen, 5381);
+}
+
 /*
   for wide char such as chinese, japan.
  */
 S_UINT32 Times33Hash::hash(const S_WCHAR *key, S_UINT klen)
 {
-    const S_WCHAR* k = key;
-    S_UINT32 hashval = 5381;
-    for (; klen>=8; klen-=8) {
-        hashval = (hashval<<5) + hashval + *(k++);
-        hashval = (hashval<<5) + hashval + *(k++);
-        hashval = (hashval<<5) + hashval + *(k++);
-        hashval = (hashval<<5) + hashval + *(k++);
-        hashval = (hashval<<5) + hashval + *(k++);
-        hashval = (hashval<<5) + hashval + *(k++);
-        hashval = (hashval<<5) + hashval + *(k++);
-        hashval = (hashval<<5) + hashval + *(k++);
+#ifdef TIMES33_SIMD
+    if (klen >= TIMES33_SIMD_MIN) {
+        times33_wchar_func impl = __atomic_load_n(&times33_wchar_impl, __ATOMIC_ACQUIRE);
+        if (! impl) {
+            times33_dispatch();
+            impl = __atomic_load_n(&times33_wchar_impl, __ATOMIC_ACQUIRE);
+        }
+        return impl(key, klen);
     }
-    switch(klen) {
-    case 7: hashval = (hashval<<5) + hashval + *(k++);
-    case 6: hashval = (hashval<<5) + hashval + *(k++);
-    case 5: hashval = (hashval<<5) + hashval + *(k++);
-    case 4: hashval = (hashval<<5) + hashval + *(k++);
-    case 3: hashval = (hashval<<5) + hashval + *(k++);
-    case 2: hashval = (hashval<<5) + hashval + *(k++);
-    case 1: hashval = (hashval<<5) + hashval + *(k++); break;
-    case 0: break;
-    }        
-    return hashval;
+#endif
+    return times33(key, klen, 5381);
 }
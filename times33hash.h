@@ -1,7 +1,7 @@
 #ifndef TIMES33HASH_H
 #define TIMES33HASH_H
 
-#include "win.h"
+#include "portable.h"
 
 class Times33Hash {
 public:
@@ -9,5 +9,4 @@ public:
     static S_UINT32 hash(const S_WCHAR *key, S_UINT klen);    
 };
 
-
 #endif
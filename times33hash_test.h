@@ -0,0 +1,20 @@
+#ifndef TIMES33HASH_TEST_H
+#define TIMES33HASH_TEST_H
+
+#include "times33hash.h"
+
+/*
+  For hash_test only, not for servers: Times33Hash runs long keys through
+  the widest kernel the CPU runs, and every kernel gives the serial loop's
+  result. This picks one instead, for every thread; false if this CPU or
+  build can't run it.
+ */
+enum times33_kernel {
+    TIMES33_SERIAL = 0,
+    TIMES33_SSE2,
+    TIMES33_AVX2
+};
+
+bool times33_set_kernel(const enum times33_kernel kernel);
+
+#endif
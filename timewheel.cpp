@@ -0,0 +1,168 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * Hierarchical timing wheel.
+ *
+ * An entry due within TIMEWHEEL_SLOTS ticks sits in the level 0 slot of its
+ * tick. One due later sits at the lowest level whose span covers it, in the
+ * slot its time falls in at that level. Whenever the clock crosses a
+ * level's slot boundary that slot is emptied and its entries placed again,
+ * now closer; a level 0 slot is emptied into the due list when its tick
+ * comes. Slots are growable arrays.
+ */
+#include "timewheel.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+typedef struct {
+    S_UINT32 key;
+    S_UINT32 when;
+} tw_entry;
+
+typedef struct {
+    tw_entry *entries;
+    unsigned int n;
+    unsigned int cap;
+} tw_slot;
+
+struct timewheel {
+    S_UINT32 now;
+    tw_slot slots[TIMEWHEEL_LEVELS][TIMEWHEEL_SLOTS];
+    /* fired entries; those before due_pos have been handed out */
+    tw_slot due;
+    unsigned int due_pos;
+    size_t pending;
+};
+
+/* ticks a slot at this level spans */
+#define level_span(level) ((S_UINT64)1 << (TIMEWHEEL_BITS * (level)))
+#define slot_index(when, level) \
+    (((when) >> (TIMEWHEEL_BITS * (level))) & (TIMEWHEEL_SLOTS - 1))
+
+static void slot_push(tw_slot *s, const tw_entry *e) {
+    if (s->n == s->cap) {
+        unsigned int cap = s->cap ? s->cap * 2 : 8;
+        tw_entry *entries = (tw_entry *)realloc(s->entries, cap * sizeof(tw_entry));
+        if (entries == NULL) {
+            perror("Can't grow timing wheel slot");
+            exit(EXIT_FAILURE);
+        }
+        s->entries = entries;
+        s->cap = cap;
+    }
+    s->entries[s->n++] = *e;
+}
+
+static void place(timewheel *w, const tw_entry *e) {
+    S_UINT64 delta;
+    S_UINT32 when = e->when;
+    int level = 0;
+
+    if (when <= w->now) {
+        slot_push(&w->due, e);
+        return;
+    }
+    delta = when - w->now;
+    while (level < TIMEWHEEL_LEVELS - 1 && delta >= level_span(level + 1))
+        level++;
+    if (delta >= level_span(TIMEWHEEL_LEVELS)) {
+        /* out of range: park as far out as the top level reaches */
+        when = w->now + (S_UINT32)(level_span(TIMEWHEEL_LEVELS) - 1);
+    }
+    slot_push(&w->slots[level][slot_index(when, level)], e);
+}
+
+timewheel *timewheel_create(const S_UINT32 now) {
+    timewheel *w = (timewheel *)calloc(1, sizeof(timewheel));
+
+    if (w == NULL) {
+        perror("Can't allocate timing wheel");
+        exit(EXIT_FAILURE);
+    }
+    w->now = now;
+    return w;
+}
+
+void timewheel_free(timewheel *w) {
+    int level, i;
+
+    if (w == NULL)
+        return;
+    for (level = 0; level < TIMEWHEEL_LEVELS; level++) {
+        for (i = 0; i < TIMEWHEEL_SLOTS; i++)
+            free(w->slots[level][i].entries);
+    }
+    free(w->due.entries);
+    free(w);
+}
+
+void timewheel_add(timewheel *w, const S_UINT32 key, const S_UINT32 when) {
+    tw_entry e;
+
+    e.key = key;
+    e.when = when;
+    place(w, &e);
+    w->pending++;
+}
+
+/* one tick: cascade every level whose boundary we crossed, then fire */
+static void tick(timewheel *w) {
+    tw_slot *s;
+    unsigned int i;
+    int level;
+
+    w->now++;
+    for (level = 1; level < TIMEWHEEL_LEVELS; level++) {
+        tw_slot moving;
+
+        if (w->now & (level_span(level) - 1))
+            break;
+        s = &w->slots[level][slot_index(w->now, level)];
+        moving = *s;
+        memset(s, 0, sizeof(*s));
+        for (i = 0; i < moving.n; i++)
+            place(w, &moving.entries[i]);
+        free(moving.entries);
+    }
+
+    s = &w->slots[0][slot_index(w->now, 0)];
+    if (s->n == 0)
+        return;
+    if (w->due_pos == w->due.n) {
+        /* nothing waiting: take the slot's array as it is */
+        free(w->due.entries);
+        w->due = *s;
+        w->due_pos = 0;
+        memset(s, 0, sizeof(*s));
+        return;
+    }
+    for (i = 0; i < s->n; i++)
+        slot_push(&w->due, &s->entries[i]);
+    s->n = 0;
+}
+
+unsigned int timewheel_expire(timewheel *w, const S_UINT32 now,
+                              S_UINT32 *keys, const unsigned int max) {
+    unsigned int n = 0;
+
+    while (w->now < now) {
+        if (w->pending == w->due.n - w->due_pos) {
+            /* the wheel itself is empty; no slot to pass on the way */
+            w->now = now;
+            break;
+        }
+        tick(w);
+    }
+
+    while (n < max && w->due_pos < w->due.n)
+        keys[n++] = w->due.entries[w->due_pos++].key;
+    if (w->due_pos == w->due.n)
+        w->due.n = w->due_pos = 0;
+    w->pending -= n;
+    return n;
+}
+
+size_t timewheel_pending(const timewheel *w) {
+    return w->pending;
+}
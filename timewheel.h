@@ -0,0 +1,41 @@
+#ifndef TIMEWHEEL_H
+#define TIMEWHEEL_H
+
+#include <stddef.h>
+#include "portable.h"
+
+/*
+  Hierarchical timing wheel.
+
+  Holds (key, when) pairs and hands the keys back once the wheel's clock
+  reaches when. Level 0 has TIMEWHEEL_SLOTS one-tick slots; each level
+  above has as many slots, every one as wide as the whole level below.
+  Adding is O(1), advancing a tick is O(1) plus the entries of any slot
+  that cascades down a level. Times past the top level park in its last
+  slot and are placed again when it cascades.
+
+  Keys are opaque and may be handed back after they stopped meaning
+  anything; the caller checks. Not thread safe.
+ */
+
+#define TIMEWHEEL_BITS 6
+#define TIMEWHEEL_SLOTS (1 << TIMEWHEEL_BITS)
+#define TIMEWHEEL_LEVELS 4
+
+typedef struct timewheel timewheel;
+
+/* a wheel whose clock starts at now */
+timewheel *timewheel_create(const S_UINT32 now);
+void timewheel_free(timewheel *w);
+void timewheel_add(timewheel *w, const S_UINT32 key, const S_UINT32 when);
+/*
+ * Advances the clock to now and moves up to max due keys into keys,
+ * returning how many. Keys left over are returned by the next call, so a
+ * caller can drain a burst in small steps.
+ */
+unsigned int timewheel_expire(timewheel *w, const S_UINT32 now,
+                              S_UINT32 *keys, const unsigned int max);
+/* entries added and not yet returned */
+size_t timewheel_pending(const timewheel *w);
+
+#endif
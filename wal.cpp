@@ -0,0 +1,525 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * Write-ahead log with group commit.
+ */
+#include "wal.h"
+#include "hash.h"
+#include "slabs.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+#define WAL_BYTE_ORDER 0x01020304
+
+struct wal {
+    char *path;
+    char *old_path;
+    int fd;
+    struct wal_settings settings;
+
+    pthread_mutex_t lock;
+    pthread_cond_t work;        /* for the flusher: records wait, or stop */
+    pthread_cond_t space;       /* for appenders: the buffer was swapped out */
+    pthread_cond_t synced;      /* for wal_commit(): durable moved on */
+    pthread_t flusher;
+
+    /*
+     * Appenders fill buf[active] while the flusher writes out the other.
+     * A buffer grows only while it is empty and being filled, for a record
+     * bigger than it.
+     */
+    char *buf[2];
+    size_t cap[2];
+    int active;
+    size_t used;
+    /* an appender waits for room, so sync without waiting for a group */
+    bool full;
+    /* the flusher has the other buffer out of the lock */
+    bool flushing;
+    bool stop;
+    /* when the oldest waiting record was appended, in microseconds */
+    S_UINT64 first;
+
+    /* log positions: bytes appended since wal_open() */
+    S_UINT64 appended;
+    S_UINT64 durable;
+    struct wal_stats stats;
+};
+
+static S_UINT64 now_us(void) {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (S_UINT64)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+static S_UINT32 record_checksum(const struct wal_record *r, const S_CHAR *key,
+                                const S_CHAR *value) {
+    S_UINT32 h = hash((const char *)r + sizeof(r->checksum),
+                      sizeof(*r) - sizeof(r->checksum), 0);
+    h = hash(key, r->nkey, h);
+    return hash(value, r->nvalue, h);
+}
+
+static S_UINT64 wall_exptime(const rel_time_t exptime) {
+    rel_time_t now;
+
+    if (exptime == 0)
+        return 0;
+    now = hashtable_current_time();
+    /* already expired: any time in the past will do */
+    if (exptime <= now)
+        return 1;
+    return (S_UINT64)time(NULL) + (exptime - now);
+}
+
+static void write_all(const int fd, const char *buf, size_t len, const char *path) {
+    ssize_t n;
+
+    while (len > 0) {
+        n = write(fd, buf, len);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            fprintf(stderr, "Failed to write %s: %s\n", path, strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        buf += n;
+        len -= n;
+    }
+}
+
+static void sync_fd(const int fd, const char *path) {
+    if (fdatasync(fd) != 0) {
+        fprintf(stderr, "Failed to sync %s: %s\n", path, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+}
+
+/*
+ * Swaps the buffers and writes out the full one with the lock dropped, so
+ * appenders go on filling the other. Called with the lock held.
+ */
+static void flush_locked(wal *w) {
+    char *buf = w->buf[w->active];
+    size_t n = w->used;
+    S_UINT64 target = w->appended;
+
+    w->active ^= 1;
+    w->used = 0;
+    w->full = false;
+    w->flushing = true;
+    pthread_cond_broadcast(&w->space);
+    pthread_mutex_unlock(&w->lock);
+
+    write_all(w->fd, buf, n, w->path);
+    sync_fd(w->fd, w->path);
+
+    pthread_mutex_lock(&w->lock);
+    w->flushing = false;
+    w->durable = target;
+    w->stats.syncs++;
+    pthread_cond_broadcast(&w->synced);
+}
+
+static void *wal_flusher(void *arg) {
+    wal *w = (wal *)arg;
+    struct timespec ts;
+    S_UINT64 deadline;
+
+    pthread_mutex_lock(&w->lock);
+    for (;;) {
+        while (w->used == 0 && ! w->stop)
+            pthread_cond_wait(&w->work, &w->lock);
+        if (w->used == 0)
+            break;
+        /* let a group gather behind the oldest record */
+        deadline = w->first + w->settings.sync_interval_us;
+        while (! w->stop && ! w->full && w->used < w->settings.sync_bytes &&
+               now_us() < deadline) {
+            ts.tv_sec = deadline / 1000000;
+            ts.tv_nsec = (deadline % 1000000) * 1000;
+            pthread_cond_timedwait(&w->work, &w->lock, &ts);
+        }
+        /* wal_rotate() may have written it out meanwhile */
+        if (w->used > 0)
+            flush_locked(w);
+    }
+    pthread_mutex_unlock(&w->lock);
+    return NULL;
+}
+
+void wal_settings_init(struct wal_settings *settings) {
+    settings->sync_interval_us = WAL_SYNC_INTERVAL_DEFAULT;
+    settings->sync_bytes = WAL_SYNC_BYTES_DEFAULT;
+    settings->buffer_size = WAL_BUFFER_SIZE_DEFAULT;
+}
+
+/* opens path for appending and writes the header if it is new */
+static int open_log(const char *path) {
+    struct wal_header h;
+    struct stat st;
+    int fd = open(path, O_RDWR | O_CREAT | O_APPEND, 0644);
+
+    if (fd < 0) {
+        fprintf(stderr, "Failed to open %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    if (fstat(fd, &st) != 0) {
+        fprintf(stderr, "Failed to stat %s: %s\n", path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    if (st.st_size == 0) {
+        memset(&h, 0, sizeof(h));
+        memcpy(h.magic, WAL_MAGIC, sizeof(h.magic));
+        h.version = WAL_VERSION;
+        h.byte_order = WAL_BYTE_ORDER;
+        write_all(fd, (const char *)&h, sizeof(h), path);
+        sync_fd(fd, path);
+    } else if (pread(fd, &h, sizeof(h), 0) != sizeof(h) ||
+               memcmp(h.magic, WAL_MAGIC, sizeof(h.magic)) != 0 ||
+               h.version != WAL_VERSION || h.byte_order != WAL_BYTE_ORDER) {
+        fprintf(stderr, "%s is not a version %u log of this byte order\n",
+                path, WAL_VERSION);
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static void wal_free(wal *w) {
+    free(w->buf[0]);
+    free(w->buf[1]);
+    free(w->old_path);
+    free(w->path);
+    free(w);
+}
+
+wal *wal_open(const char *path, const struct wal_settings *settings) {
+    size_t len = strlen(path);
+    wal *w = (wal *)calloc(1, sizeof(wal));
+
+    if (w == NULL) {
+        fprintf(stderr, "Failed to allocate log\n");
+        return NULL;
+    }
+    w->settings = *settings;
+    if (w->settings.buffer_size == 0)
+        w->settings.buffer_size = WAL_BUFFER_SIZE_DEFAULT;
+    w->path = (char *)malloc(len + 1);
+    w->old_path = (char *)malloc(len + sizeof(".old"));
+    w->buf[0] = (char *)malloc(w->settings.buffer_size);
+    w->buf[1] = (char *)malloc(w->settings.buffer_size);
+    if (w->path == NULL || w->old_path == NULL || w->buf[0] == NULL || w->buf[1] == NULL) {
+        fprintf(stderr, "Failed to allocate log\n");
+        wal_free(w);
+        return NULL;
+    }
+    w->cap[0] = w->cap[1] = w->settings.buffer_size;
+    memcpy(w->path, path, len + 1);
+    memcpy(w->old_path, path, len);
+    memcpy(w->old_path + len, ".old", sizeof(".old"));
+
+    w->fd = open_log(path);
+    if (w->fd < 0) {
+        wal_free(w);
+        return NULL;
+    }
+    pthread_mutex_init(&w->lock, NULL);
+    pthread_cond_init(&w->work, NULL);
+    pthread_cond_init(&w->space, NULL);
+    pthread_cond_init(&w->synced, NULL);
+    if (pthread_create(&w->flusher, NULL, wal_flusher, w) != 0) {
+        fprintf(stderr, "Can't create log flusher thread\n");
+        close(w->fd);
+        pthread_cond_destroy(&w->synced);
+        pthread_cond_destroy(&w->space);
+        pthread_cond_destroy(&w->work);
+        pthread_mutex_destroy(&w->lock);
+        wal_free(w);
+        return NULL;
+    }
+    return w;
+}
+
+void wal_close(wal *w) {
+    pthread_mutex_lock(&w->lock);
+    w->stop = true;
+    pthread_cond_signal(&w->work);
+    pthread_mutex_unlock(&w->lock);
+    pthread_join(w->flusher, NULL);
+
+    close(w->fd);
+    pthread_cond_destroy(&w->synced);
+    pthread_cond_destroy(&w->space);
+    pthread_cond_destroy(&w->work);
+    pthread_mutex_destroy(&w->lock);
+    wal_free(w);
+}
+
+static S_UINT64 append(wal *w, struct wal_record *r, const S_CHAR *key,
+                       const S_CHAR *value) {
+    size_t len = sizeof(*r) + r->nkey + r->nvalue;
+    char *grown, *p;
+    S_UINT64 pos;
+
+    r->reserved = 0;
+    r->checksum = record_checksum(r, key, value);
+
+    pthread_mutex_lock(&w->lock);
+    while (w->used + len > w->cap[w->active]) {
+        if (w->used == 0) {
+            grown = (char *)realloc(w->buf[w->active], len);
+            if (grown == NULL) {
+                fprintf(stderr, "Failed to allocate a %lu byte log record\n",
+                        (unsigned long)len);
+                exit(EXIT_FAILURE);
+            }
+            w->buf[w->active] = grown;
+            w->cap[w->active] = len;
+            break;
+        }
+        w->full = true;
+        pthread_cond_signal(&w->work);
+        pthread_cond_wait(&w->space, &w->lock);
+    }
+    p = w->buf[w->active] + w->used;
+    memcpy(p, r, sizeof(*r));
+    memcpy(p + sizeof(*r), key, r->nkey);
+    /* a remove has no value, and NULL for it */
+    if (r->nvalue)
+        memcpy(p + sizeof(*r) + r->nkey, value, r->nvalue);
+    if (w->used == 0) {
+        w->first = now_us();
+        pthread_cond_signal(&w->work);
+    }
+    w->used += len;
+    if (w->used >= w->settings.sync_bytes)
+        pthread_cond_signal(&w->work);
+    w->appended += len;
+    pos = w->appended;
+    w->stats.records++;
+    w->stats.bytes += len;
+    pthread_mutex_unlock(&w->lock);
+    return pos;
+}
+
+S_UINT64 wal_append_insert(wal *w, const S_CHAR *key, const S_UINT nkey,
+                           const S_CHAR *value, const S_UINT32 nvalue,
+                           const rel_time_t exptime, const S_UINT32 hv) {
+    struct wal_record r;
+
+    r.type = WAL_INSERT;
+    r.hv = hv;
+    r.nkey = nkey;
+    r.nvalue = nvalue;
+    r.exptime = wall_exptime(exptime);
+    return append(w, &r, key, value);
+}
+
+S_UINT64 wal_append_remove(wal *w, const S_CHAR *key, const S_UINT nkey,
+                           const S_UINT32 hv) {
+    struct wal_record r;
+
+    r.type = WAL_REMOVE;
+    r.hv = hv;
+    r.nkey = nkey;
+    r.nvalue = 0;
+    r.exptime = 0;
+    return append(w, &r, key, NULL);
+}
+
+void wal_commit(wal *w) {
+    S_UINT64 target;
+
+    pthread_mutex_lock(&w->lock);
+    target = w->appended;
+    while (w->durable < target)
+        pthread_cond_wait(&w->synced, &w->lock);
+    pthread_mutex_unlock(&w->lock);
+}
+
+int wal_rotate(wal *w) {
+    int fd, ret = 0;
+
+    pthread_mutex_lock(&w->lock);
+    /* the flusher never starts a write while the lock is held */
+    while (w->flushing)
+        pthread_cond_wait(&w->synced, &w->lock);
+    if (w->used > 0) {
+        write_all(w->fd, w->buf[w->active], w->used, w->path);
+        w->used = 0;
+        w->full = false;
+        pthread_cond_broadcast(&w->space);
+    }
+    sync_fd(w->fd, w->path);
+    w->durable = w->appended;
+    w->stats.syncs++;
+    pthread_cond_broadcast(&w->synced);
+
+    if (access(w->old_path, F_OK) == 0) {
+        /* its snapshot never happened; both logs are still needed */
+    } else if (rename(w->path, w->old_path) != 0) {
+        fprintf(stderr, "Failed to rename %s to %s: %s\n", w->path,
+                w->old_path, strerror(errno));
+        ret = -1;
+    } else {
+        fd = open_log(w->path);
+        if (fd < 0) {
+            /* go on appending to the rotated log */
+            ret = -1;
+        } else {
+            close(w->fd);
+            w->fd = fd;
+        }
+    }
+    pthread_mutex_unlock(&w->lock);
+    return ret;
+}
+
+int wal_drop_rotated(wal *w) {
+    if (unlink(w->old_path) != 0 && errno != ENOENT) {
+        fprintf(stderr, "Failed to remove %s: %s\n", w->old_path, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+void wal_get_stats(wal *w, struct wal_stats *st) {
+    pthread_mutex_lock(&w->lock);
+    *st = w->stats;
+    pthread_mutex_unlock(&w->lock);
+}
+
+/* takes key out of ht and frees it, if it is there */
+static void replay_remove(HashTable *ht, const S_CHAR *key, const S_UINT nkey,
+                          const S_UINT32 hv) {
+    item *it = ht->find(key, nkey, hv);
+
+    if (it != NULL) {
+        ht->remove(key, nkey, hv);
+        slabs_item_free(it);
+    }
+}
+
+static int replay_record(HashTable *ht, const struct wal_record *r,
+                         const S_CHAR *key, const S_UINT64 wall, const rel_time_t now) {
+    rel_time_t exptime;
+    item *it;
+
+    replay_remove(ht, key, r->nkey, r->hv);
+    if (r->type == WAL_REMOVE || (r->exptime != 0 && r->exptime <= wall))
+        return 0;
+    exptime = r->exptime ? now + (rel_time_t)(r->exptime - wall) : 0;
+    if (ht->inline_keys())
+        it = slabs_item_alloc_inline(key, r->nkey, r->nvalue, exptime);
+    else
+        it = slabs_item_alloc(key, r->nkey, r->nvalue, exptime);
+    if (it == NULL) {
+        fprintf(stderr, "Failed to allocate a replayed item\n");
+        return -1;
+    }
+    memcpy(ITEM_value(it), key + r->nkey, r->nvalue);
+    ht->insert(it, r->hv);
+    return 0;
+}
+
+/* the records of one log file; 0 if there is no such file */
+static long replay_file(const char *path, HashTable *ht) {
+    S_UINT64 wall = time(NULL), off, len;
+    rel_time_t now = hashtable_current_time();
+    const struct wal_header *h;
+    struct wal_record r;
+    const S_CHAR *key;
+    struct stat st;
+    long n = 0;
+    char *base;
+    int fd = open(path, O_RDWR);
+
+    if (fd < 0) {
+        if (errno == ENOENT)
+            return 0;
+        fprintf(stderr, "Failed to open %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        close(fd);
+        return 0;
+    }
+    base = (char *)mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (base == MAP_FAILED) {
+        fprintf(stderr, "Failed to map %s: %s\n", path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    madvise(base, st.st_size, MADV_SEQUENTIAL);
+    h = (const struct wal_header *)base;
+    if ((size_t)st.st_size < sizeof(*h) ||
+        memcmp(h->magic, WAL_MAGIC, sizeof(h->magic)) != 0 ||
+        h->version != WAL_VERSION || h->byte_order != WAL_BYTE_ORDER) {
+        fprintf(stderr, "%s is not a version %u log of this byte order\n",
+                path, WAL_VERSION);
+        n = -1;
+    }
+
+    for (off = sizeof(*h); n >= 0 && off + sizeof(r) <= (S_UINT64)st.st_size; off += len) {
+        memcpy(&r, base + off, sizeof(r));
+        len = sizeof(r) + (S_UINT64)r.nkey + r.nvalue;
+        key = base + off + sizeof(r);
+        if ((r.type != WAL_INSERT && r.type != WAL_REMOVE) ||
+            off + len > (S_UINT64)st.st_size ||
+            r.checksum != record_checksum(&r, key, key + r.nkey))
+            break;
+        if (n == 0 && ht->hash_key(key, r.nkey) != r.hv) {
+            fprintf(stderr, "%s was written with another hash function\n", path);
+            n = -1;
+            break;
+        }
+        if (replay_record(ht, &r, key, wall, now) != 0) {
+            n = -1;
+            break;
+        }
+        n++;
+    }
+    munmap(base, st.st_size);
+
+    if (n >= 0 && off < (S_UINT64)st.st_size) {
+        fprintf(stderr, "%s: cutting off a torn record at %llu\n", path, off);
+        if (ftruncate(fd, off) != 0) {
+            fprintf(stderr, "Failed to truncate %s: %s\n", path, strerror(errno));
+            n = -1;
+        }
+    }
+    close(fd);
+    return n;
+}
+
+long wal_replay(const char *path, HashTable *ht) {
+    size_t len = strlen(path);
+    char *old_path = (char *)malloc(len + sizeof(".old"));
+    long n, total;
+
+    if (old_path == NULL) {
+        fprintf(stderr, "Failed to allocate log path\n");
+        return -1;
+    }
+    memcpy(old_path, path, len);
+    memcpy(old_path + len, ".old", sizeof(".old"));
+    total = replay_file(old_path, ht);
+    free(old_path);
+    if (total < 0)
+        return -1;
+    n = replay_file(path, ht);
+    if (n < 0)
+        return -1;
+    return total + n;
+}
@@ -0,0 +1,127 @@
+#ifndef WAL_H
+#define WAL_H
+
+#include <stddef.h>
+#include "hashtable.h"
+
+/*
+  Write-ahead log of hashtable inserts and removes, for the changes made
+  since the last snapshot.
+
+  Appenders copy their record into one shared buffer under a mutex and go
+  on; a flusher thread writes the buffer out and syncs it, group commit:
+  whatever every thread appended since the last sync goes out with one
+  write() and one fdatasync(). It syncs once sync_bytes are waiting or
+  the oldest waiting record is sync_interval_us old, whichever is first.
+  wal_commit() waits for the next sync that covers what has been appended,
+  for callers that must not go on before their change is durable.
+
+  The file is a header and then records, each a struct wal_record, the key
+  and, for an insert, the value. Every record has a checksum, so replay
+  stops at a record torn by a crash and cuts it off; only the records
+  after the last sync can be lost. Exptimes are wall clock seconds.
+
+  Replaying an insert replaces the key and replaying a remove of a key
+  that isn't there does nothing, so replaying older records again is
+  harmless. To checkpoint with a snapshot:
+
+      wal_rotate(w);             (the log so far becomes path.old)
+      snapshot_write(ht, snap);
+      wal_drop_rotated(w);       (covered by the snapshot)
+
+  and on startup, snapshot_load(), then wal_replay() (path.old, then
+  path), then wal_open().
+ */
+
+#define WAL_MAGIC "HTWAL\0\0"
+#define WAL_VERSION 1
+
+#define WAL_SYNC_INTERVAL_DEFAULT 1000     /* microseconds */
+#define WAL_SYNC_BYTES_DEFAULT (256 * 1024)
+#define WAL_BUFFER_SIZE_DEFAULT (4 * 1024 * 1024)
+
+struct wal_header {
+    char magic[8];              /* WAL_MAGIC */
+    S_UINT32 version;           /* WAL_VERSION */
+    S_UINT32 byte_order;        /* 0x01020304 as the writer stored it */
+};
+
+enum wal_record_type {
+    WAL_INSERT = 1,
+    WAL_REMOVE = 2
+};
+
+struct wal_record {
+    /* hash() chained over the rest of the record, then the key and value */
+    S_UINT32 checksum;
+    S_UINT32 type;
+    S_UINT32 hv;
+    S_UINT32 nkey;
+    S_UINT32 nvalue;            /* 0 for a remove */
+    S_UINT32 reserved;
+    S_UINT64 exptime;           /* wall clock seconds, 0 for never */
+};
+
+struct wal_settings {
+    /* longest a record waits for its sync; 0 syncs as soon as any wait */
+    unsigned int sync_interval_us;
+    /* sync sooner once this much waits */
+    size_t sync_bytes;
+    /* room for records waiting; appenders block while it is full */
+    size_t buffer_size;
+};
+
+struct wal_stats {
+    S_UINT64 records;
+    S_UINT64 bytes;             /* appended, header not counted */
+    S_UINT64 syncs;
+};
+
+typedef struct wal wal;
+
+/* WAL_*_DEFAULT */
+void wal_settings_init(struct wal_settings *settings);
+
+/*
+ * Opens path for appending, creating it if needed, and starts the flusher.
+ * An existing log must have been through wal_replay() first, which cuts
+ * off a torn tail. Returns NULL after printing why.
+ */
+wal *wal_open(const char *path, const struct wal_settings *settings);
+/* syncs what is waiting, stops the flusher and closes the file */
+void wal_close(wal *w);
+
+/*
+ * Append a record and return the log position after it. A failed write
+ * or sync is fatal: the log can't promise anything after it.
+ */
+S_UINT64 wal_append_insert(wal *w, const S_CHAR *key, const S_UINT nkey,
+                           const S_CHAR *value, const S_UINT32 nvalue,
+                           const rel_time_t exptime, const S_UINT32 hv);
+S_UINT64 wal_append_remove(wal *w, const S_CHAR *key, const S_UINT nkey,
+                           const S_UINT32 hv);
+/* waits until everything appended so far, by any thread, is synced */
+void wal_commit(wal *w);
+
+/*
+ * Syncs the log and moves it to path.old, starting an empty one at path.
+ * If path.old is still there from a rotation whose snapshot failed, it is
+ * kept and the log goes on as it is, so that nothing goes missing.
+ * Returns 0, or -1 after printing why.
+ */
+int wal_rotate(wal *w);
+/* removes path.old once a snapshot covers it */
+int wal_drop_rotated(wal *w);
+
+void wal_get_stats(wal *w, struct wal_stats *st);
+
+/*
+ * Applies path.old and then path to ht, cutting a torn record off the end
+ * of either. ht must be in no other use and hold only slab items, such as
+ * an empty table or one from snapshot_load(), and not log to a WAL yet:
+ * replaced and removed items are freed with slabs_item_free(). Returns how many records it applied,
+ * or -1 after printing why.
+ */
+long wal_replay(const char *path, HashTable *ht);
+
+#endif
@@ -1,3 +0,0 @@
-#include "win.h"
-
-
@@ -1,20 +0,0 @@
-#ifndef WIN_H
-#define WIN_H
-
-#include <windows.h>
-
-
-// relation to windows
-#define ENDIAN_LITTLE 1
-
-typedef WCHAR S_WCHAR;
-typedef DWORD S_UINT32;
-
-
-// user define
-typedef unsigned int S_UINT;
-typedef char S_CHAR;
-typedef unsigned char S_UINT8;
-typedef unsigned short S_UINT16;
-
-#endif